@@ -0,0 +1,115 @@
+#include "affinity.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace std;
+
+#define AFFINITY_NODE_DIR   "/sys/devices/system/node"
+
+/* parses a kernel cpu list such as "0-3,8,10-11" */
+static vector<int> parse_cpulist(const char *list)
+{
+    vector<int> cpus;
+    while (*list != '\0' && *list != '\n')
+    {
+        char *end;
+        int first = (int)strtol(list, &end, 10);
+        int last = first;
+        if (end == list)
+            break;
+        if (*end == '-')
+            last = (int)strtol(end + 1, &end, 10);
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        list = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+vector<int> affinity_cpus(bool numa)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        perror("Failed to read CPU affinity");
+        return vector<int>();
+    }
+
+    vector<vector<int>> nodes;
+    DIR *dir = numa ? opendir(AFFINITY_NODE_DIR) : nullptr;
+    if (dir != nullptr)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9')
+                continue;
+
+            char path[PATH_MAX], list[1024];
+            snprintf(path, sizeof(path), AFFINITY_NODE_DIR "/%s/cpulist", entry->d_name);
+            FILE *file = fopen(path, "r");
+            if (file == nullptr)
+                continue;
+            if (fgets(list, sizeof(list), file) != nullptr)
+            {
+                vector<int> node;
+                for (int cpu : parse_cpulist(list))
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                        node.push_back(cpu);
+                if (!node.empty())
+                    nodes.push_back(node);
+            }
+            fclose(file);
+        }
+        closedir(dir);
+        sort(nodes.begin(), nodes.end());
+    }
+
+    /* without NUMA information every allowed CPU is one node */
+    if (nodes.empty())
+    {
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                nodes[0].push_back(cpu);
+    }
+
+    vector<int> cpus;
+    for (size_t i = 0; cpus.size() < (size_t)CPU_COUNT(&allowed); i++)
+    {
+        bool any = false;
+        for (auto &node : nodes)
+        {
+            if (i < node.size())
+            {
+                cpus.push_back(node[i]);
+                any = true;
+            }
+        }
+        if (!any)
+            break;
+    }
+    return cpus;
+}
+
+bool affinity_pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0)
+    {
+        fprintf(stderr, "Failed to pin thread to CPU %d: %s\n", cpu, strerror(error));
+        return false;
+    }
+    return true;
+}
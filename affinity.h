@@ -0,0 +1,16 @@
+#ifndef HTTP_PROXY_SERVER_AFFINITY_H
+#define HTTP_PROXY_SERVER_AFFINITY_H
+
+#include <vector>
+
+/*
+ * CPUs the process may run on, in the order shards are placed on them. With
+ * numa set the list alternates between NUMA nodes so that consecutive shards
+ * land on different memory nodes.
+ */
+std::vector<int> affinity_cpus(bool numa);
+
+/* pins the calling thread to one CPU */
+bool affinity_pin(int cpu);
+
+#endif //HTTP_PROXY_SERVER_AFFINITY_H
@@ -0,0 +1,364 @@
+/*
+ * Closed-loop load generator. For every concurrency level it runs that many
+ * client threads against the proxy for a fixed time, each sending one request
+ * after the other, and prints RPS, latency percentiles and throughput as JSON.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCH_PROXY_HOST    "127.0.0.1"
+#define BENCH_PROXY_PORT    8090
+#define BENCH_BUFFER_SIZE   65536
+
+using namespace std;
+using bench_clock = chrono::steady_clock;
+
+struct bench_config
+{
+    string proxy_host = BENCH_PROXY_HOST;
+    int proxy_port = BENCH_PROXY_PORT;
+    string url = "http://127.0.0.1:9100/fixed/1024";
+    vector<int> concurrency = {1, 8, 32, 128};
+    double duration = 5;
+    bool keep_alive = true;
+};
+
+struct bench_client
+{
+    const bench_config *config;
+    const string *request;
+    const atomic<bool> *running;
+
+    vector<uint32_t> latencies;     /* microseconds */
+    uint64_t bytes = 0, errors = 0;
+};
+
+/* a blocking connection to the proxy and the bytes read past the last response */
+struct bench_conn
+{
+    int fd = -1;
+    char buffer[BENCH_BUFFER_SIZE];
+    size_t len = 0;
+};
+
+static int connect_proxy(const bench_config *config)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(config->proxy_port);
+    inet_pton(AF_INET, config->proxy_host.c_str(), &address.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    int option = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    return fd;
+}
+
+static bool fill(bench_conn *conn)
+{
+    if (conn->len == BENCH_BUFFER_SIZE)
+        return false;
+    ssize_t received = recv(conn->fd, conn->buffer + conn->len, BENCH_BUFFER_SIZE - conn->len, 0);
+    if (received <= 0)
+        return false;
+    conn->len += received;
+    return true;
+}
+
+static void consume(bench_conn *conn, size_t len)
+{
+    memmove(conn->buffer, conn->buffer + len, conn->len - len);
+    conn->len -= len;
+}
+
+/* reads exactly len body bytes, returns false if the connection ends first */
+static bool skip(bench_conn *conn, size_t len)
+{
+    while (len > 0)
+    {
+        if (conn->len == 0 && !fill(conn))
+            return false;
+        size_t take = min(len, conn->len);
+        consume(conn, take);
+        len -= take;
+    }
+    return true;
+}
+
+static bool read_line(bench_conn *conn, string *line)
+{
+    char *end;
+    while ((end = (char*) memmem(conn->buffer, conn->len, "\r\n", 2)) == nullptr)
+        if (!fill(conn))
+            return false;
+    line->assign(conn->buffer, end - conn->buffer);
+    consume(conn, end + 2 - conn->buffer);
+    return true;
+}
+
+/* reads one response, returns its size or -1; *reusable says whether the connection can carry another */
+static long read_response(bench_conn *conn, bool *reusable)
+{
+    char *end;
+    while ((end = (char*) memmem(conn->buffer, conn->len, "\r\n\r\n", 4)) == nullptr)
+        if (!fill(conn))
+            return -1;
+
+    size_t head_len = end + 4 - conn->buffer;
+    string head(conn->buffer, head_len);
+    consume(conn, head_len);
+
+    int status = 0;
+    if (sscanf(head.c_str(), "HTTP/1.%*d %d", &status) != 1 || status >= 500)
+        return -1;
+
+    const char *length = strcasestr(head.c_str(), "\r\nContent-Length:");
+    bool chunked = strcasestr(head.c_str(), "\r\nTransfer-Encoding: chunked") != nullptr;
+    *reusable = strcasestr(head.c_str(), "\r\nConnection: close") == nullptr;
+    long total = (long)head_len;
+
+    if (chunked)
+    {
+        string line;
+        while (true)
+        {
+            if (!read_line(conn, &line))
+                return -1;
+            size_t size = strtoul(line.c_str(), nullptr, 16);
+            total += line.size() + 2;
+            if (size == 0)
+                break;
+            if (!skip(conn, size + 2))
+                return -1;
+            total += size + 2;
+        }
+        /* trailers end with an empty line */
+        do
+        {
+            if (!read_line(conn, &line))
+                return -1;
+            total += line.size() + 2;
+        } while (!line.empty());
+    }
+    else if (length != nullptr)
+    {
+        size_t size = strtoul(length + strlen("\r\nContent-Length:"), nullptr, 10);
+        if (!skip(conn, size))
+            return -1;
+        total += size;
+    }
+    else
+    {
+        /* delimited by the end of the connection */
+        total += conn->len;
+        conn->len = 0;
+        while (fill(conn))
+        {
+            total += conn->len;
+            conn->len = 0;
+        }
+        *reusable = false;
+    }
+    return total;
+}
+
+static void *run_client(void *input)
+{
+    bench_client *client = (bench_client*)input;
+    bench_conn *conn = new bench_conn();
+
+    while (client->running->load(memory_order_relaxed))
+    {
+        auto start = bench_clock::now();
+        if (conn->fd < 0)
+        {
+            conn->fd = connect_proxy(client->config);
+            conn->len = 0;
+            if (conn->fd < 0)
+            {
+                client->errors++;
+                usleep(1000);
+                continue;
+            }
+        }
+
+        bool reusable = false;
+        long size = -1;
+        if (send(conn->fd, client->request->data(), client->request->size(), MSG_NOSIGNAL) ==
+            (ssize_t)client->request->size())
+            size = read_response(conn, &reusable);
+
+        if (size < 0)
+            client->errors++;
+        else
+        {
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(bench_clock::now() - start);
+            client->latencies.push_back((uint32_t)elapsed.count());
+            client->bytes += size;
+        }
+
+        if (size < 0 || !reusable || !client->config->keep_alive)
+        {
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    }
+
+    if (conn->fd >= 0)
+        close(conn->fd);
+    delete conn;
+    return nullptr;
+}
+
+static uint32_t percentile(const vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static void run_level(const bench_config *config, const string *request, int concurrency, FILE *out, bool last)
+{
+    atomic<bool> running(true);
+    vector<bench_client> clients(concurrency);
+    vector<pthread_t> threads(concurrency);
+
+    auto start = bench_clock::now();
+    for (int i = 0; i < concurrency; i++)
+    {
+        clients[i].config = config;
+        clients[i].request = request;
+        clients[i].running = &running;
+        pthread_create(&threads[i], nullptr, run_client, &clients[i]);
+    }
+
+    usleep((useconds_t)(config->duration * 1000000));
+    running = false;
+    for (int i = 0; i < concurrency; i++)
+        pthread_join(threads[i], nullptr);
+    double elapsed = chrono::duration<double>(bench_clock::now() - start).count();
+
+    vector<uint32_t> latencies;
+    uint64_t bytes = 0, errors = 0;
+    for (auto &client : clients)
+    {
+        latencies.insert(latencies.end(), client.latencies.begin(), client.latencies.end());
+        bytes += client.bytes;
+        errors += client.errors;
+    }
+    sort(latencies.begin(), latencies.end());
+
+    fprintf(out, "    {\"concurrency\": %d, \"requests\": %zu, \"errors\": %lu, \"seconds\": %.3f, "
+                 "\"rps\": %.1f, \"p50_us\": %u, \"p99_us\": %u, \"p999_us\": %u, \"max_us\": %u, "
+                 "\"bytes_per_sec\": %.1f}%s\n",
+            concurrency, latencies.size(), errors, elapsed, latencies.size() / elapsed,
+            percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+            latencies.empty() ? 0 : latencies.back(), bytes / elapsed, last ? "" : ",");
+    fflush(out);
+
+    fprintf(stderr, "c=%d: %.1f req/s, p50 %u us, p99 %u us, %lu errors\n", concurrency, latencies.size() / elapsed,
+            percentile(latencies, 0.5), percentile(latencies, 0.99), errors);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-x proxy_host:port] [-u url] [-c levels] [-d seconds] [-k 0|1] [-o out.json]\n", name);
+    fprintf(stderr, "  levels is a comma separated list of concurrency levels, e.g. 1,8,32,128\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    bench_config config;
+    const char *out_path = nullptr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:u:c:d:k:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'x':
+            {
+                string proxy = optarg;
+                size_t colon = proxy.rfind(':');
+                config.proxy_host = proxy.substr(0, colon);
+                if (colon != string::npos)
+                    config.proxy_port = atoi(proxy.c_str() + colon + 1);
+                break;
+            }
+            case 'u':
+                config.url = optarg;
+                break;
+            case 'c':
+            {
+                config.concurrency.clear();
+                for (char *level = strtok(optarg, ","); level != nullptr; level = strtok(nullptr, ","))
+                    if (atoi(level) > 0)
+                        config.concurrency.push_back(atoi(level));
+                break;
+            }
+            case 'd':
+                config.duration = atof(optarg);
+                break;
+            case 'k':
+                config.keep_alive = atoi(optarg) != 0;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (config.concurrency.empty() || config.duration <= 0 || config.url.compare(0, 7, "http://") != 0)
+        usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t host_end = config.url.find('/', 7);
+    string host = config.url.substr(7, host_end == string::npos ? string::npos : host_end - 7);
+    string request = "GET " + config.url + " HTTP/1.1\r\nHost: " + host + "\r\n" +
+                     (config.keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+
+    FILE *out = stdout;
+    if (out_path != nullptr && (out = fopen(out_path, "w")) == nullptr)
+    {
+        perror("Failed to open output file");
+        exit(errno);
+    }
+
+    fprintf(out, "{\n  \"proxy\": \"%s:%d\", \"url\": \"%s\", \"keep_alive\": %s, \"duration\": %.1f,\n  \"results\": [\n",
+            config.proxy_host.c_str(), config.proxy_port, config.url.c_str(), config.keep_alive ? "true" : "false",
+            config.duration);
+    for (size_t i = 0; i < config.concurrency.size(); i++)
+        run_level(&config, &request, config.concurrency[i], out, i + 1 == config.concurrency.size());
+    fprintf(out, "  ]\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+    return EXIT_SUCCESS;
+}
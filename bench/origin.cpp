@@ -0,0 +1,180 @@
+/*
+ * Local origin server for load tests. Every connection gets its own thread and
+ * may carry any number of keep-alive requests. The path selects the response:
+ *
+ *   /fixed/<bytes>           Content-Length body of the given size
+ *   /chunked/<bytes>         the same body in 4 KB chunks
+ *   /slow/<ms>/<bytes>       a fixed body sent after a delay
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ORIGIN_PORT         9100
+#define ORIGIN_HEAD_MAX     16384
+#define ORIGIN_CHUNK_SIZE   4096
+#define ORIGIN_BODY_MAX     (64 * 1024 * 1024)
+
+using namespace std;
+
+static string body_data;
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+            if (sent < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static bool send_fixed(int fd, size_t size, bool keep_alive)
+{
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n%s\r\n",
+                            size, keep_alive ? "" : "Connection: close\r\n");
+    return send_all(fd, head, head_len) && send_all(fd, body_data.data(), size);
+}
+
+static bool send_chunked(int fd, size_t size, bool keep_alive)
+{
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n%s\r\n",
+                            keep_alive ? "" : "Connection: close\r\n");
+    if (!send_all(fd, head, head_len))
+        return false;
+
+    for (size_t off = 0; off < size; off += ORIGIN_CHUNK_SIZE)
+    {
+        size_t len = size - off < ORIGIN_CHUNK_SIZE ? size - off : ORIGIN_CHUNK_SIZE;
+        char line[32];
+        int line_len = snprintf(line, sizeof(line), "%zx\r\n", len);
+        if (!send_all(fd, line, line_len) || !send_all(fd, body_data.data() + off, len) || !send_all(fd, "\r\n", 2))
+            return false;
+    }
+    return send_all(fd, "0\r\n\r\n", 5);
+}
+
+static bool respond(int fd, const char *path, bool keep_alive)
+{
+    size_t size;
+    long delay;
+
+    if (sscanf(path, "/fixed/%zu", &size) == 1 && size <= ORIGIN_BODY_MAX)
+        return send_fixed(fd, size, keep_alive);
+    if (sscanf(path, "/chunked/%zu", &size) == 1 && size <= ORIGIN_BODY_MAX)
+        return send_chunked(fd, size, keep_alive);
+    if (sscanf(path, "/slow/%ld/%zu", &delay, &size) == 2 && size <= ORIGIN_BODY_MAX)
+    {
+        usleep(delay * 1000);
+        return send_fixed(fd, size, keep_alive);
+    }
+
+    const char *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    return send_all(fd, not_found, strlen(not_found));
+}
+
+static void *serve_connection(void *input)
+{
+    int fd = (int)(intptr_t)input;
+    char *buffer = (char*) malloc(ORIGIN_HEAD_MAX + 1);
+    size_t len = 0;
+
+    while (true)
+    {
+        char *end = nullptr;
+        while ((end = (char*) memmem(buffer, len, "\r\n\r\n", 4)) == nullptr)
+        {
+            if (len == ORIGIN_HEAD_MAX)
+                goto done;
+            ssize_t received = recv(fd, buffer + len, ORIGIN_HEAD_MAX - len, 0);
+            if (received <= 0)
+                goto done;
+            len += received;
+        }
+        buffer[len] = '\0';
+
+        {
+            /* the proxy sends origin-form paths, a direct client may send absolute ones */
+            char method[16], target[2048];
+            if (sscanf(buffer, "%15s %2047s", method, target) != 2)
+                goto done;
+            const char *path = target;
+            if (strncmp(path, "http://", 7) == 0)
+            {
+                path = strchr(path + 7, '/');
+                if (path == nullptr)
+                    path = "/";
+            }
+
+            *end = '\0';
+            bool keep_alive = strcasestr(buffer, "\r\nConnection: close") == nullptr;
+            if (!respond(fd, path, keep_alive) || !keep_alive)
+                goto done;
+        }
+
+        /* request bodies are not expected, keep whatever followed the head */
+        size_t head_len = end + 4 - buffer;
+        memmove(buffer, buffer + head_len, len - head_len);
+        len -= head_len;
+    }
+
+done:
+    free(buffer);
+    close(fd);
+    return nullptr;
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : ORIGIN_PORT;
+
+    signal(SIGPIPE, SIG_IGN);
+    body_data.assign(ORIGIN_BODY_MAX, 'x');
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int option = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(listen_fd, 1024) == -1)
+    {
+        perror("Failed to listen");
+        exit(errno);
+    }
+    fprintf(stderr, "Origin listening on 127.0.0.1:%d\n", port);
+
+    while (true)
+    {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+        pthread_t thread;
+        pthread_create(&thread, nullptr, serve_connection, (void*)(intptr_t)fd);
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,70 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../http_parser.h"
+
+#define BENCH_MAX_HEAD  65536
+
+using namespace std;
+
+static string build_request(int cookies)
+{
+    string request = "GET http://www.example.com/static/js/app.bundle.min.js?v=20240101 HTTP/1.1\r\n"
+                     "Host: www.example.com\r\n"
+                     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+                     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                     "Accept-Language: en-US,en;q=0.5\r\n"
+                     "Accept-Encoding: gzip, deflate\r\n"
+                     "Referer: http://www.example.com/index.html\r\n"
+                     "Proxy-Connection: keep-alive\r\n";
+    request += "Cookie: ";
+    for (int i = 0; i < cookies; i++)
+        request += "session_token_" + to_string(i) + "=3f9a1c0e7b5d42a8b6e1f0c9d8a7b6c5; ";
+    request += "last=1\r\n\r\n";
+    return request;
+}
+
+/* parses the head `iterations` times, feeding it in `chunk` byte reads */
+static double run(const string &request, size_t chunk, long iterations)
+{
+    HttpRequestParser parser(BENCH_MAX_HEAD);
+    size_t checksum = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++)
+    {
+        parser.reset();
+        ParseStatus status = PARSE_INCOMPLETE;
+        for (size_t len = chunk; status == PARSE_INCOMPLETE; len += chunk)
+            status = parser.parse(request.data(), len < request.size() ? len : request.size());
+        if (status != PARSE_DONE)
+        {
+            fprintf(stderr, "Parse failed\n");
+            exit(EXIT_FAILURE);
+        }
+        checksum += parser.num_headers;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    if (checksum == 0)
+        printf("unreachable\n");
+    return iterations / elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+
+    for (int cookies : {0, 10, 50})
+    {
+        string request = build_request(cookies);
+        printf("head %5zu bytes: %10.0f req/s whole, %10.0f req/s in 64 byte reads, %10.0f req/s in 1460 byte reads\n",
+               request.size(), run(request, request.size(), iterations), run(request, 64, iterations),
+               run(request, 1460, iterations));
+    }
+
+    return EXIT_SUCCESS;
+}
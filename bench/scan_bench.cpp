@@ -0,0 +1,110 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../scan.h"
+
+using namespace std;
+
+/* a response head with many cookies followed by the start of its body, as one read returns it */
+static string build_response(int cookies)
+{
+    string response = "HTTP/1.1 200 OK\r\n"
+                      "Date: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+                      "Server: Apache/2.4.57 (Unix)\r\n"
+                      "Cache-Control: private, max-age=0\r\n";
+    for (int i = 0; i < cookies; i++)
+        response += "Set-Cookie: session_token_" + to_string(i) +
+                    "=3f9a1c0e7b5d42a8b6e1f0c9d8a7b6c5; Path=/; HttpOnly; SameSite=Lax\r\n";
+    response += "Content-Type: text/html; charset=utf-8\r\n"
+                "Content-Length: 48213\r\n"
+                "Connection: keep-alive\r\n\r\n";
+    response.append(8192 - response.size() % 8192, 'x');
+    return response;
+}
+
+/* what the proxy did per response before: one strstr over the buffer for every field */
+static size_t lookup_strstr(const char *buffer)
+{
+    size_t checksum = 0;
+    const char *head_end = strstr(buffer, "\r\n\r\n");
+    const char *content_length = strstr(buffer, "Content-Length: ");
+    const char *content_type = strstr(buffer, "Content-Type: ");
+    const char *connection = strstr(buffer, "Connection: ");
+    const char *transfer_encoding = strstr(buffer, "Transfer-Encoding: ");
+
+    checksum += head_end ? head_end - buffer : 0;
+    checksum += content_length ? atoi(content_length + 16) : 0;
+    checksum += content_type ? content_type[14] : 0;
+    checksum += connection ? connection[12] : 0;
+    checksum += transfer_encoding ? 1 : 0;
+    return checksum;
+}
+
+static size_t lookup_scan(const char *buffer, size_t len)
+{
+    http_head_index index;
+    size_t checksum = 0;
+    if (scan_head(buffer, len, &index) == SCAN_MORE)
+        return 0;
+
+    /* all fields in one pass over the index, as the response framer looks them up */
+    static const char *const names[] = {"Content-Length", "Content-Type", "Connection", "Transfer-Encoding"};
+    const char *values[4];
+    size_t value_lens[4];
+    scan_find_headers(&index, names, 4, values, value_lens);
+    const char *content_length = values[0], *content_type = values[1];
+    const char *connection = values[2], *transfer_encoding = values[3];
+
+    checksum += index.head_len - 4;
+    checksum += content_length ? atoi(content_length) : 0;
+    checksum += content_type ? content_type[0] : 0;
+    checksum += connection ? connection[0] : 0;
+    checksum += transfer_encoding ? 1 : 0;
+    return checksum;
+}
+
+template <typename F>
+static double run(long iterations, size_t *checksum, F lookup)
+{
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++)
+        *checksum += lookup();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return iterations / elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    ScanKernel best = scan_best_kernel();
+
+    for (int cookies : {0, 10, 50})
+    {
+        string response = build_response(cookies);
+        const char *buffer = response.c_str();
+        size_t head_len = strstr(buffer, "\r\n\r\n") + 4 - buffer;
+
+        size_t expected = 0, checksum = 0;
+        printf("head %5zu bytes: strstr %10.0f heads/s", head_len,
+               run(iterations, &expected, [&]() { return lookup_strstr(buffer); }));
+
+        for (int kernel = SCAN_SCALAR; kernel <= best; kernel++)
+        {
+            scan_set_kernel((ScanKernel)kernel);
+            checksum = 0;
+            double rate = run(iterations, &checksum, [&]() { return lookup_scan(buffer, response.size()); });
+            printf(", %s %10.0f heads/s", scan_kernel_name((ScanKernel)kernel), rate);
+            if (checksum != expected)
+            {
+                fprintf(stderr, "\n%s kernel disagrees with strstr\n", scan_kernel_name((ScanKernel)kernel));
+                return EXIT_FAILURE;
+            }
+        }
+        printf("\n");
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+#include "buffer_pool.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "libhttp.h"
+
+using namespace std;
+
+BufferPool* BufferPool::instance = nullptr;
+thread_local vector<char*> *BufferPool::local = nullptr;
+
+atomic<size_t> arena_high_water(0);
+atomic<uint64_t> arena_overflows(0);
+
+BufferPool::BufferPool()
+{
+    this->sizes[BUFFER_READ] = LIBHTTP_REQUEST_MAX_SIZE + 1;
+    this->sizes[BUFFER_HEAD] = http_max_head_size + 1;
+    this->sizes[BUFFER_FORWARD] = LIBHTTP_FORWARD_SIZE;
+
+    for (int i = 0; i < BUFFER_CLASSES; i++)
+    {
+        pthread_mutex_init(&this->depots[i].lock, nullptr);
+        this->allocated[i] = this->high_water[i] = this->mallocs[i] = 0;
+    }
+}
+
+BufferPool *BufferPool::getInstance()
+{
+    if (instance == nullptr)
+        instance = new BufferPool();
+    return instance;
+}
+
+char *BufferPool::get(BufferClass type)
+{
+    if (local == nullptr)
+        local = new vector<char*>[BUFFER_CLASSES];
+    vector<char*> &buffers = local[type];
+
+    if (buffers.empty())
+    {
+        depot &shared = this->depots[type];
+        pthread_mutex_lock(&shared.lock);
+        size_t count = shared.buffers.size() < BUFFER_POOL_BATCH ? shared.buffers.size() : BUFFER_POOL_BATCH;
+        buffers.insert(buffers.end(), shared.buffers.end() - count, shared.buffers.end());
+        shared.buffers.resize(shared.buffers.size() - count);
+        pthread_mutex_unlock(&shared.lock);
+    }
+
+    if (!buffers.empty())
+    {
+        char *buffer = buffers.back();
+        buffers.pop_back();
+        return buffer;
+    }
+
+    char *buffer = (char*) malloc(this->sizes[type]);
+    if (buffer == nullptr)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        exit(ENOBUFS);
+    }
+    this->mallocs[type].fetch_add(1, memory_order_relaxed);
+
+    uint64_t count = this->allocated[type].fetch_add(1, memory_order_relaxed) + 1;
+    uint64_t peak = this->high_water[type].load(memory_order_relaxed);
+    while (count > peak && !this->high_water[type].compare_exchange_weak(peak, count, memory_order_relaxed))
+        ;
+    return buffer;
+}
+
+void BufferPool::put(BufferClass type, char *buffer)
+{
+    if (buffer == nullptr)
+        return;
+    if (local == nullptr)
+        local = new vector<char*>[BUFFER_CLASSES];
+    vector<char*> &buffers = local[type];
+
+    buffers.push_back(buffer);
+    if (buffers.size() <= BUFFER_POOL_LOCAL)
+        return;
+
+    /* hand a batch to the threads that allocate, free what the depot has no room for */
+    depot &shared = this->depots[type];
+    pthread_mutex_lock(&shared.lock);
+    while (buffers.size() > BUFFER_POOL_LOCAL - BUFFER_POOL_BATCH && shared.buffers.size() < BUFFER_POOL_DEPOT)
+    {
+        shared.buffers.push_back(buffers.back());
+        buffers.pop_back();
+    }
+    pthread_mutex_unlock(&shared.lock);
+
+    while (buffers.size() > BUFFER_POOL_LOCAL)
+    {
+        free(buffers.back());
+        buffers.pop_back();
+        this->allocated[type].fetch_sub(1, memory_order_relaxed);
+    }
+}
+
+static const char *buffer_class_names[BUFFER_CLASSES] = {"read", "head", "forward"};
+
+void BufferPool::stats(FILE *out)
+{
+    const char **names = buffer_class_names;
+
+    for (int i = 0; i < BUFFER_CLASSES; i++)
+    {
+        pthread_mutex_lock(&this->depots[i].lock);
+        size_t pooled = this->depots[i].buffers.size();
+        pthread_mutex_unlock(&this->depots[i].lock);
+
+        fprintf(out, "%s buffers (%zu bytes): allocated %lu, high water %lu, mallocs %lu, in depot %zu\n",
+                names[i], this->sizes[i], this->allocated[i].load(), this->high_water[i].load(),
+                this->mallocs[i].load(), pooled);
+    }
+    fprintf(out, "Request arena: high water %zu bytes, overflows %lu\n", arena_high_water.load(), arena_overflows.load());
+}
+
+void BufferPool::metrics(FILE *out)
+{
+    fprintf(out, "# TYPE proxy_buffers_allocated gauge\n");
+    for (int i = 0; i < BUFFER_CLASSES; i++)
+        fprintf(out, "proxy_buffers_allocated{class=\"%s\"} %lu\n", buffer_class_names[i], this->allocated[i].load());
+    fprintf(out, "# TYPE proxy_buffer_mallocs_total counter\n");
+    for (int i = 0; i < BUFFER_CLASSES; i++)
+        fprintf(out, "proxy_buffer_mallocs_total{class=\"%s\"} %lu\n", buffer_class_names[i], this->mallocs[i].load());
+    fprintf(out, "# TYPE proxy_arena_overflows_total counter\nproxy_arena_overflows_total %lu\n", arena_overflows.load());
+}
+
+Arena::~Arena()
+{
+    for (char *chunk : this->overflow)
+        free(chunk);
+}
+
+char *Arena::alloc(size_t size)
+{
+    char *data;
+    if (size <= ARENA_BLOCK_SIZE - this->used)
+    {
+        data = this->block + this->used;
+        this->used += size;
+    }
+    else
+    {
+        data = (char*) malloc(size);
+        if (data == nullptr)
+        {
+            fprintf(stderr, "Malloc failed\n");
+            exit(ENOBUFS);
+        }
+        this->overflow.push_back(data);
+        this->overflow_bytes += size;
+        arena_overflows.fetch_add(1, memory_order_relaxed);
+    }
+
+    size_t total = this->used + this->overflow_bytes;
+    size_t peak = arena_high_water.load(memory_order_relaxed);
+    while (total > peak && !arena_high_water.compare_exchange_weak(peak, total, memory_order_relaxed))
+        ;
+    return data;
+}
+
+char *Arena::strdup(const char *str)
+{
+    size_t len = strlen(str);
+    char *copy = this->alloc(len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+Arena::mark_t Arena::mark() const
+{
+    return {this->used, this->overflow.size(), this->overflow_bytes};
+}
+
+void Arena::reset(mark_t mark)
+{
+    while (this->overflow.size() > mark.overflow)
+    {
+        free(this->overflow.back());
+        this->overflow.pop_back();
+    }
+    this->used = mark.used;
+    this->overflow_bytes = mark.overflow_bytes;
+}
@@ -0,0 +1,90 @@
+#ifndef HTTP_PROXY_SERVER_BUFFER_POOL_H
+#define HTTP_PROXY_SERVER_BUFFER_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <pthread.h>
+
+#define BUFFER_POOL_LOCAL   32      /* buffers of a class a thread keeps to itself */
+#define BUFFER_POOL_BATCH   16      /* moved between a thread and the depot at once */
+#define BUFFER_POOL_DEPOT   4096    /* buffers of a class shared by all threads, more are freed */
+#define ARENA_BLOCK_SIZE    512
+
+enum BufferClass
+{
+    BUFFER_READ,        /* LIBHTTP_REQUEST_MAX_SIZE + 1, one read */
+    BUFFER_HEAD,        /* http_max_head_size + 1, a request head being parsed */
+    BUFFER_FORWARD,     /* LIBHTTP_FORWARD_SIZE, requests on their way upstream */
+    BUFFER_CLASSES
+};
+
+/*
+ * Fixed-size I/O buffers. Each thread keeps a few of every class and trades
+ * them with a shared depot in batches, so buffers allocated by workers and
+ * released by relay loops are recycled without a lock per buffer. Buffers are
+ * not zeroed.
+ */
+class BufferPool
+{
+    struct depot
+    {
+        pthread_mutex_t lock;
+        std::vector<char*> buffers;
+    };
+
+    size_t sizes[BUFFER_CLASSES]{};
+    depot depots[BUFFER_CLASSES];
+
+    /* buffers obtained from malloc and not freed yet, whether in use or pooled */
+    std::atomic<uint64_t> allocated[BUFFER_CLASSES];
+    std::atomic<uint64_t> high_water[BUFFER_CLASSES];
+    std::atomic<uint64_t> mallocs[BUFFER_CLASSES];
+
+    static thread_local std::vector<char*> *local;
+    static BufferPool *instance;
+    BufferPool();
+
+public:
+    static BufferPool* getInstance();
+    char *get(BufferClass type);
+    void put(BufferClass type, char *buffer);
+    void stats(FILE *out);
+    void metrics(FILE *out);
+};
+
+/* arena high-water statistics, see Arena */
+extern std::atomic<size_t> arena_high_water;
+extern std::atomic<uint64_t> arena_overflows;
+
+/*
+ * Bump allocator for the strings of one request. Allocations come from an
+ * inline block, larger ones fall back to malloc; reset() drops everything
+ * allocated since a mark at once.
+ */
+class Arena
+{
+    char block[ARENA_BLOCK_SIZE];
+    size_t used = 0;
+    size_t overflow_bytes = 0;
+    std::vector<char*> overflow;
+
+public:
+    struct mark_t
+    {
+        size_t used, overflow, overflow_bytes;
+    };
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    ~Arena();
+
+    char *alloc(size_t size);
+    char *strdup(const char *str);
+    mark_t mark() const;
+    void reset(mark_t mark);
+};
+
+#endif //HTTP_PROXY_SERVER_BUFFER_POOL_H
@@ -0,0 +1,380 @@
+#include "cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+using namespace std;
+
+ResponseCache* ResponseCache::instance = nullptr;
+size_t ResponseCache::memory_budget = CACHE_MEMORY_BUDGET;
+
+ResponseCache::ResponseCache()
+{
+    pthread_mutex_init(&this->lock, nullptr);
+}
+
+ResponseCache *ResponseCache::getInstance()
+{
+    if (instance == nullptr)
+        instance = new ResponseCache();
+    return instance;
+}
+
+string ResponseCache::key(const struct http_request *request)
+{
+    return string(request->host) + ":" + to_string(request->port) + string(request->path.data, request->path.len);
+}
+
+/* finds a comma separated Cache-Control directive, storing its numeric argument if it has one */
+static bool cache_directive(const char *value, const char *name, long *arg)
+{
+    if (value == nullptr)
+        return false;
+
+    size_t name_len = strlen(name);
+    size_t value_len = http_header_value_len(value);
+    const char *end = value + value_len;
+    while (value < end)
+    {
+        while (value < end && (*value == ' ' || *value == ','))
+            value++;
+        if ((size_t)(end - value) >= name_len && strncasecmp(value, name, name_len) == 0 &&
+            (value + name_len == end || value[name_len] == ',' || value[name_len] == ' ' || value[name_len] == '='))
+        {
+            if (arg != nullptr)
+                *arg = value[name_len] == '=' ? atol(value + name_len + 1) : 0;
+            return true;
+        }
+        while (value < end && *value != ',')
+            value++;
+    }
+    return false;
+}
+
+static time_t parse_http_date(const char *value)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (value == nullptr || strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == nullptr)
+        return 0;
+    return timegm(&tm);
+}
+
+bool ResponseCache::cacheable_request(const struct http_stream *stream, const struct http_request *request)
+{
+    const char *headers = request->headers.data;
+    return http_slice_equals(request->method, "GET") && stream->body_remaining == 0 &&
+           http_find_header(headers, "Authorization") == nullptr &&
+           !cache_directive(http_find_header(headers, "Cache-Control"), "no-store", nullptr);
+}
+
+/* decides whether a response may be stored and until when it stays fresh */
+bool ResponseCache::freshness(const char *head, size_t head_len, time_t *expires)
+{
+    int status_code = atoi(head + strlen("HTTP/1.") + 2);
+    if (status_code != OK && status_code != 203 && status_code != MOVED_PERMANENTLY)
+        return false;
+
+    const char *headers = strstr(head, "\r\n");
+    if (headers == nullptr || (size_t)(headers - head) >= head_len)
+        return false;
+    headers += 2;
+
+    const char *vary = http_find_header(headers, "Vary");
+    if (http_find_header(headers, "Set-Cookie") != nullptr || (vary != nullptr && *vary == '*'))
+        return false;
+
+    time_t now = time(nullptr);
+    const char *cache_control = http_find_header(headers, "Cache-Control");
+    long max_age;
+    if (cache_directive(cache_control, "no-store", nullptr) || cache_directive(cache_control, "private", nullptr) ||
+        cache_directive(cache_control, "no-cache", nullptr))
+        return false;
+
+    /* a response that was already old when it arrived has that much less of its lifetime left, RFC 7234 section 4.2.3 */
+    time_t date = parse_http_date(http_find_header(headers, "Date"));
+    const char *age_value = http_find_header(headers, "Age");
+    long age = age_value != nullptr ? strtol(age_value, nullptr, 10) : 0;
+    if (age < 0)
+        age = 0;
+    if (date != 0 && now - date > age)
+        age = now - date;
+
+    if (cache_directive(cache_control, "s-maxage", &max_age) || cache_directive(cache_control, "max-age", &max_age))
+        *expires = now + max_age - age;
+    else
+    {
+        time_t expires_at = parse_http_date(http_find_header(headers, "Expires"));
+        if (expires_at == 0)
+            return false;
+
+        /* Expires is relative to the origin's clock */
+        *expires = now + (expires_at - (date != 0 ? date : now)) - age;
+    }
+
+    return *expires > now;
+}
+
+bool ResponseCache::vary_matches(const cache_vary &vary_values, const char *request_headers)
+{
+    for (auto &vary : vary_values)
+    {
+        const char *value = http_find_header(request_headers, vary.first.c_str());
+        size_t value_len = value != nullptr ? http_header_value_len(value) : 0;
+        if (vary.second.size() != value_len || (value_len > 0 && strncmp(vary.second.c_str(), value, value_len) != 0))
+            return false;
+    }
+    return true;
+}
+
+/* remembers the request header values named by the Vary header of a response head */
+void ResponseCache::vary_values(const char *head, const char *request_headers, cache_vary &vary_values)
+{
+    const char *vary = http_find_header(strstr(head, "\r\n") + 2, "Vary");
+    if (vary == nullptr)
+        return;
+
+    const char *end = vary + http_header_value_len(vary);
+    while (vary < end)
+    {
+        while (vary < end && (*vary == ' ' || *vary == ','))
+            vary++;
+        const char *name_end = vary;
+        while (name_end < end && *name_end != ',' && *name_end != ' ')
+            name_end++;
+        if (name_end == vary)
+            break;
+
+        string name(vary, name_end - vary);
+        const char *value = http_find_header(request_headers, name.c_str());
+        vary_values.emplace_back(name, value != nullptr ? string(value, http_header_value_len(value)) : string());
+        vary = name_end;
+    }
+}
+
+void ResponseCache::remove(const shared_ptr<cache_object> &object)
+{
+    this->used -= object->response.size() + object->key.size() + sizeof(cache_object);
+    this->lru.erase(object->lru);
+
+    auto it = this->objects.find(object->key);
+    vector<shared_ptr<cache_object>> &variants = it->second;
+    for (size_t i = 0; i < variants.size(); i++)
+    {
+        if (variants[i] == object)
+        {
+            variants.erase(variants.begin() + i);
+            break;
+        }
+    }
+    if (variants.empty())
+        this->objects.erase(it);
+}
+
+shared_ptr<const cache_object> ResponseCache::lookup(const string &key, const char *request_headers)
+{
+    /* the client asked for a response validated by the origin */
+    const char *cache_control = http_find_header(request_headers, "Cache-Control");
+    const char *pragma = http_find_header(request_headers, "Pragma");
+    long max_age = -1;
+    bool bypass = cache_directive(cache_control, "no-cache", nullptr) || cache_directive(pragma, "no-cache", nullptr) ||
+                  (cache_directive(cache_control, "max-age", &max_age) && max_age == 0);
+
+    time_t now = time(nullptr);
+    shared_ptr<cache_object> found;
+
+    pthread_mutex_lock(&this->lock);
+    auto it = this->objects.find(key);
+    if (!bypass && it != this->objects.end())
+    {
+        for (auto &object : it->second)
+        {
+            if (!vary_matches(object->vary, request_headers))
+                continue;
+
+            if (object->expires <= now)
+                this->remove(shared_ptr<cache_object>(object));
+            else
+                found = object;
+            break;
+        }
+    }
+
+    if (found)
+    {
+        this->lru.splice(this->lru.begin(), this->lru, found->lru);
+        this->hits++;
+        this->bytes_served += found->response.size();
+    }
+    else
+        this->misses++;
+    pthread_mutex_unlock(&this->lock);
+
+    return found;
+}
+
+void ResponseCache::store(const string &key, const char *request_headers, string &response, size_t head_len, bool keep_alive)
+{
+    time_t expires;
+    if (response.size() > CACHE_MAX_OBJECT || response.size() > memory_budget ||
+        !freshness(response.c_str(), head_len, &expires))
+        return;
+
+    shared_ptr<cache_object> object = make_shared<cache_object>();
+    object->key = key;
+    object->response.swap(response);
+    object->head_len = head_len;
+    object->keep_alive = keep_alive;
+    object->expires = expires;
+
+    vary_values(object->response.c_str(), request_headers, object->vary);
+
+    size_t size = object->response.size() + object->key.size() + sizeof(cache_object);
+
+    pthread_mutex_lock(&this->lock);
+    auto it = this->objects.find(key);
+    if (it != this->objects.end())
+    {
+        for (auto &old : it->second)
+        {
+            if (vary_matches(old->vary, request_headers))
+            {
+                this->remove(shared_ptr<cache_object>(old));
+                break;
+            }
+        }
+    }
+
+    this->objects[key].push_back(object);
+    this->lru.push_front(object);
+    object->lru = this->lru.begin();
+    this->used += size;
+    this->stores++;
+
+    while (this->used > memory_budget)
+    {
+        this->remove(shared_ptr<cache_object>(this->lru.back()));
+        this->evictions++;
+    }
+    pthread_mutex_unlock(&this->lock);
+}
+
+cache_fetch::cache_fetch()
+{
+    pthread_mutex_init(&this->lock, nullptr);
+}
+
+cache_fetch::~cache_fetch()
+{
+    pthread_mutex_destroy(&this->lock);
+}
+
+shared_ptr<cache_fetch> ResponseCache::join(const string &key, bool *leader)
+{
+    pthread_mutex_lock(&this->lock);
+    shared_ptr<cache_fetch> &fetch = this->fetches[key];
+    *leader = !fetch;
+    if (*leader)
+    {
+        fetch = make_shared<cache_fetch>();
+        fetch->key = key;
+    }
+    shared_ptr<cache_fetch> joined = fetch;
+    pthread_mutex_unlock(&this->lock);
+    return joined;
+}
+
+bool ResponseCache::follow(cache_fetch *fetch, const char *request_headers)
+{
+    if (!this->shares(fetch, request_headers, true))
+        return false;
+
+    pthread_mutex_lock(&this->lock);
+    this->collapsed++;
+    pthread_mutex_unlock(&this->lock);
+    return true;
+}
+
+bool ResponseCache::shares(cache_fetch *fetch, const char *request_headers, bool pending)
+{
+    pthread_mutex_lock(&fetch->lock);
+    bool shared = (pending && fetch->state == FETCH_PENDING) ||
+                  (fetch->state == FETCH_SHARED && vary_matches(fetch->vary, request_headers));
+    pthread_mutex_unlock(&fetch->lock);
+    return shared;
+}
+
+bool ResponseCache::give_up(cache_fetch *fetch)
+{
+    pthread_mutex_lock(&fetch->lock);
+    bool pending = fetch->state == FETCH_PENDING;
+    if (pending)
+        fetch->state = FETCH_ALONE;
+    pthread_mutex_unlock(&fetch->lock);
+
+    if (pending)
+        this->forget(fetch);
+    return pending;
+}
+
+void ResponseCache::share(cache_fetch *fetch, const char *head, const char *request_headers)
+{
+    pthread_mutex_lock(&fetch->lock);
+    vary_values(head, request_headers, fetch->vary);
+    fetch->state = FETCH_SHARED;
+    pthread_mutex_unlock(&fetch->lock);
+}
+
+void ResponseCache::abandon(cache_fetch *fetch)
+{
+    pthread_mutex_lock(&fetch->lock);
+    if (fetch->state == FETCH_PENDING)
+        fetch->state = FETCH_ALONE;
+    pthread_mutex_unlock(&fetch->lock);
+    this->forget(fetch);
+}
+
+void ResponseCache::forget(cache_fetch *fetch)
+{
+    pthread_mutex_lock(&this->lock);
+    auto it = this->fetches.find(fetch->key);
+    if (it != this->fetches.end() && it->second.get() == fetch)
+        this->fetches.erase(it);
+    pthread_mutex_unlock(&this->lock);
+}
+
+void ResponseCache::stats(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    uint64_t lookups = this->hits + this->misses;
+    fprintf(out, "Cache hits: %lu, misses: %lu, hit ratio: %f\n",
+            this->hits, this->misses, lookups > 0 ? (double)this->hits / lookups : 0.0);
+    fprintf(out, "Bytes served from cache: %lu\n", this->bytes_served);
+    fprintf(out, "Requests collapsed into another's fetch: %lu, fetches in flight: %zu\n",
+            this->collapsed, this->fetches.size());
+    fprintf(out, "Cached objects: %zu (%zu of %zu bytes), stored: %lu, evictions: %lu\n",
+            this->lru.size(), this->used, memory_budget, this->stores, this->evictions);
+    pthread_mutex_unlock(&this->lock);
+}
+
+void ResponseCache::metrics(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    uint64_t hits = this->hits, misses = this->misses, bytes_served = this->bytes_served;
+    uint64_t stores = this->stores, evictions = this->evictions, collapsed = this->collapsed;
+    size_t objects = this->lru.size(), used = this->used;
+    pthread_mutex_unlock(&this->lock);
+
+    fprintf(out, "# TYPE proxy_cache_lookups_total counter\n");
+    fprintf(out, "proxy_cache_lookups_total{result=\"hit\"} %lu\n", hits);
+    fprintf(out, "proxy_cache_lookups_total{result=\"miss\"} %lu\n", misses);
+    fprintf(out, "# TYPE proxy_cache_served_bytes_total counter\nproxy_cache_served_bytes_total %lu\n", bytes_served);
+    fprintf(out, "# TYPE proxy_cache_stores_total counter\nproxy_cache_stores_total %lu\n", stores);
+    fprintf(out, "# TYPE proxy_cache_collapsed_total counter\nproxy_cache_collapsed_total %lu\n", collapsed);
+    fprintf(out, "# TYPE proxy_cache_evictions_total counter\nproxy_cache_evictions_total %lu\n", evictions);
+    fprintf(out, "# TYPE proxy_cache_objects gauge\nproxy_cache_objects %zu\n", objects);
+    fprintf(out, "# TYPE proxy_cache_bytes gauge\nproxy_cache_bytes %zu\n", used);
+    fprintf(out, "# TYPE proxy_cache_budget_bytes gauge\nproxy_cache_budget_bytes %zu\n", memory_budget);
+}
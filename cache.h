@@ -0,0 +1,116 @@
+#ifndef HTTP_PROXY_SERVER_CACHE_H
+#define HTTP_PROXY_SERVER_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "libhttp.h"
+
+#define CACHE_MEMORY_BUDGET     (64 * 1024 * 1024)
+#define CACHE_MAX_OBJECT        (4 * 1024 * 1024)
+#define CACHE_COLLAPSE_WAIT_MS  3000    /* a request waits this long for another's response head */
+
+class Relay;
+struct relay_conn;
+
+typedef std::vector<std::pair<std::string, std::string>> cache_vary;
+
+struct cache_object
+{
+    std::string key;
+    std::string response;       /* head and body as received from the origin */
+    size_t head_len;
+    bool keep_alive;
+    time_t expires;
+
+    /* request header values the response varies on */
+    cache_vary vary;
+    std::list<std::shared_ptr<cache_object>>::iterator lru;
+};
+
+enum FetchState
+{
+    FETCH_PENDING,      /* the response head has not arrived */
+    FETCH_SHARED,       /* requests for the same object are fed from this response */
+    FETCH_ALONE         /* the response cannot be shared, the others fetch their own */
+};
+
+/* a cacheable response in flight, which later requests for the same object attach to */
+struct cache_fetch
+{
+    std::string key;
+    pthread_mutex_t lock;
+    FetchState state = FETCH_PENDING;
+    cache_vary vary;
+
+    /* the loop the leader and its followers are added to, picked by whichever gets there first */
+    Relay *loop = nullptr;
+
+    /* only touched by that relay loop */
+    std::string data;           /* head and body received so far, never reallocated */
+    bool keep_alive = false;
+    bool complete = false, failed = false;
+    std::vector<relay_conn*> followers;
+
+    /* the response to a pipelined request: its one follower drops what it sent, the fetcher pauses while far ahead */
+    bool pipelined = false;
+    relay_conn *fetcher = nullptr;
+
+    cache_fetch();
+    ~cache_fetch();
+};
+
+/* in-memory LRU cache of fresh GET responses */
+class ResponseCache
+{
+    pthread_mutex_t lock{};
+    std::map<std::string, std::vector<std::shared_ptr<cache_object>>> objects;
+    std::list<std::shared_ptr<cache_object>> lru;
+    size_t used = 0;
+    std::map<std::string, std::shared_ptr<cache_fetch>> fetches;
+
+    uint64_t hits = 0, misses = 0, bytes_served = 0, evictions = 0, stores = 0, collapsed = 0;
+
+    static ResponseCache *instance;
+    ResponseCache();
+
+    void remove(const std::shared_ptr<cache_object> &object);
+
+public:
+    static size_t memory_budget;
+
+    static ResponseCache* getInstance();
+    static std::string key(const struct http_request *request);
+    static bool cacheable_request(const struct http_stream *stream, const struct http_request *request);
+    static bool freshness(const char *head, size_t head_len, time_t *expires);
+    static bool vary_matches(const cache_vary &vary, const char *request_headers);
+    static void vary_values(const char *head, const char *request_headers, cache_vary &vary);
+
+    std::shared_ptr<const cache_object> lookup(const std::string &key, const char *request_headers);
+    void store(const std::string &key, const char *request_headers, std::string &response, size_t head_len, bool keep_alive);
+
+    /* the fetch in flight for key, a new one when leader is set and the caller is to fetch it */
+    std::shared_ptr<cache_fetch> join(const std::string &key, bool *leader);
+    /* false when the caller has to fetch on its own, a follower of a pending fetch waits for the head in the loop */
+    bool follow(cache_fetch *fetch, const char *request_headers);
+    /* the response is shared and matches the request, or pending still when that is enough */
+    bool shares(cache_fetch *fetch, const char *request_headers, bool pending);
+    /* abandons a fetch whose head is later than CACHE_COLLAPSE_WAIT_MS, true if it was pending */
+    bool give_up(cache_fetch *fetch);
+    /* called by the leader once the head shows the response can be shared */
+    void share(cache_fetch *fetch, const char *head, const char *request_headers);
+    /* the response will not be shared (any more), requests arriving now fetch their own */
+    void abandon(cache_fetch *fetch);
+    void forget(cache_fetch *fetch);
+    void stats(FILE *out);
+    void metrics(FILE *out);
+};
+
+#endif //HTTP_PROXY_SERVER_CACHE_H
@@ -0,0 +1,111 @@
+#include "conn_pool.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/socket.h>
+
+using namespace std;
+
+ConnPool* ConnPool::instance = nullptr;
+
+ConnPool::ConnPool()
+{
+    pthread_mutex_init(&this->lock, nullptr);
+}
+
+ConnPool *ConnPool::getInstance()
+{
+    if (instance == nullptr)
+        instance = new ConnPool();
+    return instance;
+}
+
+string ConnPool::key(const char *host, uint16_t port)
+{
+    return string(host) + ":" + to_string(port);
+}
+
+/* an idle upstream must neither be closed nor have sent anything unasked */
+bool ConnPool::is_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int ConnPool::acquire(const char *host, uint16_t port)
+{
+    string k = key(host, port);
+    time_t now = time(nullptr);
+
+    while (true)
+    {
+        pthread_mutex_lock(&this->lock);
+        auto it = this->idle.find(k);
+        if (it == this->idle.end() || it->second.empty())
+        {
+            pthread_mutex_unlock(&this->lock);
+            return -1;
+        }
+        pooled_conn conn = it->second.back();
+        it->second.pop_back();
+        pthread_mutex_unlock(&this->lock);
+
+        if (now - conn.released <= CONN_POOL_IDLE_TIMEOUT && is_alive(conn.fd))
+        {
+            /* handed out as if freshly connected */
+            int flags = fcntl(conn.fd, F_GETFL, 0);
+            if (flags >= 0)
+                fcntl(conn.fd, F_SETFL, flags & ~O_NONBLOCK);
+            return conn.fd;
+        }
+
+        close(conn.fd);
+    }
+}
+
+void ConnPool::release(const char *host, uint16_t port, int fd)
+{
+    int evicted = -1;
+
+    pthread_mutex_lock(&this->lock);
+    deque<pooled_conn> &conns = this->idle[key(host, port)];
+    if (conns.size() >= CONN_POOL_MAX_IDLE)
+    {
+        evicted = conns.front().fd;
+        conns.pop_front();
+    }
+    conns.push_back({fd, time(nullptr)});
+    pthread_mutex_unlock(&this->lock);
+
+    if (evicted >= 0)
+        close(evicted);
+}
+
+void ConnPool::expire()
+{
+    vector<int> expired;
+    time_t now = time(nullptr);
+
+    pthread_mutex_lock(&this->lock);
+    for (auto it = this->idle.begin(); it != this->idle.end();)
+    {
+        deque<pooled_conn> &conns = it->second;
+        while (!conns.empty() && now - conns.front().released > CONN_POOL_IDLE_TIMEOUT)
+        {
+            expired.push_back(conns.front().fd);
+            conns.pop_front();
+        }
+
+        if (conns.empty())
+            it = this->idle.erase(it);
+        else
+            it++;
+    }
+    pthread_mutex_unlock(&this->lock);
+
+    for (int fd : expired)
+        close(fd);
+}
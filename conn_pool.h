@@ -0,0 +1,39 @@
+#ifndef HTTP_PROXY_SERVER_CONN_POOL_H
+#define HTTP_PROXY_SERVER_CONN_POOL_H
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <string>
+#include <pthread.h>
+
+#define CONN_POOL_MAX_IDLE      8
+#define CONN_POOL_IDLE_TIMEOUT  30
+
+struct pooled_conn
+{
+    int fd;
+    time_t released;
+};
+
+/* idle keep-alive connections to origin servers, keyed by host:port */
+class ConnPool
+{
+    pthread_mutex_t lock{};
+    std::map<std::string, std::deque<pooled_conn>> idle;
+
+    static ConnPool *instance;
+    ConnPool();
+
+    static std::string key(const char *host, uint16_t port);
+    static bool is_alive(int fd);
+
+public:
+    static ConnPool* getInstance();
+    int acquire(const char *host, uint16_t port);
+    void release(const char *host, uint16_t port, int fd);
+    void expire();
+};
+
+#endif //HTTP_PROXY_SERVER_CONN_POOL_H
@@ -0,0 +1,302 @@
+#include "connector.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "dns.h"
+#include "libhttp.h"
+
+using namespace std;
+
+Connector* Connector::instance = nullptr;
+
+struct connect_attempt
+{
+    int fd;
+    size_t index;           /* into the ordered addresses */
+    uint64_t deadline;      /* milliseconds */
+};
+
+Connector::Connector()
+{
+    pthread_mutex_init(&this->lock, nullptr);
+}
+
+Connector *Connector::getInstance()
+{
+    if (instance == nullptr)
+        instance = new Connector();
+    return instance;
+}
+
+static bool same_addr(const sockaddr_storage *a, const sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+        return false;
+    if (a->ss_family == AF_INET)
+        return ((const sockaddr_in*)a)->sin_addr.s_addr == ((const sockaddr_in*)b)->sin_addr.s_addr;
+    return memcmp(&((const sockaddr_in6*)a)->sin6_addr, &((const sockaddr_in6*)b)->sin6_addr, sizeof(in6_addr)) == 0;
+}
+
+static uint64_t now_ms()
+{
+    return latency_now() / 1000000;
+}
+
+/* families alternate starting with the resolver's first choice, addresses that failed lately go last */
+vector<sockaddr_storage> Connector::order(const char *host, const vector<sockaddr_storage> &addrs)
+{
+    vector<sockaddr_storage> preferred, other, ordered;
+    for (const sockaddr_storage &addr : addrs)
+    {
+        if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+            continue;
+        if (preferred.empty() || addr.ss_family == preferred[0].ss_family)
+            preferred.push_back(addr);
+        else
+            other.push_back(addr);
+    }
+    for (size_t i = 0; i < preferred.size() || i < other.size(); i++)
+    {
+        if (i < preferred.size())
+            ordered.push_back(preferred[i]);
+        if (i < other.size())
+            ordered.push_back(other[i]);
+    }
+
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&this->lock);
+    auto it = this->failures.find(host);
+    if (it != this->failures.end())
+    {
+        vector<failed_addr> &failed = it->second;
+        failed.erase(remove_if(failed.begin(), failed.end(), [now](const failed_addr &f) { return f.until <= now; }),
+                     failed.end());
+        stable_partition(ordered.begin(), ordered.end(), [&failed](const sockaddr_storage &addr)
+        {
+            for (const failed_addr &f : failed)
+                if (same_addr(&f.addr, &addr))
+                    return false;
+            return true;
+        });
+        if (failed.empty())
+            this->failures.erase(it);
+    }
+    pthread_mutex_unlock(&this->lock);
+    return ordered;
+}
+
+void Connector::record(const char *host, const sockaddr_storage *addr, bool failed)
+{
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&this->lock);
+
+    auto it = this->failures.find(host);
+    if (it == this->failures.end() && failed)
+    {
+        /* when too many hosts are remembered the expired ones are forgotten, new ones are not kept if that fails */
+        if (this->failures.size() >= CONNECT_HOSTS_MAX)
+            for (auto host_it = this->failures.begin(); host_it != this->failures.end();)
+            {
+                bool expired = true;
+                for (const failed_addr &f : host_it->second)
+                    expired = expired && f.until <= now;
+                host_it = expired ? this->failures.erase(host_it) : next(host_it);
+            }
+        if (this->failures.size() < CONNECT_HOSTS_MAX)
+            it = this->failures.emplace(host, vector<failed_addr>()).first;
+    }
+
+    if (it != this->failures.end())
+    {
+        vector<failed_addr> &addrs = it->second;
+        auto known = find_if(addrs.begin(), addrs.end(), [addr](const failed_addr &f) { return same_addr(&f.addr, addr); });
+        if (failed && known != addrs.end())
+            known->until = now + CONNECT_FAILURE_TTL;
+        else if (failed)
+            addrs.push_back({*addr, now + CONNECT_FAILURE_TTL});
+        else if (known != addrs.end())
+            addrs.erase(known);
+        if (addrs.empty())
+            this->failures.erase(it);
+    }
+    pthread_mutex_unlock(&this->lock);
+}
+
+int Connector::connect(const char *host, uint16_t port, const vector<sockaddr_storage> &addrs)
+{
+    vector<sockaddr_storage> ordered = this->order(host, addrs);
+    vector<connect_attempt> pending;
+    size_t next = 0, winner_index = 0;
+    uint64_t next_start = 0, failed = 0, timed_out = 0;
+    int winner = -1;
+
+    while (winner < 0 && (next < ordered.size() || !pending.empty()))
+    {
+        uint64_t now = now_ms();
+        if (next < ordered.size() && (pending.empty() || now >= next_start))
+        {
+            sockaddr_storage addr = ordered[next];
+            socklen_t addr_len = sizeof(sockaddr_in);
+            if (addr.ss_family == AF_INET6)
+            {
+                ((sockaddr_in6*)&addr)->sin6_port = htons(port);
+                addr_len = sizeof(sockaddr_in6);
+            }
+            else
+                ((sockaddr_in*)&addr)->sin_port = htons(port);
+
+            int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fd >= 0 && ::connect(fd, (struct sockaddr*)&addr, addr_len) == 0)
+            {
+                winner = fd;
+                winner_index = next;
+            }
+            else if (fd >= 0 && errno == EINPROGRESS)
+                pending.push_back({fd, next, now + CONNECT_ATTEMPT_TIMEOUT_MS});
+            else
+            {
+                if (fd >= 0)
+                    close(fd);
+                this->record(host, &ordered[next], true);
+                failed++;
+            }
+            next++;
+            next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+            continue;
+        }
+
+        /* until an attempt finishes or times out, or the next one is due */
+        uint64_t wake = next < ordered.size() ? next_start : UINT64_MAX;
+        vector<pollfd> fds;
+        for (const connect_attempt &attempt : pending)
+        {
+            wake = min(wake, attempt.deadline);
+            fds.push_back({attempt.fd, POLLOUT, 0});
+        }
+        int ready = poll(fds.data(), fds.size(), wake > now ? (int)(wake - now) : 0);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        now = now_ms();
+        for (size_t i = pending.size(); i-- > 0;)
+        {
+            connect_attempt attempt = pending[i];
+            bool done = ready > 0 && (fds[i].revents & (POLLOUT | POLLERR | POLLHUP));
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            if (done && getsockopt(attempt.fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+                error = errno;
+
+            if (done && error == 0 && winner < 0)
+            {
+                winner = attempt.fd;
+                winner_index = attempt.index;
+            }
+            else if (done && error == 0)
+                close(attempt.fd);
+            else if (done || now >= attempt.deadline)
+            {
+                close(attempt.fd);
+                this->record(host, &ordered[attempt.index], true);
+                if (done)
+                    failed++;
+                else
+                    timed_out++;
+            }
+            else
+                continue;
+            pending.erase(pending.begin() + i);
+        }
+    }
+
+    /* an address overtaken by one tried after it is tried after the others next time as well */
+    for (const connect_attempt &attempt : pending)
+    {
+        close(attempt.fd);
+        if (attempt.index < winner_index)
+            this->record(host, &ordered[attempt.index], true);
+    }
+
+    if (winner >= 0)
+    {
+        this->record(host, &ordered[winner_index], false);
+        int flags = fcntl(winner, F_GETFL, 0);
+        if (flags >= 0)
+            fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+        http_set_nodelay(winner);
+    }
+
+    pthread_mutex_lock(&this->lock);
+    this->attempts += next;
+    this->failed_attempts += failed;
+    this->timeouts += timed_out;
+    if (winner < 0)
+        this->unreachable++;
+    else
+        this->connections++;
+    if (winner >= 0 && winner_index > 0)
+        this->fallbacks++;
+    pthread_mutex_unlock(&this->lock);
+    return winner;
+}
+
+int Connector::open(const char *host, uint16_t port, latency_trace *trace)
+{
+    vector<sockaddr_storage> addrs;
+    DNSResolver::getInstance()->resolve(host, addrs);
+    trace->dns = latency_now();
+    if (addrs.empty())
+    {
+        fprintf(stderr, "Cannot find host: %s\n", host);
+        return -1;
+    }
+
+    int fd = this->connect(host, port, addrs);
+    if (fd < 0)
+        return -1;
+    trace->connect = latency_now();
+
+    struct timeval timeout;
+    timeout.tv_sec = 30;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+void Connector::stats(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    size_t remembered = 0;
+    for (auto &host : this->failures)
+        remembered += host.second.size();
+    fprintf(out, "Upstream connections: %lu, unreachable: %lu, won by a later address: %lu\n",
+            this->connections, this->unreachable, this->fallbacks);
+    fprintf(out, "Connect attempts: %lu, failed: %lu, timed out: %lu, addresses tried last: %zu\n",
+            this->attempts, this->failed_attempts, this->timeouts, remembered);
+    pthread_mutex_unlock(&this->lock);
+}
+
+void Connector::metrics(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    uint64_t connections = this->connections, unreachable = this->unreachable, fallbacks = this->fallbacks;
+    uint64_t attempts = this->attempts, failed = this->failed_attempts, timeouts = this->timeouts;
+    pthread_mutex_unlock(&this->lock);
+
+    fprintf(out, "# TYPE proxy_upstream_connects_total counter\n");
+    fprintf(out, "proxy_upstream_connects_total{result=\"connected\"} %lu\n", connections);
+    fprintf(out, "proxy_upstream_connects_total{result=\"unreachable\"} %lu\n", unreachable);
+    fprintf(out, "# TYPE proxy_upstream_connect_fallbacks_total counter\nproxy_upstream_connect_fallbacks_total %lu\n",
+            fallbacks);
+    fprintf(out, "# TYPE proxy_upstream_connect_attempts_total counter\nproxy_upstream_connect_attempts_total %lu\n",
+            attempts);
+    fprintf(out, "# TYPE proxy_upstream_connect_attempt_failures_total counter\n");
+    fprintf(out, "proxy_upstream_connect_attempt_failures_total{reason=\"error\"} %lu\n", failed);
+    fprintf(out, "proxy_upstream_connect_attempt_failures_total{reason=\"timeout\"} %lu\n", timeouts);
+}
@@ -0,0 +1,57 @@
+#ifndef HTTP_PROXY_SERVER_CONNECTOR_H
+#define HTTP_PROXY_SERVER_CONNECTOR_H
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "latency.h"
+
+#define CONNECT_ATTEMPT_DELAY_MS    250     /* before the next address is tried alongside (RFC 8305) */
+#define CONNECT_ATTEMPT_TIMEOUT_MS  3000
+#define CONNECT_FAILURE_TTL         30      /* seconds a failed address is tried after the others */
+#define CONNECT_HOSTS_MAX           4096
+
+struct failed_addr
+{
+    sockaddr_storage addr;
+    time_t until;
+};
+
+/*
+ * Opens upstream connections the happy eyeballs way: the addresses of a
+ * host are tried in turn, alternating IPv6 and IPv4, and a new attempt starts
+ * whenever the others have failed or CONNECT_ATTEMPT_DELAY_MS passed without
+ * one succeeding. The first to connect is kept. Addresses that failed or were
+ * overtaken lately are tried last.
+ */
+class Connector
+{
+    pthread_mutex_t lock{};
+    std::map<std::string, std::vector<failed_addr>> failures;     /* by host */
+
+    uint64_t connections = 0, unreachable = 0, fallbacks = 0;
+    uint64_t attempts = 0, failed_attempts = 0, timeouts = 0;
+
+    static Connector *instance;
+    Connector();
+
+    std::vector<sockaddr_storage> order(const char *host, const std::vector<sockaddr_storage> &addrs);
+    void record(const char *host, const sockaddr_storage *addr, bool failed);
+
+public:
+    static Connector* getInstance();
+    /* a connected blocking socket, or -1 once every address failed */
+    int connect(const char *host, uint16_t port, const std::vector<sockaddr_storage> &addrs);
+    /* resolves the host first, then connects with a receive timeout set */
+    int open(const char *host, uint16_t port, latency_trace *trace);
+    void stats(FILE *out);
+    void metrics(FILE *out);
+};
+
+#endif //HTTP_PROXY_SERVER_CONNECTOR_H
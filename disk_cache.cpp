@@ -0,0 +1,681 @@
+#include "disk_cache.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "libhttp.h"
+
+#define DISK_CACHE_MAGIC        0x7865646e49435044ULL   /* "DPCIndex" */
+#define DISK_CACHE_VERSION      1
+#define DISK_RECORD_MAGIC       0x52435044              /* "DPCR" */
+#define DISK_RECORD_MAX_META    65536
+
+using namespace std;
+
+DiskCache* DiskCache::instance = nullptr;
+string DiskCache::directory;
+uint64_t DiskCache::budget = DISK_CACHE_BUDGET;
+
+disk_segment::~disk_segment()
+{
+    close(this->fd);
+}
+
+DiskCache::DiskCache()
+{
+    pthread_mutex_init(&this->lock, nullptr);
+    pthread_mutex_init(&this->queue_lock, nullptr);
+    pthread_cond_init(&this->queue_ready, nullptr);
+
+    mkdir(directory.c_str(), 0755);
+    this->dir_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (this->dir_fd < 0)
+    {
+        perror("Failed to open the disk cache directory");
+        exit(errno);
+    }
+
+    this->open_index();
+    this->open_segments();
+}
+
+DiskCache *DiskCache::getInstance()
+{
+    if (instance == nullptr)
+        instance = new DiskCache();
+    return instance;
+}
+
+bool DiskCache::enabled()
+{
+    return !directory.empty();
+}
+
+/* FNV-1a, stable across restarts unlike std::hash */
+uint64_t DiskCache::hash(const string &key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key)
+    {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* maps the index left by the last run, or starts an empty one if it does not fit this build */
+void DiskCache::open_index()
+{
+    int fd = openat(this->dir_fd, "index", O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror("Failed to open the disk cache index");
+        exit(errno);
+    }
+
+    this->index_size = sizeof(disk_index_header) + (size_t) DISK_CACHE_INDEX_SLOTS * sizeof(disk_slot);
+    struct stat st;
+    bool existing = fstat(fd, &st) == 0 && (size_t) st.st_size == this->index_size;
+    if (!existing && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t) this->index_size) < 0))
+    {
+        perror("Failed to size the disk cache index");
+        exit(errno);
+    }
+
+    void *map = mmap(nullptr, this->index_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map the disk cache index");
+        exit(errno);
+    }
+    this->header = (disk_index_header*) map;
+    this->slots = (disk_slot*)(this->header + 1);
+
+    this->warm = existing && this->header->magic == DISK_CACHE_MAGIC &&
+                 this->header->version == DISK_CACHE_VERSION && this->header->num_slots == DISK_CACHE_INDEX_SLOTS;
+    if (!this->warm)
+    {
+        memset(map, 0, this->index_size);
+        this->header->magic = DISK_CACHE_MAGIC;
+        this->header->version = DISK_CACHE_VERSION;
+        this->header->num_slots = DISK_CACHE_INDEX_SLOTS;
+        this->header->next_segment = 1;
+    }
+}
+
+/* segments nothing points to any more are left to compaction */
+void DiskCache::open_segments()
+{
+    DIR *dir = fdopendir(dup(this->dir_fd));
+    if (dir == nullptr)
+    {
+        perror("Failed to list the disk cache directory");
+        exit(errno);
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        unsigned id;
+        if (sscanf(entry->d_name, "segment.%u", &id) != 1 || id == 0)
+            continue;
+        int fd = openat(this->dir_fd, entry->d_name, O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+
+        shared_ptr<disk_segment> segment = make_shared<disk_segment>();
+        segment->id = id;
+        segment->fd = fd;
+        segment->size = (uint64_t) st.st_size;
+        this->segments[id] = segment;
+        this->total_size += segment->size;
+        if (id >= this->header->next_segment)
+            this->header->next_segment = id + 1;
+    }
+    closedir(dir);
+}
+
+shared_ptr<disk_segment> DiskCache::new_segment()
+{
+    char name[32];
+    uint32_t id = this->header->next_segment++;
+    snprintf(name, sizeof(name), "segment.%u", id);
+    int fd = openat(this->dir_fd, name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("Failed to create a disk cache segment");
+        return nullptr;
+    }
+
+    shared_ptr<disk_segment> segment = make_shared<disk_segment>();
+    segment->id = id;
+    segment->fd = fd;
+    segment->size = 0;
+    this->segments[id] = segment;
+    return segment;
+}
+
+/* space for a record at the end of the newest segment, a full one is followed by a new segment */
+shared_ptr<disk_segment> DiskCache::reserve(uint64_t len, uint64_t *offset)
+{
+    shared_ptr<disk_segment> segment = this->segments.empty() ? nullptr : this->segments.rbegin()->second;
+    if (segment == nullptr || (segment->size > 0 && segment->size + len > DISK_CACHE_SEGMENT_SIZE))
+        segment = this->new_segment();
+    if (segment == nullptr)
+        return nullptr;
+
+    *offset = segment->size;
+    segment->size += len;
+    this->total_size += len;
+    return segment;
+}
+
+size_t DiskCache::find_slot(uint64_t hash)
+{
+    size_t mask = DISK_CACHE_INDEX_SLOTS - 1;
+    for (size_t i = hash & mask; this->slots[i].segment != 0; i = (i + 1) & mask)
+        if (this->slots[i].hash == hash)
+            return i;
+    return DISK_CACHE_INDEX_SLOTS;
+}
+
+/* replaces the entry of the same key, the table is kept at most 7/8 full so that probes end */
+bool DiskCache::insert_slot(const disk_slot &slot)
+{
+    size_t mask = DISK_CACHE_INDEX_SLOTS - 1;
+    size_t i = slot.hash & mask;
+    while (this->slots[i].segment != 0 && this->slots[i].hash != slot.hash)
+        i = (i + 1) & mask;
+
+    if (this->slots[i].segment == 0)
+    {
+        if (this->header->used >= DISK_CACHE_INDEX_SLOTS / 8 * 7)
+            return false;
+        this->header->used++;
+    }
+    this->slots[i] = slot;
+    return true;
+}
+
+/* shifts the entries after a freed slot back so that no probe sequence has a hole */
+void DiskCache::erase_slot(size_t i)
+{
+    size_t mask = DISK_CACHE_INDEX_SLOTS - 1;
+    size_t j = i;
+    this->header->used--;
+    while (true)
+    {
+        this->slots[i].segment = 0;
+        size_t home;
+        do
+        {
+            j = (j + 1) & mask;
+            if (this->slots[j].segment == 0)
+                return;
+            home = this->slots[j].hash & mask;
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+        this->slots[i] = this->slots[j];
+        i = j;
+    }
+}
+
+/* forgets a segment and its entries, readers still sending from it keep the file open */
+void DiskCache::drop_segment(uint32_t id)
+{
+    for (size_t i = 0; i < DISK_CACHE_INDEX_SLOTS;)
+    {
+        if (this->slots[i].segment == id)
+            this->erase_slot(i);
+        else
+            i++;
+    }
+
+    auto it = this->segments.find(id);
+    if (it == this->segments.end())
+        return;
+    char name[32];
+    snprintf(name, sizeof(name), "segment.%u", id);
+    if (unlinkat(this->dir_fd, name, 0) < 0)
+        perror("Failed to remove a disk cache segment");
+    this->total_size -= it->second->size;
+    this->segments.erase(it);
+}
+
+bool DiskCache::lookup(const string &key, const char *request_headers, disk_object *object)
+{
+    uint64_t key_hash = hash(key);
+    disk_slot slot;
+    shared_ptr<disk_segment> segment;
+
+    pthread_mutex_lock(&this->lock);
+    size_t i = this->find_slot(key_hash);
+    if (i != DISK_CACHE_INDEX_SLOTS)
+    {
+        slot = this->slots[i];
+        auto it = this->segments.find(slot.segment);
+        if (it != this->segments.end() && slot.expires > time(nullptr) && slot.meta_len <= DISK_RECORD_MAX_META &&
+            slot.offset + slot.meta_len + slot.response_len <= it->second->size)
+            segment = it->second;
+        else
+            this->erase_slot(i);
+    }
+    if (!segment)
+    {
+        this->misses++;
+        pthread_mutex_unlock(&this->lock);
+        return false;
+    }
+    pthread_mutex_unlock(&this->lock);
+
+    /* the key is read back from the record, which also rejects entries a crash left half written */
+    string meta(slot.meta_len, '\0');
+    const disk_record *record = (const disk_record*) meta.data();
+    bool intact = slot.meta_len >= sizeof(disk_record) &&
+                  pread(segment->fd, &meta[0], slot.meta_len, (off_t) slot.offset) == (ssize_t) slot.meta_len &&
+                  record->magic == DISK_RECORD_MAGIC && record->hash == key_hash &&
+                  record->response_len == slot.response_len && record->key_len == key.size() &&
+                  sizeof(disk_record) + record->key_len + record->vary_len == slot.meta_len &&
+                  memcmp(meta.data() + sizeof(disk_record), key.data(), key.size()) == 0;
+
+    cache_vary vary;
+    if (intact)
+    {
+        const char *value = meta.data() + sizeof(disk_record) + key.size();
+        const char *end = meta.data() + meta.size();
+        while (value < end)
+        {
+            const char *name = value;
+            value += strlen(name) + 1;
+            if (value >= end)
+                break;
+            vary.emplace_back(name, value);
+            value += strlen(value) + 1;
+        }
+    }
+    bool hit = intact && ResponseCache::vary_matches(vary, request_headers);
+
+    pthread_mutex_lock(&this->lock);
+    if (!intact)
+    {
+        i = this->find_slot(key_hash);
+        if (i != DISK_CACHE_INDEX_SLOTS && this->slots[i].segment == slot.segment && this->slots[i].offset == slot.offset)
+            this->erase_slot(i);
+    }
+    if (hit)
+        this->hits++;
+    else
+        this->misses++;
+    pthread_mutex_unlock(&this->lock);
+
+    if (!hit)
+        return false;
+    object->segment = segment;
+    object->offset = slot.offset + slot.meta_len;
+    object->len = slot.response_len;
+    object->keep_alive = slot.keep_alive != 0;
+    return true;
+}
+
+bool DiskCache::send(int fd, const disk_object *object)
+{
+    off_t offset = (off_t) object->offset;
+    uint64_t remaining = object->len;
+    bool sent = true;
+
+    /* a response that takes several sendfile calls leaves in full segments only */
+    bool cork = remaining > DISK_CACHE_CORK_SIZE;
+    if (cork)
+        http_set_cork(fd, true);
+    while (remaining > 0 && sent)
+    {
+        ssize_t bytes_sent = sendfile(fd, object->segment->fd, &offset, remaining);
+        if (bytes_sent < 0 && errno == EINTR)
+            continue;
+        sent = bytes_sent > 0;
+        if (sent)
+            remaining -= (uint64_t) bytes_sent;
+    }
+    if (cork)
+        http_set_cork(fd, false);
+    if (!sent)
+        return false;
+
+    pthread_mutex_lock(&this->lock);
+    this->bytes_served += object->len;
+    pthread_mutex_unlock(&this->lock);
+    return true;
+}
+
+shared_ptr<disk_write> DiskCache::begin(const string &key, const char *request_headers, const char *head,
+                                        size_t head_len, uint64_t response_len, time_t expires, bool keep_alive)
+{
+    if (response_len > DISK_CACHE_MAX_OBJECT || response_len > budget / 2)
+        return nullptr;
+
+    /* the head is copied first, what follows it in the buffer is not part of it */
+    cache_vary vary;
+    ResponseCache::vary_values(string(head, head_len).c_str(), request_headers, vary);
+
+    disk_record record;
+    memset(&record, 0, sizeof(record));
+    string meta(sizeof(disk_record), '\0');
+    meta.append(key);
+    for (auto &value : vary)
+    {
+        meta.append(value.first.c_str(), value.first.size() + 1);
+        meta.append(value.second.c_str(), value.second.size() + 1);
+    }
+    if (meta.size() > DISK_RECORD_MAX_META)
+        return nullptr;
+    record.magic = DISK_RECORD_MAGIC;
+    record.key_len = (uint32_t) key.size();
+    record.vary_len = (uint32_t)(meta.size() - sizeof(disk_record) - key.size());
+    record.head_len = (uint32_t) head_len;
+    record.response_len = response_len;
+    record.expires = expires;
+    record.hash = hash(key);
+    memcpy(&meta[0], &record, sizeof(record));
+
+    /* no space is reserved for a response the writer has no room to queue */
+    pthread_mutex_lock(&this->queue_lock);
+    bool room = this->queued_bytes + meta.size() + head_len <= DISK_CACHE_QUEUE_SIZE;
+    pthread_mutex_unlock(&this->queue_lock);
+    if (!room)
+    {
+        pthread_mutex_lock(&this->lock);
+        this->store_failures++;
+        pthread_mutex_unlock(&this->lock);
+        return nullptr;
+    }
+
+    shared_ptr<disk_write> write = make_shared<disk_write>();
+    memset(&write->slot, 0, sizeof(write->slot));
+    pthread_mutex_lock(&this->lock);
+    write->segment = this->reserve(meta.size() + response_len, &write->slot.offset);
+    pthread_mutex_unlock(&this->lock);
+    if (!write->segment)
+        return nullptr;
+
+    write->slot.hash = record.hash;
+    write->slot.segment = write->segment->id;
+    write->slot.meta_len = (uint32_t) meta.size();
+    write->slot.response_len = response_len;
+    write->slot.expires = expires;
+    write->slot.head_len = (uint32_t) head_len;
+    write->slot.keep_alive = keep_alive;
+    write->queued = 0;
+    write->dropped = false;
+    write->written = 0;
+    write->failed = false;
+    this->append(write, meta.data(), meta.size());
+    this->append(write, head, head_len);
+    return write;
+}
+
+/* false if the writer is too far behind to take the data */
+bool DiskCache::enqueue(const shared_ptr<disk_write> &write, const char *data, size_t len, bool commit)
+{
+    pthread_mutex_lock(&this->queue_lock);
+    if (!commit && this->queued_bytes + len > DISK_CACHE_QUEUE_SIZE)
+    {
+        pthread_mutex_unlock(&this->queue_lock);
+        return false;
+    }
+    this->jobs.push_back(disk_job{write, string(data, len), write->queued, commit});
+    this->queued_bytes += len;
+    pthread_cond_signal(&this->queue_ready);
+    pthread_mutex_unlock(&this->queue_lock);
+    return true;
+}
+
+void DiskCache::append(const shared_ptr<disk_write> &write, const char *data, size_t len)
+{
+    uint64_t record_len = write->slot.meta_len + write->slot.response_len;
+    if (write->dropped || write->queued + len > record_len)
+    {
+        write->dropped = true;
+        return;
+    }
+    if (len == 0)
+        return;
+    if (!this->enqueue(write, data, len, false))
+    {
+        write->dropped = true;
+        return;
+    }
+    write->queued += len;
+}
+
+/* a dropped store is never written in full, which the writer counts as a failure */
+void DiskCache::commit(const shared_ptr<disk_write> &write)
+{
+    this->enqueue(write, nullptr, 0, true);
+}
+
+void DiskCache::run(disk_job &job)
+{
+    disk_write *write = job.write.get();
+    if (job.commit)
+    {
+        pthread_mutex_lock(&this->lock);
+        /* a segment dropped while the response was written takes it along */
+        bool stored = !write->failed && write->written == write->slot.meta_len + write->slot.response_len &&
+                      this->segments.count(write->slot.segment) > 0 && this->insert_slot(write->slot);
+        if (stored)
+            this->stores++;
+        else
+            this->store_failures++;
+        pthread_mutex_unlock(&this->lock);
+        return;
+    }
+    if (write->failed)
+        return;
+
+    const char *data = job.data.data();
+    size_t len = job.data.size();
+    off_t offset = (off_t)(write->slot.offset + job.at);
+    while (len > 0)
+    {
+        ssize_t bytes_written = pwrite(write->segment->fd, data, len, offset);
+        if (bytes_written < 0 && errno == EINTR)
+            continue;
+        if (bytes_written <= 0)
+        {
+            write->failed = true;
+            return;
+        }
+        data += bytes_written;
+        len -= (size_t) bytes_written;
+        offset += bytes_written;
+        write->written += (uint64_t) bytes_written;
+    }
+}
+
+/* copies a live record to the newest segment and points its entry there, unless that changed meanwhile */
+bool DiskCache::move_record(const disk_slot &slot, const shared_ptr<disk_segment> &from)
+{
+    uint64_t len = slot.meta_len + slot.response_len;
+    uint64_t offset;
+    pthread_mutex_lock(&this->lock);
+    shared_ptr<disk_segment> to = this->reserve(len, &offset);
+    pthread_mutex_unlock(&this->lock);
+    if (!to)
+        return false;
+
+    loff_t in = (loff_t) slot.offset, out = (loff_t) offset;
+    for (uint64_t remaining = len; remaining > 0;)
+    {
+        ssize_t copied = copy_file_range(from->fd, &in, to->fd, &out, remaining, 0);
+        if (copied <= 0)
+            return false;
+        remaining -= (uint64_t) copied;
+    }
+
+    pthread_mutex_lock(&this->lock);
+    size_t i = this->find_slot(slot.hash);
+    if (i != DISK_CACHE_INDEX_SLOTS && this->slots[i].segment == slot.segment && this->slots[i].offset == slot.offset)
+    {
+        this->slots[i].segment = to->id;
+        this->slots[i].offset = offset;
+        this->moved_bytes += len;
+    }
+    pthread_mutex_unlock(&this->lock);
+    return true;
+}
+
+/*
+ * One pass: expired entries are dropped, then the oldest segments while over
+ * budget, then the oldest segment that is less than DISK_CACHE_MIN_LIVE
+ * percent live has its records moved to the newest one and is removed. The
+ * newest segment is never touched, responses are being appended to it.
+ */
+void DiskCache::compact()
+{
+    time_t now = time(nullptr);
+    map<uint32_t, uint64_t> live;
+    shared_ptr<disk_segment> victim;
+    vector<disk_slot> moving;
+
+    pthread_mutex_lock(&this->lock);
+    for (size_t i = 0; i < DISK_CACHE_INDEX_SLOTS;)
+    {
+        disk_slot &slot = this->slots[i];
+        if (slot.segment != 0 && (slot.expires <= now || this->segments.count(slot.segment) == 0))
+        {
+            this->erase_slot(i);
+            continue;
+        }
+        if (slot.segment != 0)
+            live[slot.segment] += slot.meta_len + slot.response_len;
+        i++;
+    }
+
+    while (this->total_size > budget && this->segments.size() > 1)
+    {
+        this->drop_segment(this->segments.begin()->first);
+        this->evicted_segments++;
+    }
+
+    for (auto &entry : this->segments)
+    {
+        if (entry.second == this->segments.rbegin()->second)
+            break;
+        if (live[entry.first] == 0 || live[entry.first] * 100 < entry.second->size * DISK_CACHE_MIN_LIVE)
+        {
+            victim = entry.second;
+            break;
+        }
+    }
+    if (victim)
+        for (size_t i = 0; i < DISK_CACHE_INDEX_SLOTS; i++)
+            if (this->slots[i].segment == victim->id)
+                moving.push_back(this->slots[i]);
+    pthread_mutex_unlock(&this->lock);
+
+    if (victim)
+    {
+        bool moved = true;
+        for (size_t i = 0; i < moving.size() && moved; i++)
+            moved = this->move_record(moving[i], victim);
+
+        pthread_mutex_lock(&this->lock);
+        if (moved)
+        {
+            this->drop_segment(victim->id);
+            this->compacted_segments++;
+        }
+        pthread_mutex_unlock(&this->lock);
+    }
+
+    msync(this->header, this->index_size, MS_ASYNC);
+}
+
+void DiskCache::compaction_loop(void *)
+{
+    while (true)
+    {
+        sleep(DISK_CACHE_COMPACT_INTERVAL);
+        getInstance()->compact();
+    }
+}
+
+/* takes whatever is queued at once, the queue only shrinks by what has been written */
+void DiskCache::writer_loop(void *)
+{
+    DiskCache *cache = getInstance();
+    deque<disk_job> batch;
+    while (true)
+    {
+        pthread_mutex_lock(&cache->queue_lock);
+        while (cache->jobs.empty())
+            pthread_cond_wait(&cache->queue_ready, &cache->queue_lock);
+        batch.swap(cache->jobs);
+        pthread_mutex_unlock(&cache->queue_lock);
+
+        size_t written = 0;
+        for (disk_job &job : batch)
+        {
+            cache->run(job);
+            written += job.data.size();
+        }
+        batch.clear();
+
+        pthread_mutex_lock(&cache->queue_lock);
+        cache->queued_bytes -= written;
+        pthread_mutex_unlock(&cache->queue_lock);
+    }
+}
+
+void DiskCache::stats(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    uint64_t lookups = this->hits + this->misses;
+    fprintf(out, "Disk cache hits: %lu, misses: %lu, hit ratio: %f, bytes served: %lu\n",
+            this->hits, this->misses, lookups > 0 ? (double)this->hits / lookups : 0.0, this->bytes_served);
+    fprintf(out, "Disk cache objects: %u in %zu segments (%lu of %lu bytes), stored: %lu, not stored: %lu, %s start\n",
+            this->header->used, this->segments.size(), this->total_size, budget, this->stores, this->store_failures,
+            this->warm ? "warm" : "cold");
+    fprintf(out, "Disk cache segments evicted: %lu, compacted: %lu (%lu bytes moved)\n",
+            this->evicted_segments, this->compacted_segments, this->moved_bytes);
+    pthread_mutex_unlock(&this->lock);
+}
+
+void DiskCache::metrics(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    uint64_t hits = this->hits, misses = this->misses, bytes_served = this->bytes_served, stores = this->stores;
+    uint64_t evicted = this->evicted_segments, compacted = this->compacted_segments, size = this->total_size;
+    uint32_t objects = this->header->used;
+    size_t segment_count = this->segments.size();
+    pthread_mutex_unlock(&this->lock);
+
+    fprintf(out, "# TYPE proxy_disk_cache_lookups_total counter\n");
+    fprintf(out, "proxy_disk_cache_lookups_total{result=\"hit\"} %lu\n", hits);
+    fprintf(out, "proxy_disk_cache_lookups_total{result=\"miss\"} %lu\n", misses);
+    fprintf(out, "# TYPE proxy_disk_cache_served_bytes_total counter\nproxy_disk_cache_served_bytes_total %lu\n",
+            bytes_served);
+    fprintf(out, "# TYPE proxy_disk_cache_stores_total counter\nproxy_disk_cache_stores_total %lu\n", stores);
+    fprintf(out, "# TYPE proxy_disk_cache_segments_evicted_total counter\nproxy_disk_cache_segments_evicted_total %lu\n",
+            evicted);
+    fprintf(out, "# TYPE proxy_disk_cache_segments_compacted_total counter\n"
+                 "proxy_disk_cache_segments_compacted_total %lu\n", compacted);
+    fprintf(out, "# TYPE proxy_disk_cache_objects gauge\nproxy_disk_cache_objects %u\n", objects);
+    fprintf(out, "# TYPE proxy_disk_cache_segments gauge\nproxy_disk_cache_segments %zu\n", segment_count);
+    fprintf(out, "# TYPE proxy_disk_cache_bytes gauge\nproxy_disk_cache_bytes %lu\n", size);
+}
@@ -0,0 +1,165 @@
+#ifndef HTTP_PROXY_SERVER_DISK_CACHE_H
+#define HTTP_PROXY_SERVER_DISK_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <pthread.h>
+
+#define DISK_CACHE_BUDGET           (1024ULL * 1024 * 1024)
+#define DISK_CACHE_SEGMENT_SIZE     (64 * 1024 * 1024)
+#define DISK_CACHE_MAX_OBJECT       (256 * 1024 * 1024)
+#define DISK_CACHE_INDEX_SLOTS      (1 << 18)   /* power of two, 48 bytes each */
+#define DISK_CACHE_COMPACT_INTERVAL 10          /* seconds between compaction passes */
+#define DISK_CACHE_MIN_LIVE         50          /* percent of a segment that has to be live for it to stay */
+#define DISK_CACHE_CORK_SIZE        (64 * 1024) /* hits above this are corked while they are sent */
+#define DISK_CACHE_QUEUE_SIZE       (32 * 1024 * 1024)  /* bytes waiting for the writer before stores are dropped */
+
+/* in a segment file this header is followed by the key, the Vary values and the response */
+struct disk_record
+{
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t vary_len;          /* name and value pairs, each NUL terminated */
+    uint32_t head_len;
+    uint64_t response_len;
+    int64_t expires;
+    uint64_t hash;
+};
+
+/* entry of the mapped index, free while segment is 0 */
+struct disk_slot
+{
+    uint64_t hash;
+    uint32_t segment;
+    uint32_t meta_len;          /* record header, key and Vary values */
+    uint64_t offset;            /* of the record in the segment */
+    uint64_t response_len;
+    int64_t expires;
+    uint32_t head_len;
+    uint32_t keep_alive;
+};
+
+struct disk_index_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t used;
+    uint32_t next_segment;
+    uint64_t reserved[5];
+};
+
+/* an append-only file of records, closed once neither the cache nor a reader holds it */
+struct disk_segment
+{
+    uint32_t id;
+    int fd;
+    uint64_t size;              /* appended or reserved for records being written */
+    ~disk_segment();
+};
+
+/* where a hit is, served by sending straight from the segment file */
+struct disk_object
+{
+    std::shared_ptr<disk_segment> segment;
+    uint64_t offset;            /* of the response */
+    uint64_t len;
+    bool keep_alive;
+};
+
+/* a response being written to the disk cache as it passes, indexed once complete */
+struct disk_write
+{
+    std::shared_ptr<disk_segment> segment;
+    disk_slot slot;
+    uint64_t queued;            /* of the record, only touched by the thread relaying the response */
+    bool dropped;
+    uint64_t written;           /* of the record, only touched by the writer thread */
+    bool failed;
+};
+
+/* a piece of a record for the writer thread, or the request to index it */
+struct disk_job
+{
+    std::shared_ptr<disk_write> write;
+    std::string data;
+    uint64_t at;                /* from the start of the record */
+    bool commit;
+};
+
+/*
+ * Persistent cache of fresh GET responses behind the in-memory one: records
+ * are appended to segment files and found through an open addressing hash
+ * index in a mapped file, so a restart only maps it again. Keys are checked
+ * against the record itself, which also catches entries torn by a crash. A
+ * background pass drops the oldest segments once over budget and moves the
+ * live records out of segments that are mostly dead. Records are written
+ * by a thread of their own, so relaying a response never waits for the disk.
+ */
+class DiskCache
+{
+    pthread_mutex_t lock{};
+    int dir_fd = -1;
+    disk_index_header *header = nullptr;
+    disk_slot *slots = nullptr;
+    size_t index_size = 0;
+    std::map<uint32_t, std::shared_ptr<disk_segment>> segments;     /* by id, the last one is appended to */
+    uint64_t total_size = 0;
+
+    uint64_t hits = 0, misses = 0, bytes_served = 0, stores = 0, store_failures = 0;
+    uint64_t evicted_segments = 0, compacted_segments = 0, moved_bytes = 0;
+    bool warm = false;
+
+    pthread_mutex_t queue_lock{};
+    pthread_cond_t queue_ready{};
+    std::deque<disk_job> jobs;
+    size_t queued_bytes = 0;
+
+    static DiskCache *instance;
+    DiskCache();
+
+    static uint64_t hash(const std::string &key);
+    void open_index();
+    void open_segments();
+    std::shared_ptr<disk_segment> new_segment();
+    std::shared_ptr<disk_segment> reserve(uint64_t len, uint64_t *offset);
+    size_t find_slot(uint64_t hash);
+    bool insert_slot(const disk_slot &slot);
+    void erase_slot(size_t i);
+    void drop_segment(uint32_t id);
+    bool move_record(const disk_slot &slot, const std::shared_ptr<disk_segment> &from);
+    void compact();
+    bool enqueue(const std::shared_ptr<disk_write> &write, const char *data, size_t len, bool commit);
+    void run(disk_job &job);
+
+public:
+    static std::string directory;
+    static uint64_t budget;
+
+    static DiskCache* getInstance();
+    static bool enabled();
+
+    bool lookup(const std::string &key, const char *request_headers, disk_object *object);
+    /* sends a hit to a blocking socket, false if the client went away */
+    bool send(int fd, const disk_object *object);
+
+    /* starts storing a response with its head, nullptr if it is not going to be kept */
+    std::shared_ptr<disk_write> begin(const std::string &key, const char *request_headers, const char *head,
+                                      size_t head_len, uint64_t response_len, time_t expires, bool keep_alive);
+    /* these only queue the data, a store is dropped rather than waited for once the writer falls behind */
+    void append(const std::shared_ptr<disk_write> &write, const char *data, size_t len);
+    /* indexes the response if all of it was written */
+    void commit(const std::shared_ptr<disk_write> &write);
+
+    static void compaction_loop(void *);
+    static void writer_loop(void *);
+    void stats(FILE *out);
+    void metrics(FILE *out);
+};
+
+#endif //HTTP_PROXY_SERVER_DISK_CACHE_H
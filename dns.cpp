@@ -0,0 +1,151 @@
+#include "dns.h"
+
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <sys/time.h>
+
+using namespace std;
+
+DNSResolver* DNSResolver::instance = nullptr;
+
+DNSResolver::DNSResolver()
+{
+    this->lookup_ms = RunningStat();
+
+    pthread_mutex_init(&this->lock, nullptr);
+    pthread_cond_init(&this->cond, nullptr);
+}
+
+DNSResolver *DNSResolver::getInstance()
+{
+    if (instance == nullptr)
+        instance = new DNSResolver();
+    return instance;
+}
+
+bool DNSResolver::lookup(const char *host, vector<sockaddr_storage> &addrs)
+{
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, nullptr, &hints, &result) != 0)
+        return false;
+
+    for (struct addrinfo *ai = result; ai != nullptr; ai = ai->ai_next)
+    {
+        sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+        addrs.push_back(addr);
+    }
+
+    freeaddrinfo(result);
+    return !addrs.empty();
+}
+
+/* drops expired answers once the cache outgrows DNS_CACHE_MAX */
+void DNSResolver::purge(time_t now)
+{
+    if (this->cache.size() < DNS_CACHE_MAX)
+        return;
+
+    for (auto it = this->cache.begin(); it != this->cache.end();)
+    {
+        if (!it->second.pending && it->second.expires <= now)
+            it = this->cache.erase(it);
+        else
+            it++;
+    }
+}
+
+bool DNSResolver::resolve(const char *host, vector<sockaddr_storage> &addrs)
+{
+    pthread_mutex_lock(&this->lock);
+
+    bool waited = false;
+    while (true)
+    {
+        auto it = this->cache.find(host);
+        if (it == this->cache.end())
+            break;
+
+        if (it->second.pending)
+        {
+            /* someone is already asking for this name */
+            if (!waited)
+                this->coalesced++;
+            waited = true;
+            pthread_cond_wait(&this->cond, &this->lock);
+            continue;
+        }
+
+        if (it->second.expires <= time(nullptr))
+            break;
+
+        if (!waited)
+            this->hits++;
+        addrs = it->second.addrs;
+        pthread_mutex_unlock(&this->lock);
+        return !addrs.empty();
+    }
+
+    this->misses++;
+    this->purge(time(nullptr));
+    this->cache[host].pending = true;
+    pthread_mutex_unlock(&this->lock);
+
+    struct timeval start, end;
+    gettimeofday(&start, nullptr);
+    vector<sockaddr_storage> result;
+    bool found = lookup(host, result);
+    gettimeofday(&end, nullptr);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3;
+
+    pthread_mutex_lock(&this->lock);
+    dns_entry &entry = this->cache[host];
+    entry.addrs = result;
+    entry.pending = false;
+    entry.expires = time(nullptr) + (found ? DNS_POSITIVE_TTL : DNS_NEGATIVE_TTL);
+
+    if (!found)
+        this->failures++;
+    this->lookup_ms.Push(elapsed_ms);
+    if (elapsed_ms > this->lookup_max_ms)
+        this->lookup_max_ms = elapsed_ms;
+
+    pthread_cond_broadcast(&this->cond);
+    pthread_mutex_unlock(&this->lock);
+
+    addrs = result;
+    return found;
+}
+
+void DNSResolver::stats(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    uint64_t total = this->hits + this->misses + this->coalesced;
+    fprintf(out, "DNS queries: %lu (hits: %lu, coalesced: %lu, lookups: %lu, failed: %lu)\n",
+            total, this->hits, this->coalesced, this->misses, this->failures);
+    fprintf(out, "DNS hit rate: %f\n", total > 0 ? (double)(this->hits + this->coalesced) / total : 0.0);
+    fprintf(out, "DNS lookup latency ms(mean, std, max): (%f, %f, %f)\n",
+            this->lookup_ms.Mean(), this->lookup_ms.StandardDeviation(), this->lookup_max_ms);
+    pthread_mutex_unlock(&this->lock);
+}
+
+void DNSResolver::metrics(FILE *out)
+{
+    pthread_mutex_lock(&this->lock);
+    uint64_t hits = this->hits, coalesced = this->coalesced, misses = this->misses, failures = this->failures;
+    RunningStat lookup_ms = this->lookup_ms;
+    pthread_mutex_unlock(&this->lock);
+
+    fprintf(out, "# TYPE proxy_dns_queries_total counter\n");
+    fprintf(out, "proxy_dns_queries_total{result=\"hit\"} %lu\n", hits);
+    fprintf(out, "proxy_dns_queries_total{result=\"coalesced\"} %lu\n", coalesced);
+    fprintf(out, "proxy_dns_queries_total{result=\"lookup\"} %lu\n", misses);
+    fprintf(out, "# TYPE proxy_dns_failures_total counter\nproxy_dns_failures_total %lu\n", failures);
+    fprintf(out, "# TYPE proxy_dns_lookup_seconds_mean gauge\nproxy_dns_lookup_seconds_mean %f\n", lookup_ms.Mean() / 1000);
+}
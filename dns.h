@@ -0,0 +1,50 @@
+#ifndef HTTP_PROXY_SERVER_DNS_H
+#define HTTP_PROXY_SERVER_DNS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "management.h"
+
+#define DNS_POSITIVE_TTL    60
+#define DNS_NEGATIVE_TTL    10
+#define DNS_CACHE_MAX       4096
+
+struct dns_entry
+{
+    std::vector<sockaddr_storage> addrs;    /* empty for a negative answer */
+    time_t expires;
+    bool pending;
+};
+
+/* caching resolver that lets concurrent lookups of one name share a single getaddrinfo */
+class DNSResolver
+{
+    pthread_mutex_t lock{};
+    pthread_cond_t cond{};
+    std::map<std::string, dns_entry> cache;
+
+    uint64_t hits = 0, misses = 0, coalesced = 0, failures = 0;
+    RunningStat lookup_ms;
+    double lookup_max_ms = 0;
+
+    static DNSResolver *instance;
+    DNSResolver();
+
+    static bool lookup(const char *host, std::vector<sockaddr_storage> &addrs);
+    void purge(time_t now);
+
+public:
+    static DNSResolver* getInstance();
+    bool resolve(const char *host, std::vector<sockaddr_storage> &addrs);
+    void stats(FILE *out);
+    void metrics(FILE *out);
+};
+
+#endif //HTTP_PROXY_SERVER_DNS_H
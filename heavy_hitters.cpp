@@ -0,0 +1,159 @@
+#include "heavy_hitters.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+SpaceSaving::SpaceSaving(size_t capacity)
+{
+    this->capacity = capacity > 0 ? capacity : 1;
+    this->total = 0;
+}
+
+void SpaceSaving::Clear()
+{
+    this->total = 0;
+    this->heap.clear();
+    this->hashes.clear();
+    this->positions.clear();
+}
+
+void SpaceSaving::swap_nodes(size_t a, size_t b)
+{
+    swap(this->heap[a], this->heap[b]);
+    swap(this->hashes[a], this->hashes[b]);
+    this->positions[this->hashes[a]] = a;
+    this->positions[this->hashes[b]] = b;
+}
+
+void SpaceSaving::sift_up(size_t i)
+{
+    while (i > 0 && this->heap[(i - 1) / 2].count > this->heap[i].count)
+    {
+        this->swap_nodes(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void SpaceSaving::sift_down(size_t i)
+{
+    while (true)
+    {
+        size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < this->heap.size() && this->heap[left].count < this->heap[smallest].count)
+            smallest = left;
+        if (right < this->heap.size() && this->heap[right].count < this->heap[smallest].count)
+            smallest = right;
+        if (smallest == i)
+            return;
+        this->swap_nodes(i, smallest);
+        i = smallest;
+    }
+}
+
+void SpaceSaving::Push(const char *key, uint64_t weight)
+{
+    this->total += weight;
+
+    uint64_t hash = heavy_hitters_hash(key);
+    auto it = this->positions.find(hash);
+    if (it != this->positions.end())
+    {
+        this->heap[it->second].count += weight;
+        this->sift_down(it->second);
+        return;
+    }
+
+    if (this->heap.size() < this->capacity)
+    {
+        this->heap.push_back({key, weight, 0});
+        this->hashes.push_back(hash);
+        this->positions[hash] = this->heap.size() - 1;
+        this->sift_up(this->heap.size() - 1);
+        return;
+    }
+
+    /* the new key inherits the smallest counter and its count as error */
+    heavy_hitter &min = this->heap[0];
+    this->positions.erase(this->hashes[0]);
+    min.key.assign(key);
+    min.error = min.count;
+    min.count += weight;
+    this->hashes[0] = hash;
+    this->positions[hash] = 0;
+    this->sift_down(0);
+}
+
+WindowedSpaceSaving::WindowedSpaceSaving(size_t capacity)
+{
+    for (int i = 0; i < HEAVY_HITTERS_SLOTS; i++)
+    {
+        this->slots[i] = SpaceSaving(capacity);
+        this->epochs[i] = -1;
+    }
+}
+
+void WindowedSpaceSaving::Push(const char *key, time_t now)
+{
+    time_t epoch = now / HEAVY_HITTERS_SLOT_TIME;
+    int slot = (int)(epoch % HEAVY_HITTERS_SLOTS);
+    if (this->epochs[slot] != epoch)
+    {
+        this->slots[slot].Clear();
+        this->epochs[slot] = epoch;
+    }
+    this->slots[slot].Push(key);
+}
+
+void WindowedSpaceSaving::Collect(time_t now, time_t window, vector<SpaceSaving> &out) const
+{
+    time_t epoch = now / HEAVY_HITTERS_SLOT_TIME;
+    time_t oldest = (now - window) / HEAVY_HITTERS_SLOT_TIME;
+    for (int i = 0; i < HEAVY_HITTERS_SLOTS; i++)
+        if (this->epochs[i] >= oldest && this->epochs[i] <= epoch)
+            out.push_back(this->slots[i]);
+}
+
+uint64_t heavy_hitters_hash(const char *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *key != '\0'; key++)
+    {
+        hash ^= (unsigned char)*key;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+vector<heavy_hitter> heavy_hitters_merge(const vector<SpaceSaving> &summaries, size_t k)
+{
+    /* a key missing from a full summary may still have been seen up to its floor there */
+    uint64_t floors = 0;
+    for (auto &summary : summaries)
+        floors += summary.Floor();
+
+    map<string, heavy_hitter> merged;
+    for (auto &summary : summaries)
+    {
+        for (auto &counter : summary.Counters())
+        {
+            auto it = merged.find(counter.key);
+            if (it == merged.end())
+                it = merged.emplace(counter.key, heavy_hitter{counter.key, floors, floors}).first;
+            /* swap the floor assumed above for what this summary actually counted */
+            it->second.count += counter.count - summary.Floor();
+            it->second.error = it->second.error - summary.Floor() + counter.error;
+        }
+    }
+
+    vector<heavy_hitter> top;
+    for (auto &it : merged)
+        top.push_back(it.second);
+
+    k = min(k, top.size());
+    partial_sort(top.begin(), top.begin() + k, top.end(),
+                 [](const heavy_hitter &a, const heavy_hitter &b) { return a.count > b.count; });
+    top.resize(k);
+    return top;
+}
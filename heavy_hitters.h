@@ -0,0 +1,83 @@
+#ifndef HTTP_PROXY_SERVER_HEAVY_HITTERS_H
+#define HTTP_PROXY_SERVER_HEAVY_HITTERS_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define HEAVY_HITTERS_CAPACITY  512
+#define HEAVY_HITTERS_SLOTS     10      /* windowed counts reach this many slots back */
+#define HEAVY_HITTERS_SLOT_TIME 60      /* seconds per slot */
+
+struct heavy_hitter
+{
+    std::string key;
+    uint64_t count;
+    uint64_t error;     /* count overestimates the true one by at most this */
+};
+
+/*
+ * Space-Saving (Metwally et al.): at most capacity counters are kept, a new key
+ * takes over the smallest one. Any key seen more than total / capacity times is
+ * guaranteed to be present. Counters live in a min-heap so an update costs
+ * O(log capacity).
+ */
+class SpaceSaving
+{
+    size_t capacity;
+    uint64_t total;
+    std::vector<heavy_hitter> heap;
+    std::vector<uint64_t> hashes;                       /* of the keys in heap, in the same order */
+    std::unordered_map<uint64_t, size_t> positions;     /* keys are told apart by their 64 bit hash */
+
+    void swap_nodes(size_t a, size_t b);
+    void sift_up(size_t i);
+    void sift_down(size_t i);
+
+public:
+    explicit SpaceSaving(size_t capacity = HEAVY_HITTERS_CAPACITY);
+
+    void Clear();
+    /* builds no string unless the key is new */
+    void Push(const char *key, uint64_t weight = 1);
+
+    uint64_t Total() const
+    {
+        return total;
+    }
+
+    /* what a key that is not tracked may have been seen at most */
+    uint64_t Floor() const
+    {
+        return heap.size() < capacity ? 0 : heap[0].count;
+    }
+
+    const std::vector<heavy_hitter> &Counters() const
+    {
+        return heap;
+    }
+};
+
+/* Space-Saving per time slot, so counts can be limited to the last few minutes */
+class WindowedSpaceSaving
+{
+    SpaceSaving slots[HEAVY_HITTERS_SLOTS];
+    time_t epochs[HEAVY_HITTERS_SLOTS];
+
+public:
+    explicit WindowedSpaceSaving(size_t capacity = HEAVY_HITTERS_CAPACITY);
+
+    void Push(const char *key, time_t now);
+    /* appends the slots that overlap the last window seconds */
+    void Collect(time_t now, time_t window, std::vector<SpaceSaving> &out) const;
+};
+
+/* FNV-1a */
+uint64_t heavy_hitters_hash(const char *key);
+
+/* combines summaries kept by different threads and returns the k largest counts */
+std::vector<heavy_hitter> heavy_hitters_merge(const std::vector<SpaceSaving> &summaries, size_t k);
+
+#endif //HTTP_PROXY_SERVER_HEAVY_HITTERS_H
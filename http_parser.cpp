@@ -0,0 +1,560 @@
+#include "http_parser.h"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+/* RFC 7230 tchar */
+static const bool token_chars[256] = {
+    /* 0x00 - 0x1f */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /*    !  "  #  $  %  &  '  (  )  *  +  ,  -  .  /  0  1  2  3  4  5  6  7  8  9  :  ;  <  =  >  ? */
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    /* @  A  B  C  D  E  F  G  H  I  J  K  L  M  N  O  P  Q  R  S  T  U  V  W  X  Y  Z  [  \  ]  ^  _ */
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    /* `  a  b  c  d  e  f  g  h  i  j  k  l  m  n  o  p  q  r  s  t  u  v  w  x  y  z  {  |  }  ~    */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+};
+
+static inline bool is_token(char c)
+{
+    return token_chars[(unsigned char)c];
+}
+
+HttpRequestParser::HttpRequestParser()
+{
+    this->max_head = 0;
+    this->reset();
+}
+
+HttpRequestParser::HttpRequestParser(size_t max_head)
+{
+    this->max_head = max_head;
+    this->reset();
+}
+
+void HttpRequestParser::set_max_head(size_t max_head)
+{
+    this->max_head = max_head;
+}
+
+void HttpRequestParser::reset()
+{
+    this->state = START;
+    this->pos = this->mark = 0;
+    this->num_headers = 0;
+    this->line_len = this->head_len = 0;
+}
+
+void HttpRequestParser::add_header(size_t end)
+{
+    size_t start = this->value_spans[this->num_headers].off;
+    this->value_spans[this->num_headers].len = end - start;
+    this->num_headers++;
+}
+
+ParseStatus HttpRequestParser::finish(const char *buffer)
+{
+    this->method.data = buffer + this->method_span.off;
+    this->method.len = this->method_span.len;
+    this->path.data = buffer + this->path_span.off;
+    this->path.len = this->path_span.len;
+    this->version.data = buffer + this->version_span.off;
+    this->version.len = this->version_span.len;
+
+    if (this->version.len != strlen("HTTP/1.1") || strncmp(this->version.data, "HTTP/1.", 7) != 0)
+        return PARSE_ERROR;
+
+    for (size_t i = 0; i < this->num_headers; i++)
+    {
+        this->headers[i].name.data = buffer + this->name_spans[i].off;
+        this->headers[i].name.len = this->name_spans[i].len;
+        this->headers[i].value.data = buffer + this->value_spans[i].off;
+        this->headers[i].value.len = this->value_spans[i].len;
+    }
+
+    this->head_len = this->pos;
+    this->state = DONE;
+    return PARSE_DONE;
+}
+
+ParseStatus HttpRequestParser::parse(const char *buffer, size_t len)
+{
+    if (this->state == DONE)
+        return PARSE_DONE;
+
+    size_t end = len < this->max_head ? len : this->max_head;
+    for (; this->pos < end; this->pos++)
+    {
+        char c = buffer[this->pos];
+        switch (this->state)
+        {
+            case START:
+                /* empty lines ahead of a request line are ignored */
+                if (c == '\r' || c == '\n')
+                    break;
+                this->mark = this->pos;
+                this->state = METHOD;
+                /* fall through */
+            case METHOD:
+                if (c == ' ')
+                {
+                    if (this->pos == this->mark)
+                        return PARSE_ERROR;
+                    this->method_span = {this->mark, this->pos - this->mark};
+                    this->state = PATH_START;
+                }
+                else if (!is_token(c))
+                    return PARSE_ERROR;
+                break;
+
+            case PATH_START:
+                if (c == ' ')
+                    return PARSE_ERROR;
+                this->mark = this->pos;
+                this->state = PATH;
+                /* fall through */
+            case PATH:
+                while (this->pos < end && (unsigned char)buffer[this->pos] > ' ')
+                    this->pos++;
+                if (this->pos == end)
+                    return end == this->max_head ? PARSE_TOO_LARGE : PARSE_INCOMPLETE;
+                if (buffer[this->pos] != ' ')
+                    return PARSE_ERROR;
+                this->path_span = {this->mark, this->pos - this->mark};
+                this->state = VERSION_START;
+                break;
+
+            case VERSION_START:
+                this->mark = this->pos;
+                this->state = VERSION;
+                /* fall through */
+            case VERSION:
+                if (c == '\r' || c == '\n')
+                {
+                    this->version_span = {this->mark, this->pos - this->mark};
+                    this->line_len = this->pos + 1 + (c == '\r');
+                    this->state = c == '\r' ? LINE_LF : HEADER_START;
+                }
+                else if (c == ' ')
+                    return PARSE_ERROR;
+                break;
+
+            case LINE_LF:
+                if (c != '\n')
+                    return PARSE_ERROR;
+                this->state = HEADER_START;
+                break;
+
+            case HEADER_START:
+                if (c == '\r')
+                {
+                    this->state = HEAD_LF;
+                    break;
+                }
+                if (c == '\n')
+                {
+                    this->pos++;
+                    return this->finish(buffer);
+                }
+                /* obsolete line folding is rejected */
+                if (!is_token(c) || this->num_headers == HTTP_PARSER_MAX_HEADERS)
+                    return PARSE_ERROR;
+                this->mark = this->pos;
+                this->state = HEADER_NAME;
+                break;
+
+            case HEADER_NAME:
+                if (c == ':')
+                {
+                    this->name_spans[this->num_headers] = {this->mark, this->pos - this->mark};
+                    this->state = HEADER_VALUE_START;
+                }
+                else if (!is_token(c))
+                    return PARSE_ERROR;
+                break;
+
+            case HEADER_VALUE_START:
+                if (c == ' ' || c == '\t')
+                    break;
+                this->value_spans[this->num_headers].off = this->pos;
+                this->state = HEADER_VALUE;
+                /* fall through */
+            case HEADER_VALUE:
+            {
+                while (this->pos < end && buffer[this->pos] != '\r' && buffer[this->pos] != '\n')
+                    this->pos++;
+                if (this->pos == end)
+                    return end == this->max_head ? PARSE_TOO_LARGE : PARSE_INCOMPLETE;
+
+                /* trailing whitespace is not part of the value */
+                size_t value_end = this->pos;
+                while (value_end > this->value_spans[this->num_headers].off &&
+                       (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t'))
+                    value_end--;
+                this->add_header(value_end);
+                this->state = buffer[this->pos] == '\r' ? HEADER_LF : HEADER_START;
+                break;
+            }
+
+            case HEADER_LF:
+                if (c != '\n')
+                    return PARSE_ERROR;
+                this->state = HEADER_START;
+                break;
+
+            case HEAD_LF:
+                if (c != '\n')
+                    return PARSE_ERROR;
+                this->pos++;
+                return this->finish(buffer);
+
+            case DONE:
+                return PARSE_DONE;
+        }
+    }
+
+    return this->pos >= this->max_head ? PARSE_TOO_LARGE : PARSE_INCOMPLETE;
+}
+
+const http_slice *HttpRequestParser::header(const char *name) const
+{
+    for (size_t i = 0; i < this->num_headers; i++)
+        if (http_slice_iequals(this->headers[i].name, name))
+            return &this->headers[i].value;
+    return nullptr;
+}
+
+HttpResponseFramer::HttpResponseFramer(size_t max_head)
+{
+    this->max_head = max_head;
+    this->reset();
+}
+
+void HttpResponseFramer::reset()
+{
+    this->state = HEAD;
+    this->partial.clear();
+    this->gathering = false;
+    this->remaining = this->size_digits = this->line_len = 0;
+    this->status_code = 0;
+    this->keep_alive = true;
+    this->chunked = false;
+    this->content_length = -1;
+    this->head_len = 0;
+    this->body_len = this->body_wire_len = 0;
+}
+
+FrameStatus HttpResponseFramer::fail()
+{
+    this->state = BROKEN;
+    this->gathering = false;
+    this->keep_alive = false;
+    return FRAME_ERROR;
+}
+
+/* picks the body framing of the head in index, RFC 7230 section 3.3.3 */
+FrameStatus HttpResponseFramer::start_body(bool head_request)
+{
+    const char *head = this->index.data;
+    if (this->head_len < strlen("HTTP/1.x 000") || strncmp(head, "HTTP/1.", 7) != 0 ||
+        head[8] != ' ' || head[9] < '1' || head[9] > '9')
+        return this->fail();
+
+    this->status_code = atoi(head + 9);
+    this->keep_alive = head[7] != '0';
+    this->chunked = false;
+    this->content_length = -1;
+    this->body_len = this->body_wire_len = 0;
+
+    /* the framing headers are looked up together, in one pass over the index */
+    static const char *const names[] = {"Connection", "Transfer-Encoding", "Content-Length"};
+    const char *values[3];
+    size_t value_lens[3];
+    scan_find_headers(&this->index, names, 3, values, value_lens);
+
+    const char *value = values[0];
+    size_t value_len = value_lens[0];
+    if (value != nullptr)
+    {
+        if (value_len >= 5 && strncasecmp(value, "close", 5) == 0)
+            this->keep_alive = false;
+        else if (value_len >= 10 && strncasecmp(value, "keep-alive", 10) == 0)
+            this->keep_alive = true;
+    }
+
+    /* an interim response is followed by the final one */
+    if (this->status_code / 100 == 1)
+    {
+        this->state = HEAD;
+        return FRAME_HEAD;
+    }
+
+    if (head_request || this->status_code == 204 || this->status_code == 304)
+    {
+        this->state = BODY_EMPTY;
+        return FRAME_HEAD;
+    }
+
+    value = values[1];
+    value_len = value_lens[1];
+    if (value != nullptr)
+    {
+        /* chunked has to be the last coding, anything else runs until the server closes */
+        this->chunked = value_len >= 7 && strncasecmp(value + value_len - 7, "chunked", 7) == 0;
+        this->state = this->chunked ? CHUNK_SIZE : BODY_CLOSE;
+        this->remaining = this->size_digits = 0;
+    }
+    else if (values[2] != nullptr)
+    {
+        long length;
+        if (!http_parse_length(values[2], value_lens[2], &length))
+            return this->fail();
+        this->content_length = length;
+        this->remaining = (uint64_t)length;
+        this->state = BODY_LENGTH;
+    }
+    else
+        this->state = BODY_CLOSE;
+
+    if (this->state == BODY_CLOSE)
+        this->keep_alive = false;
+    return FRAME_HEAD;
+}
+
+/* the line break after a chunk size, or after the last chunk */
+FrameStatus HttpResponseFramer::chunk_line_end()
+{
+    if (this->size_digits == 0)
+        return this->fail();
+    if (this->remaining == 0)
+    {
+        this->state = TRAILER;
+        this->line_len = 0;
+    }
+    else
+        this->state = CHUNK_DATA;
+    return FRAME_MORE;
+}
+
+FrameStatus HttpResponseFramer::feed(const char *data, size_t len, bool head_request, size_t *consumed)
+{
+    size_t pos = 0;
+    *consumed = 0;
+
+    if (this->state == HEAD)
+    {
+        if (len == 0)
+            return FRAME_MORE;
+
+        /* heads are indexed in place unless an earlier read left part of one */
+        const char *head = data;
+        size_t head_avail = len, gathered = this->gathering ? this->partial.size() : 0;
+        if (gathered < 7 && strncmp(data, "HTTP/1." + gathered, len < 7 - gathered ? len : 7 - gathered) != 0)
+            return this->fail();
+        if (gathered > 0)
+        {
+            size_t take = this->max_head - gathered < len ? this->max_head - gathered : len;
+            this->partial.append(data, take);
+            head = this->partial.data();
+            head_avail = this->partial.size();
+        }
+
+        if (scan_head(head, head_avail, &this->index) == SCAN_MORE)
+        {
+            if (head_avail >= this->max_head)
+                return this->fail();
+            if (gathered == 0)
+                this->partial.assign(data, len);
+            this->gathering = true;
+            *consumed = len;
+            return FRAME_MORE;
+        }
+
+        /* an index into partial stays valid until the next call */
+        this->gathering = false;
+        this->head_len = this->index.head_len;
+        *consumed = this->head_len - gathered;
+        return this->start_body(head_request);
+    }
+
+    while (pos < len || this->state == BODY_EMPTY || (this->state == BODY_LENGTH && this->remaining == 0))
+    {
+        switch (this->state)
+        {
+            case BODY_EMPTY:
+                this->state = HEAD;
+                *consumed = pos;
+                return FRAME_DONE;
+
+            case BODY_LENGTH:
+            case CHUNK_DATA:
+            {
+                size_t n = this->remaining < len - pos ? (size_t)this->remaining : len - pos;
+                pos += n;
+                this->remaining -= n;
+                this->body_len += n;
+                this->body_wire_len += n;
+                if (this->remaining > 0)
+                    break;
+                if (this->state == BODY_LENGTH)
+                {
+                    this->state = HEAD;
+                    *consumed = pos;
+                    return FRAME_DONE;
+                }
+                this->state = CHUNK_DATA_LF;
+                break;
+            }
+
+            case BODY_CLOSE:
+            case BROKEN:
+                this->body_len += this->state == BODY_CLOSE ? len - pos : 0;
+                this->body_wire_len += len - pos;
+                pos = len;
+                break;
+
+            case CHUNK_SIZE:
+            {
+                char c = data[pos++];
+                this->body_wire_len++;
+                int digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+                if (digit >= 0)
+                {
+                    /* sizes beyond 2^60 are not plausible */
+                    if (this->remaining >> 60)
+                        return this->fail();
+                    this->remaining = this->remaining * 16 + digit;
+                    this->size_digits++;
+                }
+                else if (c == '\n')
+                {
+                    if (this->chunk_line_end() == FRAME_ERROR)
+                        return FRAME_ERROR;
+                }
+                else if (c == ';' || c == ' ' || c == '\t' || c == '\r')
+                    this->state = CHUNK_EXT;
+                else
+                    return this->fail();
+                break;
+            }
+
+            case CHUNK_EXT:
+            {
+                const char *lf = (const char*) memchr(data + pos, '\n', len - pos);
+                size_t n = lf != nullptr ? (size_t)(lf - (data + pos)) + 1 : len - pos;
+                pos += n;
+                this->body_wire_len += n;
+                if (lf != nullptr && this->chunk_line_end() == FRAME_ERROR)
+                    return FRAME_ERROR;
+                break;
+            }
+
+            case CHUNK_DATA_LF:
+            {
+                char c = data[pos++];
+                this->body_wire_len++;
+                if (c == '\n')
+                {
+                    this->state = CHUNK_SIZE;
+                    this->remaining = this->size_digits = 0;
+                }
+                else if (c != '\r')
+                    return this->fail();
+                break;
+            }
+
+            case TRAILER:
+            {
+                char c = data[pos++];
+                this->body_wire_len++;
+                if (c == '\n')
+                {
+                    if (this->line_len == 0)
+                    {
+                        this->state = HEAD;
+                        *consumed = pos;
+                        return FRAME_DONE;
+                    }
+                    this->line_len = 0;
+                }
+                else if (c != '\r')
+                    this->line_len++;
+                break;
+            }
+
+            case HEAD:
+                *consumed = pos;
+                return FRAME_MORE;
+        }
+    }
+
+    *consumed = pos;
+    return FRAME_MORE;
+}
+
+FrameStatus HttpResponseFramer::skip(size_t len)
+{
+    this->body_len += len;
+    this->body_wire_len += len;
+    if (this->state != BODY_LENGTH)
+        return FRAME_MORE;
+
+    this->remaining -= len;
+    if (this->remaining > 0)
+        return FRAME_MORE;
+    this->state = HEAD;
+    return FRAME_DONE;
+}
+
+bool HttpResponseFramer::finish_eof()
+{
+    if (this->state != BODY_CLOSE)
+        return false;
+    this->state = HEAD;
+    return true;
+}
+
+bool HttpResponseFramer::idle() const
+{
+    return this->state == HEAD && !this->gathering;
+}
+
+bool HttpResponseFramer::in_head() const
+{
+    return this->state == HEAD;
+}
+
+uint64_t HttpResponseFramer::splice_remaining() const
+{
+    if (this->state == BODY_CLOSE)
+        return UINT64_MAX;
+    return this->state == BODY_LENGTH ? this->remaining : 0;
+}
+
+bool http_slice_equals(http_slice slice, const char *str)
+{
+    return strlen(str) == slice.len && strncmp(slice.data, str, slice.len) == 0;
+}
+
+bool http_slice_iequals(http_slice slice, const char *str)
+{
+    return strlen(str) == slice.len && strncasecmp(slice.data, str, slice.len) == 0;
+}
+
+/* a Content-Length value, RFC 7230 section 3.3.2: digits only, so that no sign or suffix slips through */
+bool http_parse_length(const char *data, size_t len, long *length)
+{
+    if (len == 0)
+        return false;
+    long value = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i] < '0' || data[i] > '9' || value > (LONG_MAX - (data[i] - '0')) / 10)
+            return false;
+        value = value * 10 + (data[i] - '0');
+    }
+    *length = value;
+    return true;
+}
@@ -0,0 +1,138 @@
+#ifndef HTTP_PROXY_SERVER_HTTP_PARSER_H
+#define HTTP_PROXY_SERVER_HTTP_PARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "scan.h"
+
+#define HTTP_PARSER_MAX_HEADERS     64
+
+/* a view into the connection buffer, not NUL terminated */
+struct http_slice
+{
+    const char *data;
+    size_t len;
+};
+
+struct http_header
+{
+    http_slice name, value;
+};
+
+enum ParseStatus
+{
+    PARSE_INCOMPLETE, PARSE_DONE, PARSE_ERROR, PARSE_TOO_LARGE
+};
+
+/*
+ * Resumable HTTP/1.x request head parser. The caller keeps appending received
+ * bytes to one buffer and calls parse() with the whole buffer after every read;
+ * scanning continues where the previous call stopped. Once PARSE_DONE is
+ * returned the slices point into that buffer, no memory is allocated.
+ */
+class HttpRequestParser
+{
+    enum State
+    {
+        START, METHOD, PATH_START, PATH, VERSION_START, VERSION, LINE_LF,
+        HEADER_START, HEADER_NAME, HEADER_VALUE_START, HEADER_VALUE, HEADER_LF, HEAD_LF, DONE
+    };
+
+    struct span
+    {
+        size_t off, len;
+    };
+
+    State state;
+    size_t pos, mark;
+    size_t max_head;
+    span method_span, path_span, version_span;
+    span name_spans[HTTP_PARSER_MAX_HEADERS], value_spans[HTTP_PARSER_MAX_HEADERS];
+
+    void add_header(size_t end);
+    ParseStatus finish(const char *buffer);
+
+public:
+    http_slice method, path, version;
+    http_header headers[HTTP_PARSER_MAX_HEADERS];
+    size_t num_headers;
+    size_t line_len;    /* request line including its line break */
+    size_t head_len;    /* request line, headers and the empty line */
+
+    HttpRequestParser();
+    explicit HttpRequestParser(size_t max_head);
+    void set_max_head(size_t max_head);
+    void reset();
+    ParseStatus parse(const char *buffer, size_t len);
+    const http_slice *header(const char *name) const;
+};
+
+enum FrameStatus
+{
+    FRAME_MORE,     /* all bytes belong to the current response */
+    FRAME_HEAD,     /* a response head is complete, see index */
+    FRAME_DONE,     /* the response is complete, the next byte starts another */
+    FRAME_ERROR     /* not HTTP, the rest of the connection is passed through */
+};
+
+/*
+ * Follows the responses on one upstream connection. Bytes are only observed
+ * as they are relayed: a head split across reads is gathered until complete,
+ * then its body is delimited by Content-Length, by chunk sizes or, without
+ * either, by the server closing. feed() stops after every event so that the
+ * caller knows which bytes belong to which response.
+ */
+class HttpResponseFramer
+{
+    enum State
+    {
+        HEAD, BODY_EMPTY, BODY_LENGTH, BODY_CLOSE, CHUNK_SIZE, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_LF,
+        TRAILER, BROKEN
+    };
+
+    State state;
+    size_t max_head;
+    std::string partial;    /* head bytes of earlier reads */
+    bool gathering;         /* partial holds the start of the next head */
+    uint64_t remaining;     /* of the body or the current chunk */
+    size_t size_digits, line_len;
+
+    FrameStatus start_body(bool head_request);
+    FrameStatus chunk_line_end();
+    FrameStatus fail();
+
+public:
+    http_head_index index;  /* of the last head, valid until the next feed() */
+    int status_code;
+    bool keep_alive;
+    bool chunked;
+    long content_length;    /* -1 unless the body is framed by Content-Length */
+    size_t head_len;
+    uint64_t body_len;      /* body bytes without chunk framing */
+    uint64_t body_wire_len; /* body bytes as received */
+
+    explicit HttpResponseFramer(size_t max_head);
+    void reset();
+    /* consumes bytes up to the next event, head_request when the response answers a HEAD */
+    FrameStatus feed(const char *data, size_t len, bool head_request, size_t *consumed);
+    /* body bytes moved past feed(), at most splice_remaining() */
+    FrameStatus skip(size_t len);
+    /* the server closed, which completes a body delimited by closing */
+    bool finish_eof();
+
+    /* between responses */
+    bool idle() const;
+    /* reading a head, which may have arrived in part */
+    bool in_head() const;
+    /* body bytes that need no parsing, UINT64_MAX until the server closes */
+    uint64_t splice_remaining() const;
+};
+
+bool http_slice_equals(http_slice slice, const char *str);
+bool http_slice_iequals(http_slice slice, const char *str);
+/* false unless the value is all digits and fits a long */
+bool http_parse_length(const char *data, size_t len, long *length);
+
+#endif //HTTP_PROXY_SERVER_HTTP_PARSER_H
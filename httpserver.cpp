@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <cerrno>
@@ -17,175 +18,214 @@
 
 #include "libhttp.h"
 #include "wq.h"
+#include "affinity.h"
+#include "cache.h"
+#include "disk_cache.h"
+#include "conn_pool.h"
+#include "connector.h"
+#include "dns.h"
 #include "management.h"
+#include "relay.h"
 
 #define PROXY_PORT          8090
 
 using namespace std;
 
-pthread_mutex_t log_mutex;
-int num_threads = 16;
-
-void connection_handler(void *input)
+/* an acceptor with the workers that serve what it accepts */
+struct worker_group
 {
-    LogMsg **args = (LogMsg **)input;
-    LogMsg *msg = args[0], *client_to_server = args[1];
-    int src_fd = client_to_server ? msg->client_socket : msg->server_socket;
-    int dst_fd = client_to_server ? msg->server_socket : msg->client_socket;
+    int index;
+    int cpu;            /* -1 when the threads are not pinned */
+    int listen_fd;
+};
 
-    char *buffer = (char*) calloc(LIBHTTP_REQUEST_MAX_SIZE + 1, sizeof(char));
+int num_threads = 16;
+int num_shards = 0;     /* SO_REUSEPORT listeners, 0 for a single acceptor */
+bool numa_placement = false;
 
-    if (client_to_server != nullptr)
-    {
-        struct http_request *request;
-        while ((request = client_http_request_parse(src_fd, buffer, msg)) != nullptr)
-        {
-            if (request->client_req)
-                http_start_request(dst_fd, request->method, request->path, request->version);
-            http_send_data(dst_fd, buffer, strlen(buffer));
-            free_request(request);
-        }
-        http_send_response(src_fd, 400);
-    }
-    else
+/* answers a CONNECT and leaves the rest of the connection to a relay tunnel */
+static void open_tunnel(LogMsg *msg, struct http_request *request, const char *rest, size_t rest_len)
+{
+    msg->server_socket = Connector::getInstance()->open(request->host, request->port, &msg->trace);
+    if (msg->server_socket < 0)
     {
-        size_t bytes_read = 0;
-        while ((bytes_read = server_http_request_parse(src_fd, buffer, msg)) > 0)
-        {
-            http_send_data(dst_fd, buffer, bytes_read);
-        }
+        http_send_response(msg->client_socket, 502);
+        close(msg->client_socket);
+        delete(msg);
+        return;
     }
 
-    free(buffer);
-    shutdown(dst_fd, SHUT_RDWR);
-    close(dst_fd);
+    /* a client may start its handshake without waiting for the answer */
+    http_send_data(msg->server_socket, rest, rest_len);
+    http_send_string(msg->client_socket, "HTTP/1.1 200 Connection Established\r\n\r\n");
+    Relay::tunnel(msg, rest_len);
 }
 
-int connect_to_target(const char* server_proxy_hostname, uint16_t server_proxy_port)
+/* a worker gets a client once a relay loop has read its next request head, and never waits for more */
+void handle_proxy_request(LogMsg* msg)
 {
-    struct sockaddr_in target_address;
-    memset(&target_address, 0, sizeof(target_address));
-    target_address.sin_family = AF_INET;
-    target_address.sin_port = htons(server_proxy_port);
+    struct http_stream stream;
+    http_stream_init(&stream);
+    struct http_request request;
 
-    int target_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (target_fd == -1)
-    {
-        fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-        return -1;
-    }
+    /* the request head, and whatever the client sent behind it */
+    string pending;
+    pending.swap(msg->pending);
 
-    // set socket timeout
-    struct timeval timeout;
-    timeout.tv_sec = 30;
-    timeout.tv_usec = 0;
-    setsockopt(target_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
-    if (target_dns_entry == nullptr)
+    const char *data = pending.data();
+    size_t bytes_read = pending.size(), offset = 0, consumed = 0;
+    shared_ptr<cache_fetch> fetch;
+    while (true)
     {
-        fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-        close(target_fd);
-        return -1;
-    }
+        int status = STREAM_MORE;
+        while (status == STREAM_MORE && offset < bytes_read)
+        {
+            status = http_stream_feed(&stream, data + offset, bytes_read - offset, &consumed, &request);
+            offset += consumed;
+        }
 
-    char *dns_address = target_dns_entry->h_addr_list[0];
-    memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-    int connection_status = connect(target_fd, (struct sockaddr*) &target_address, sizeof(target_address));
-    if (connection_status < 0)
-    {
-        close(target_fd);
-        return -1;
-    }
+        /* after cache hits, the rest of the next head is awaited by a relay loop */
+        if (status == STREAM_MORE)
+        {
+            if (!stream.head_done)
+                msg->pending.assign(stream.head, stream.head_len);
+            msg->trace.accept = latency_now();
+            http_stream_free(&stream);
+            Relay::wait(msg);
+            return;
+        }
+        if (status != STREAM_HEAD)
+        {
+            http_send_response(msg->client_socket, 400);
+            http_stream_free(&stream);
+            close(msg->client_socket);
+            delete(msg);
+            return;
+        }
+        msg->trace.parsed = latency_now();
+        Management::getInstance()->handle_stats(stream.head, stream.head_len, &request, msg);
 
-    return target_fd;
-}
+        if (http_slice_equals(request.method, "CONNECT"))
+        {
+            open_tunnel(msg, &request, data + offset, bytes_read - offset);
+            http_stream_free(&stream);
+            return;
+        }
 
-void handle_proxy_request(LogMsg* msg)
-{
-    // set socket timeout
-    struct timeval timeout;
-    timeout.tv_sec = 30;
-    timeout.tv_usec = 0;
-    setsockopt(msg->client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    timeout.tv_sec = 60;
-    timeout.tv_usec = 0;
-    setsockopt(msg->client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (!ResponseCache::cacheable_request(&stream, &request))
+            break;
+        string key = ResponseCache::key(&request);
+        bool alone = msg->fetch_alone;
+        msg->fetch_alone = false;
+        shared_ptr<const cache_object> object = ResponseCache::getInstance()->lookup(key, request.headers.data);
+        disk_object disk;
+        bool keep_alive;
+        if (object)
+        {
+            http_send_data(msg->client_socket, object->response.data(), object->response.size());
+            keep_alive = object->keep_alive;
+        }
+        else if (DiskCache::enabled() && DiskCache::getInstance()->lookup(key, request.headers.data, &disk))
+            keep_alive = DiskCache::getInstance()->send(msg->client_socket, &disk) && disk.keep_alive;
+        else
+        {
+            /* a miss that is being fetched already waits for that response instead of fetching it again */
+            bool leader = false;
+            if (offset == bytes_read && !alone)
+                fetch = ResponseCache::getInstance()->join(key, &leader);
+            if (fetch && !leader)
+            {
+                if (Relay::follow(msg, &stream, fetch))
+                    return;
+                fetch.reset();
+            }
+            break;
+        }
+        msg->trace.last_byte = latency_now();
+        Management::getInstance()->record_latency(request.host, &msg->trace);
+        msg->trace = latency_trace();
+        if (!keep_alive)
+        {
+            http_stream_free(&stream);
+            close(msg->client_socket);
+            delete(msg);
+            return;
+        }
+    }
 
-    char *buffer = (char*) calloc(LIBHTTP_REQUEST_MAX_SIZE + 1, sizeof(char));
-    struct http_request *request = client_http_request_parse(msg->client_socket, buffer, msg);
-    if (request == nullptr || !request->client_req)
+    msg->server_socket = ConnPool::getInstance()->acquire(request.host, request.port);
+    if (msg->server_socket < 0)
+        msg->server_socket = Connector::getInstance()->open(request.host, request.port, &msg->trace);
+    if (msg->server_socket < 0)
     {
-        http_send_response(msg->client_socket, 400);
-        free(buffer);
+        http_send_response(msg->client_socket, 502);
+        if (fetch)
+            ResponseCache::getInstance()->abandon(fetch.get());
+
+        http_stream_free(&stream);
         close(msg->client_socket);
         delete(msg);
         return;
     }
 
-    msg->server_socket = connect_to_target(request->host, request->port);
-    if (msg->server_socket < 0)
+    /* both directions are relayed by the event loops from here on */
+    if (!Relay::dispatch(msg, &stream, &request, data + offset, bytes_read - offset, fetch))
     {
-        http_send_response(msg->client_socket, 502);
+        http_send_response(msg->client_socket, 400);
+        if (fetch)
+            ResponseCache::getInstance()->abandon(fetch.get());
 
-        free_request(request);
-        free(buffer);
+        http_stream_free(&stream);
+        close(msg->server_socket);
         close(msg->client_socket);
         delete(msg);
-        return;
     }
-    http_start_request(msg->server_socket, request->method, request->path, request->version);
-    http_send_data(msg->server_socket, buffer, strlen(buffer) + 1);
-    free_request(request);
-    free(buffer);
-
-    LogMsg *t_c_args[2];
-    t_c_args[0] = msg; t_c_args[1] = nullptr;
-    pthread_t target_to_client_thread;
-    pthread_create(&target_to_client_thread, nullptr, (void *(*)(void *))connection_handler, (void *)t_c_args);
-
-    LogMsg *c_t_args[2];
-    c_t_args[0] = msg; c_t_args[1] = (LogMsg*)1;
-    connection_handler((void *)c_t_args);  // receive data from client and send it to target server
-
-    pthread_join(target_to_client_thread, nullptr);
-    delete(msg);
 }
 
 void worker_thread_loop(void *input)
 {
-    void (*request_handler)(LogMsg*) = (void (*)(LogMsg*))input;
+    worker_group *group = (worker_group*)input;
+    if (group->cpu >= 0)
+    {
+        affinity_pin(group->cpu);
+        Relay::set_home(group->index);
+    }
+
+    WQ *queue = WQ::getInstance(group->index);
     while (true)
     {
-        LogMsg *msg = WQ::getInstance()->pop();
-        request_handler(msg);
+        bool shed;
+        LogMsg *msg = queue->pop(&shed);
+        if (shed)
+            http_refuse_connection(msg);
+        else
+            handle_proxy_request(msg);
     }
 }
 
-void init_thread_pool(int num_threads)
+void init_thread_pool(worker_group *group, int num_threads)
 {
     for (int i = 0; i < num_threads; i++)
     {
         pthread_t worker_thread;
-        pthread_create(&worker_thread, nullptr, (void *(*)(void *))worker_thread_loop, (void*)handle_proxy_request);
+        pthread_create(&worker_thread, nullptr, (void *(*)(void *))worker_thread_loop, (void*)group);
     }
 }
 
-void serve_forever(int *socket_number)
+int open_listener(bool reuse_port)
 {
-    struct sockaddr_in server_address, client_address;
-    size_t client_address_length = sizeof(client_address);
-    int client_socket_number;
+    struct sockaddr_in server_address;
 
-    *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-    if (*socket_number == -1)
+    int socket_number = socket(PF_INET, SOCK_STREAM, 0);
+    if (socket_number == -1)
     {
         perror("Failed to create a new socket");
         exit(errno);
     }
 
     int socket_option = 1;
-    if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option, sizeof(socket_option)) == -1)
+    if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option, sizeof(socket_option)) == -1 ||
+        (reuse_port && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT, &socket_option, sizeof(socket_option)) == -1))
     {
         perror("Failed to set socket options.");
         exit(errno);
@@ -197,49 +237,163 @@ void serve_forever(int *socket_number)
 //     server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
     server_address.sin_port = htons(PROXY_PORT);
 
-    if (bind(*socket_number, (struct sockaddr *) &server_address, sizeof(server_address)) == -1)
+    if (bind(socket_number, (struct sockaddr *) &server_address, sizeof(server_address)) == -1)
     {
         perror("Failed to bind on socket");
         exit(errno);
     }
 
-    if (listen(*socket_number, num_threads * 16) == -1)
+    if (listen(socket_number, num_threads * 16) == -1)
     {
         perror("Failed to listen on socket");
         exit(errno);
     }
 
-    LOG("Listening on port %d...\n", PROXY_PORT);
+    return socket_number;
+}
+
+/* an accepted client goes to the workers through a relay loop, once its first request head has arrived */
+static void enqueue_client(worker_group *group, int client_socket_number, struct sockaddr_in *client_address)
+{
+    log_accept(inet_ntoa(client_address->sin_addr), client_address->sin_port);
+
+    LogMsg *msg = new LogMsg();
+    msg->trace.accept = latency_now();
+    msg->set_client_addr(inet_ntoa(client_address->sin_addr));
+    msg->client_socket = client_socket_number;
+    msg->client_port = client_address->sin_port;
+    msg->queue = group->index;
+    http_set_nodelay(client_socket_number);
+
+    /* workers send cache hits and error responses blocking */
+    struct timeval timeout;
+    timeout.tv_sec = 60;
+    timeout.tv_usec = 0;
+    setsockopt(client_socket_number, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    Relay::wait(msg);
+}
+
+/* one multishot accept keeps completing clients, returns false if the kernel cannot do that */
+static bool accept_loop_uring(worker_group *group)
+{
+    Uring ring;
+    if (!ring.init(64))
+        return false;
+
+    bool armed = false, accepted = false;
+    while (true)
+    {
+        if (!armed)
+        {
+            io_uring_sqe *sqe = ring.get_sqe();
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = group->listen_fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            armed = true;
+        }
+        if (ring.submit(1, -1) < 0 && errno != EINTR)
+            perror("Acceptor io_uring_enter failed");
+
+        io_uring_cqe *cqe;
+        while ((cqe = ring.peek()) != nullptr)
+        {
+            int client_socket_number = cqe->res;
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                armed = false;
+            ring.advance();
+
+            if (client_socket_number == -EINVAL && !accepted)
+                return false;
+            if (client_socket_number < 0)
+            {
+                errno = -client_socket_number;
+                perror("Error accepting socket");
+                continue;
+            }
+            accepted = true;
+
+            struct sockaddr_in client_address;
+            socklen_t client_address_length = sizeof(client_address);
+            getpeername(client_socket_number, (struct sockaddr *)&client_address, &client_address_length);
+            enqueue_client(group, client_socket_number, &client_address);
+        }
+    }
+}
+
+void accept_loop(void *input)
+{
+    worker_group *group = (worker_group*)input;
+    struct sockaddr_in client_address;
+    size_t client_address_length = sizeof(client_address);
+    int client_socket_number;
+
+    if (group->cpu >= 0)
+    {
+        affinity_pin(group->cpu);
+        Relay::set_home(group->index);
+    }
 
-    WQ::getInstance();
-    init_thread_pool(num_threads);
+    if (Relay::backend == RELAY_URING && accept_loop_uring(group))
+        return;
 
     while (true)
     {
-        client_socket_number = accept(*socket_number, (struct sockaddr *)&client_address, (socklen_t *)&client_address_length);
+        client_socket_number = accept(group->listen_fd, (struct sockaddr *)&client_address, (socklen_t *)&client_address_length);
         if (client_socket_number < 0)
         {
             perror("Error accepting socket");
             continue;
         }
 
-        LOG("Accepted connection from %s on port %d\n", inet_ntoa(client_address.sin_addr), client_address.sin_port);
-
-//        pthread_t worker_thread;
-//        pthread_create(&worker_thread, nullptr, (void *(*)(void *))handle_proxy_request, (void*)(intptr_t)client_socket_number);
-//        pthread_detach(worker_thread);
+        enqueue_client(group, client_socket_number, &client_address);
+    }
+}
 
-        LogMsg *msg = new LogMsg();
-        msg->client_addr = (char*)calloc(strlen(inet_ntoa(client_address.sin_addr))+1, sizeof(char));
-        msg->client_socket = client_socket_number;
-        strcpy(msg->client_addr, inet_ntoa(client_address.sin_addr));
-        msg->client_port = client_address.sin_port;
+void serve_forever(int *socket_number)
+{
+    int num_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
 
-        WQ::getInstance()->push(msg);
+    if (num_shards == 0)
+    {
+        worker_group *group = new worker_group{0, -1, open_listener(false)};
+        *socket_number = group->listen_fd;
+        LOG("Listening on port %d...\n", PROXY_PORT);
+
+        WQ::init(1);
+        Relay::init(num_cpus);
+        init_thread_pool(group, num_threads);
+        accept_loop(group);
+        return;
     }
 
-    shutdown(*socket_number, SHUT_RDWR);
-    close(*socket_number);
+    /* every shard accepts on its own socket and keeps its connections on one core */
+    vector<int> cpus = affinity_cpus(numa_placement);
+    if (cpus.empty())
+        for (int cpu = 0; cpu < num_cpus; cpu++)
+            cpus.push_back(cpu);
+
+    vector<worker_group*> groups;
+    for (int i = 0; i < num_shards; i++)
+        groups.push_back(new worker_group{i, cpus[i % cpus.size()], open_listener(true)});
+    *socket_number = groups[0]->listen_fd;
+    LOG("Listening on port %d with %d acceptor shards...\n", PROXY_PORT, num_shards);
+
+    WQ::init(num_shards);
+    vector<int> loop_cpus(cpus.begin(), cpus.begin() + min((size_t)num_shards, cpus.size()));
+    Relay::init((int)loop_cpus.size(), &loop_cpus);
+
+    int group_threads = (num_threads + num_shards - 1) / num_shards;
+    for (int i = 0; i < num_shards; i++)
+    {
+        init_thread_pool(groups[i], group_threads);
+        if (i > 0)
+        {
+            pthread_t acceptor_thread;
+            pthread_create(&acceptor_thread, nullptr, (void *(*)(void *))accept_loop, (void*)groups[i]);
+        }
+    }
+    accept_loop(groups[0]);
 }
 
 int server_fd;
@@ -261,16 +415,103 @@ void signal_callback_handler(int signum)
 }
 
 
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-H max_header_size] [-C cache_megabytes] [-D cache_dir] [-G disk_cache_megabytes]"
+                    " [-l log_level] [-o log_file] [-S shards] [-N] [-K top_capacity]"
+                    " [-Q queue_depth] [-W queue_delay_ms] [-L fifo|lifo|codel]"
+                    " [-B epoll|uring]\n", name);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
+    int opt;
+    const char *log_path = nullptr;
+    while ((opt = getopt(argc, argv, "H:C:D:G:l:o:S:NK:Q:W:L:B:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'H':
+                http_max_head_size = (size_t)atol(optarg);
+                break;
+            case 'C':
+                ResponseCache::memory_budget = (size_t)atol(optarg) * 1024 * 1024;
+                break;
+            case 'D':
+                DiskCache::directory = optarg;
+                break;
+            case 'G':
+                DiskCache::budget = (uint64_t)atol(optarg) * 1024 * 1024;
+                if (DiskCache::budget == 0)
+                    usage(argv[0]);
+                break;
+            case 'l':
+                log_level = log_parse_level(optarg);
+                if (log_level < 0)
+                    usage(argv[0]);
+                break;
+            case 'o':
+                log_path = optarg;
+                break;
+            case 'S':
+                num_shards = atoi(optarg);
+                if (num_shards <= 0)
+                    usage(argv[0]);
+                break;
+            case 'N':
+                numa_placement = true;
+                break;
+            case 'K':
+                Management::top_capacity = (size_t)atol(optarg);
+                if (Management::top_capacity == 0)
+                    usage(argv[0]);
+                break;
+            case 'Q':
+                WQ::max_depth = (size_t)atol(optarg);
+                if (WQ::max_depth == 0)
+                    usage(argv[0]);
+                break;
+            case 'W':
+                WQ::max_delay_ms = (uint64_t)atol(optarg);
+                break;
+            case 'L':
+                if (!WQ::parse_policy(optarg))
+                    usage(argv[0]);
+                break;
+            case 'B':
+                if (strcmp(optarg, "epoll") == 0)
+                    Relay::backend = RELAY_EPOLL;
+                else if (strcmp(optarg, "uring") == 0)
+                    Relay::backend = RELAY_URING;
+                else
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (http_max_head_size == 0)
+        usage(argv[0]);
+
     signal(SIGINT, signal_callback_handler);
     signal(SIGPIPE, SIG_IGN);
     signal(SIGSEGV, signal_callback_handler);
 
-    pthread_mutex_init(&log_mutex, nullptr);
+    log_init(log_path);
     Management::getInstance();
+    BufferPool::getInstance();
+    ConnPool::getInstance();
+    DNSResolver::getInstance();
+    ResponseCache::getInstance();
 
     pthread_t pthread;
+    if (DiskCache::enabled())
+    {
+        DiskCache::getInstance();
+        pthread_create(&pthread, nullptr, (void *(*)(void *))DiskCache::compaction_loop, nullptr);
+        pthread_create(&pthread, nullptr, (void *(*)(void *))DiskCache::writer_loop, nullptr);
+    }
     pthread_create(&pthread, nullptr, (void *(*)(void *))Management::handle_requests, nullptr);
 
     serve_forever(&server_fd);
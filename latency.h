@@ -0,0 +1,140 @@
+#ifndef HTTP_PROXY_SERVER_LATENCY_H
+#define HTTP_PROXY_SERVER_LATENCY_H
+
+#include <cstdint>
+#include <ctime>
+
+#define LATENCY_SUB_BITS    5       /* 32 buckets per power of two, values within 3% */
+#define LATENCY_MAX_BITS    32      /* microseconds, a bit over an hour */
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+enum LatencyPhase
+{
+    PHASE_PARSE, PHASE_DNS, PHASE_CONNECT, PHASE_FIRST_BYTE, PHASE_TRANSFER, PHASE_TOTAL, LATENCY_PHASES
+};
+
+/* monotonic nanoseconds at which a request reached each phase, 0 where it skipped one */
+struct latency_trace
+{
+    uint64_t accept;        /* unset for later requests on a connection */
+    uint64_t parsed;
+    uint64_t dns;           /* unset when the upstream came from the pool */
+    uint64_t connect;
+    uint64_t first_byte;
+    uint64_t last_byte;
+};
+
+inline uint64_t latency_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Log-bucketed histogram in the style of HdrHistogram: every power of two is
+ * split into 2^LATENCY_SUB_BITS linear buckets, so the relative error is the
+ * same for microseconds and minutes. Plain data, it is copied and summed.
+ */
+class LatencyHistogram
+{
+    uint32_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+
+    static int index(uint64_t value)
+    {
+        if (value >= (1ull << LATENCY_MAX_BITS))
+            value = (1ull << LATENCY_MAX_BITS) - 1;
+        if (value < (1u << LATENCY_SUB_BITS))
+            return (int)value;
+
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - LATENCY_SUB_BITS;
+        return ((shift + 1) << LATENCY_SUB_BITS) + (int)((value >> shift) - (1u << LATENCY_SUB_BITS));
+    }
+
+    /* largest value that falls into the bucket */
+    static uint64_t highest(int index)
+    {
+        if (index < (1 << LATENCY_SUB_BITS))
+            return (uint64_t)index;
+
+        int shift = (index >> LATENCY_SUB_BITS) - 1;
+        uint64_t sub = (uint64_t)(index & ((1 << LATENCY_SUB_BITS) - 1)) + (1u << LATENCY_SUB_BITS);
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    void Clear()
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            counts[i] = 0;
+        total = sum = max = 0;
+    }
+
+    void Push(uint64_t value)
+    {
+        counts[index(value)]++;
+        total++;
+        sum += value;
+        if (value > max)
+            max = value;
+    }
+
+    void Merge(const LatencyHistogram &other)
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        if (other.max > max)
+            max = other.max;
+    }
+
+    uint64_t Count() const
+    {
+        return total;
+    }
+
+    uint64_t Sum() const
+    {
+        return sum;
+    }
+
+    /* values recorded in buckets that end at or below value */
+    uint64_t CountAtMost(uint64_t value) const
+    {
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS && highest(i) <= value; i++)
+            seen += counts[i];
+        return seen;
+    }
+
+    uint64_t Max() const
+    {
+        return max;
+    }
+
+    uint64_t Percentile(double p) const
+    {
+        if (total == 0)
+            return 0;
+
+        uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+        if (rank == 0)
+            rank = 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return highest(i) < max ? highest(i) : max;
+        }
+        return max;
+    }
+};
+
+#endif //HTTP_PROXY_SERVER_LATENCY_H
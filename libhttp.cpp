@@ -4,193 +4,499 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <strings.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "management.h"
 
-void free_request(struct http_request *request)
+size_t http_max_head_size = LIBHTTP_REQUEST_MAX_SIZE;
+
+void http_stream_init(struct http_stream *stream)
+{
+    stream->parser.set_max_head(http_max_head_size);
+    stream->parser.reset();
+    stream->head = BufferPool::getInstance()->get(BUFFER_HEAD);
+    stream->head_len = 0;
+    stream->head_done = false;
+    stream->body_remaining = 0;
+    stream->chunk_state = STREAM_CHUNK_SIZE;
+    stream->chunk_remaining = stream->chunk_digits = stream->line_len = 0;
+}
+
+/* the line break after a chunk size, or after the last chunk */
+static bool chunk_line_end(struct http_stream *stream)
+{
+    if (stream->chunk_digits == 0)
+        return false;
+    stream->chunk_state = stream->chunk_remaining == 0 ? STREAM_CHUNK_TRAILER : STREAM_CHUNK_DATA;
+    stream->line_len = 0;
+    return true;
+}
+
+/* passes a chunked body through up to its end, RFC 7230 section 4.1, so that the next request head is found */
+static int chunked_body(struct http_stream *stream, const char *data, size_t len, size_t *consumed)
+{
+    size_t pos = 0;
+    while (pos < len && stream->body_remaining != 0)
+    {
+        char c = data[pos];
+        switch (stream->chunk_state)
+        {
+            case STREAM_CHUNK_SIZE:
+            {
+                pos++;
+                int digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+                if (digit >= 0 && (stream->chunk_remaining >> 60) == 0)
+                {
+                    stream->chunk_remaining = stream->chunk_remaining * 16 + digit;
+                    stream->chunk_digits++;
+                }
+                else if (c == ';' || c == ' ' || c == '\t' || c == '\r')
+                    stream->chunk_state = STREAM_CHUNK_EXT;
+                else if (c != '\n' || !chunk_line_end(stream))
+                    return STREAM_ERROR;
+                break;
+            }
+
+            case STREAM_CHUNK_EXT:
+            {
+                const char *lf = (const char*) memchr(data + pos, '\n', len - pos);
+                pos = lf != nullptr ? lf - data + 1 : len;
+                if (lf != nullptr && !chunk_line_end(stream))
+                    return STREAM_ERROR;
+                break;
+            }
+
+            case STREAM_CHUNK_DATA:
+            {
+                size_t n = stream->chunk_remaining < len - pos ? (size_t)stream->chunk_remaining : len - pos;
+                pos += n;
+                stream->chunk_remaining -= n;
+                if (stream->chunk_remaining == 0)
+                    stream->chunk_state = STREAM_CHUNK_DATA_LF;
+                break;
+            }
+
+            case STREAM_CHUNK_DATA_LF:
+                pos++;
+                if (c == '\n')
+                {
+                    stream->chunk_state = STREAM_CHUNK_SIZE;
+                    stream->chunk_remaining = stream->chunk_digits = 0;
+                }
+                else if (c != '\r')
+                    return STREAM_ERROR;
+                break;
+
+            case STREAM_CHUNK_TRAILER:
+                /* trailer lines up to an empty one */
+                pos++;
+                if (c == '\n' && stream->line_len == 0)
+                    stream->body_remaining = 0;
+                else if (c == '\n')
+                    stream->line_len = 0;
+                else if (c != '\r')
+                    stream->line_len++;
+                break;
+
+            default:
+                return STREAM_ERROR;
+        }
+    }
+
+    *consumed = pos;
+    return STREAM_BODY;
+}
+
+void http_stream_free(struct http_stream *stream)
+{
+    BufferPool::getInstance()->put(BUFFER_HEAD, stream->head);
+}
+
+bool http_stream_idle(const struct http_stream *stream)
 {
-    if (request->method)
-        free(request->method);
-    if (request->path)
-        free(request->path);
-    if (request->version)
-        free(request->version);
-    if (request->host)
-        free(request->host);
-    free(request);
+    return stream->body_remaining == 0 && (stream->head_done || stream->head_len == 0);
 }
 
-struct http_request *client_http_request_parse(int fd, char *buffer, LogMsg *msg)
+/* fills the request from a parsed head, rewriting an absolute path to origin form */
+static bool http_request_from_head(struct http_stream *stream, struct http_request *request)
 {
-    struct http_request *request = (http_request*) calloc(1, sizeof(struct http_request));
-    if (request == nullptr)
+    const HttpRequestParser *parser = &stream->parser;
+    bool connect = http_slice_equals(parser->method, "CONNECT");
+
+    request->method = parser->method;
+    request->path = parser->path;
+    request->version = parser->version;
+    request->headers.data = stream->head + parser->line_len;
+    request->headers.len = parser->head_len - parser->line_len;
+    request->client_req = true;
+
+    http_slice authority = {nullptr, 0};
+    request->authority = authority;
+    if (connect)
+        authority = request->path;
+    else if (request->path.len > strlen("http://") && strncasecmp(request->path.data, "http://", 7) == 0)
     {
-        fprintf(stderr, "Malloc failed\n");
-        exit(ENOBUFS);
+        authority.data = request->path.data + strlen("http://");
+        const char *path_start = (const char*) memchr(authority.data, '/', request->path.data + request->path.len - authority.data);
+        if (path_start == nullptr)
+            path_start = request->path.data + request->path.len;
+        authority.len = path_start - authority.data;
+
+        /* remove host from path */
+        request->path.len -= path_start - request->path.data;
+        request->path.data = path_start;
+        if (request->path.len == 0)
+            request->path = {"/", 1};
+        request->authority = authority;
     }
 
-    char *read_buffer = (char*) calloc(LIBHTTP_REQUEST_MAX_SIZE + 1, sizeof(char));
-    if (read_buffer == nullptr)
+    /* the Host header only names the target of an origin-form request, RFC 7230 section 5.4 */
+    const http_slice *host = parser->header("Host");
+    if (authority.len == 0 && host != nullptr)
+        authority = *host;
+    if (authority.len == 0)
+        return false;
+
+    /* an IPv6 literal is bracketed, and resolved without the brackets */
+    const char *end = authority.data + authority.len, *host_start = authority.data, *port = nullptr;
+    size_t host_len;
+    if (authority.data[0] == '[')
     {
-        fprintf(stderr, "Malloc failed\n");
-        exit(ENOBUFS);
+        const char *bracket = (const char*) memchr(authority.data, ']', authority.len);
+        if (bracket == nullptr || (bracket + 1 < end && bracket[1] != ':'))
+            return false;
+        host_start++;
+        host_len = bracket - host_start;
+        port = bracket + 1 < end ? bracket + 2 : nullptr;
     }
+    else
+    {
+        const char *colon = (const char*) memchr(authority.data, ':', authority.len);
+        host_len = (colon != nullptr ? colon : end) - host_start;
+        port = colon != nullptr ? colon + 1 : nullptr;
+    }
+    if (host_len == 0 || host_len > LIBHTTP_MAX_HOST)
+        return false;
+
+    memcpy(request->host, host_start, host_len);
+    request->host[host_len] = '\0';
+    request->port = port != nullptr ? (uint16_t)atoi(port) : connect ? 443 : 80;
+    return true;
+}
 
-    size_t bytes_read;
-    if ((bytes_read = http_receive_data(fd, read_buffer)) == 0)
+int http_stream_feed(struct http_stream *stream, const char *data, size_t len, size_t *consumed, struct http_request *request)
+{
+    /* the previous head was handed out, start over with the next one */
+    if (stream->head_done)
     {
-        free_request(request);
-        free(read_buffer);
-        return nullptr;
+        stream->parser.reset();
+        stream->head_len = 0;
+        stream->head_done = false;
     }
 
-    /* return if the buffer dose'nt have header */
-    char *tmp = strstr(read_buffer, " HTTP/1.");
-    if (tmp == nullptr)
+    if (stream->body_remaining < 0)
+        return chunked_body(stream, data, len, consumed);
+    if (stream->body_remaining > 0)
     {
-        memcpy(buffer, read_buffer, bytes_read);
-        free(read_buffer);
-        return request;
+        size_t body_len = (size_t)stream->body_remaining < len ? (size_t)stream->body_remaining : len;
+        stream->body_remaining -= body_len;
+        *consumed = body_len;
+        return STREAM_BODY;
     }
 
-    char *read_start, *read_end;
-    size_t read_size;
-    do
+    size_t copy_len = http_max_head_size - stream->head_len;
+    if (copy_len > len)
+        copy_len = len;
+    memcpy(stream->head + stream->head_len, data, copy_len);
+
+    ParseStatus status = stream->parser.parse(stream->head, stream->head_len + copy_len);
+    if (status == PARSE_INCOMPLETE)
     {
-        /* Read in the HTTP method: "[A-Z]*" */
-        read_start = read_end = read_buffer;
-        while (*read_end >= 'A' && *read_end <= 'Z')
-            read_end++;
-        read_size = read_end - read_start;
-        if (read_size == 0)
-            break;
-        request->method = (char*) malloc(read_size + 1);
-        memcpy(request->method, read_start, read_size);
-        request->method[read_size] = '\0';
-
-        /* Read in a space character. */
-        read_start = read_end;
-        if (*read_end != ' ')
-            break;
-        read_end++;
-
-        /* Read in the path: "[^ \r\n]*" */
-        read_start = read_end;
-        while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n' && *read_end != '\r')
-            read_end++;
-        read_size = read_end - read_start;
-        if (read_size == 0)
-            break;
-        request->path = (char*) malloc(read_size + 1);
-        memcpy(request->path, read_start, read_size);
-        request->path[read_size] = '\0';
-
-        /* Read in a space character. */
-        read_start = read_end;
-        if (*read_end != ' ')
-            break;
-        read_end++;
-
-        /* Read in the HTTP version: "[^ \r\n]*" */
-        read_start = read_end;
-        while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n' && *read_end != '\r')
-            read_end++;
-        read_size = read_end - read_start;
-        if (read_size == 0)
-            break;
-        request->version = (char*) malloc(read_size + 1);
-        memcpy(request->version, read_start, read_size);
-        request->version[read_size] = '\0';
-
-        /* Read in rest of request line: ".*" */
-        read_start = read_end;
-        while (*read_end != '\0' && *read_end != '\n')
-            read_end++;
-        if (*read_end != '\n')
-            break;
-        read_end++;
-
-        /* copy rest of buffer */
-        read_size = read_end - read_buffer;
-        memcpy(buffer, read_end, bytes_read - read_size + 1);
-
-        /* Read in the host: "[^ \r\n]*" */
-        read_end = strstr(read_end, "Host: ");
-        if (read_end == nullptr)
-            break;
-        read_start = read_end = read_end + strlen("Host: ");
-        while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n' && *read_end != '\r')
-            read_end++;
-        read_size = read_end - read_start;
-        if (read_size == 0)
-            break;
-        request->host = (char*) malloc(read_size + 1);
-        memcpy(request->host, read_start, read_size);
-        request->host[read_size] = '\0';
+        stream->head_len += copy_len;
+        *consumed = copy_len;
+        return STREAM_MORE;
+    }
+    if (status != PARSE_DONE)
+        return STREAM_ERROR;
 
-        /* remove host from path */
-        read_start = strstr(request->path, request->host);
-        if (read_start != nullptr)
+    *consumed = stream->parser.head_len - stream->head_len;
+    stream->head_len = stream->parser.head_len;
+    stream->head[stream->head_len] = '\0';
+    stream->head_done = true;
+
+    if (!http_request_from_head(stream, request))
+        return STREAM_ERROR;
+
+    /* request body framing: a coding other than chunked last leaves no way to find the end, RFC 7230 section 3.3.3 */
+    const http_slice *transfer_encoding = stream->parser.header("Transfer-Encoding");
+    if (transfer_encoding != nullptr)
+    {
+        if (transfer_encoding->len < 7 ||
+            strncasecmp(transfer_encoding->data + transfer_encoding->len - 7, "chunked", 7) != 0)
+            return STREAM_ERROR;
+        stream->body_remaining = -1;
+        stream->chunk_state = STREAM_CHUNK_SIZE;
+        stream->chunk_remaining = stream->chunk_digits = 0;
+    }
+    else
+    {
+        /* a length that is not plain digits, or two that differ, could frame the body differently upstream */
+        bool framed = false;
+        for (size_t i = 0; i < stream->parser.num_headers; i++)
         {
-            read_start += strlen(request->host);
-            read_end = read_start;
-            while (*read_end != '\0')
-                read_end++;
-            read_size = read_end - read_start;
-            if (read_size == 0 && strcmp(request->method, "CONNECT") != 0)
-                break;
+            const http_header *header = &stream->parser.headers[i];
+            long length;
+            if (!http_slice_iequals(header->name, "Content-Length"))
+                continue;
+            if (!http_parse_length(header->value.data, header->value.len, &length) ||
+                (framed && length != stream->body_remaining))
+                return STREAM_ERROR;
+            stream->body_remaining = length;
+            framed = true;
+        }
+    }
 
-            if (strcmp(request->method, "CONNECT") != 0)
-            {
-                char *tmp = (char*)calloc(read_size + 1, sizeof(char));
-                memcpy(tmp, read_start, read_size);
+    return STREAM_HEAD;
+}
 
-                free(request->path);
-                request->path = (char*) malloc(read_size + 1);
-                memcpy(request->path, tmp, read_size + 1);
-                free(tmp);
-            }
+/* headers that only concern the client's connection to us, RFC 7230 section 6.1 */
+static const char *hop_by_hop_headers[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade"};
+
+static bool token_equals(const char *data, size_t len, const char *token)
+{
+    return len == strlen(token) && strncasecmp(data, token, len) == 0;
+}
+
+/* splits a Connection or Proxy-Connection value into its options */
+static void connection_options(const char *value, const char *end, http_slice *names, int *num_names,
+                               bool *close, bool *keep_alive)
+{
+    while (value < end)
+    {
+        const char *comma = (const char*)memchr(value, ',', end - value);
+        const char *token_end = comma != nullptr ? comma : end;
+        while (value < token_end && (*value == ' ' || *value == '\t'))
+            value++;
+        size_t len = token_end - value;
+        while (len > 0 && strchr(" \t\r\n", value[len - 1]) != nullptr)
+            len--;
+
+        if (token_equals(value, len, "close"))
+            *close = true;
+        else if (token_equals(value, len, "keep-alive"))
+            *keep_alive = true;
+        else if (len > 0 && *num_names < LIBHTTP_CONNECTION_OPTIONS)
+            names[(*num_names)++] = {value, len};
+        value = token_end + 1;
+    }
+}
+
+/*
+ * The head as it goes upstream, without copying: the request line with the
+ * rewritten path, then the runs of header lines that are not hop-by-hop, then
+ * a Connection header carrying the client's close or keep-alive. Returns the
+ * number of entries, or -1 if they do not fit.
+ */
+int http_request_head_iov(const struct http_request *request, struct iovec *iov, int max_iov)
+{
+    const char *headers = request->headers.data, *end = headers + request->headers.len;
+    http_slice names[LIBHTTP_CONNECTION_OPTIONS];
+    int num_names = 0, count = 0;
+    bool close = false, keep_alive = false;
+
+    /* a Host that disagrees with an absolute-form target is replaced by the target's authority */
+    bool replace_host = request->authority.len > 0;
+    for (const char *line = headers; line < end && *line != '\r' && *line != '\n';)
+    {
+        const char *next = (const char*)memchr(line, '\n', end - line);
+        next = next != nullptr ? next + 1 : end;
+        const char *colon = (const char*)memchr(line, ':', next - line);
+        if (colon != nullptr && (token_equals(line, colon - line, "Connection") ||
+                                 token_equals(line, colon - line, "Proxy-Connection")))
+            connection_options(colon + 1, next, names, &num_names, &close, &keep_alive);
+        if (colon != nullptr && replace_host && token_equals(line, colon - line, "Host"))
+        {
+            const char *value = colon + 1;
+            while (value < next && (*value == ' ' || *value == '\t'))
+                value++;
+            size_t value_len = http_header_value_len(value);
+            replace_host = value_len != request->authority.len || strncasecmp(value, request->authority.data, value_len) != 0;
         }
+        line = next;
+    }
+    int reserved = replace_host ? 4 : 1;
+
+    if (max_iov < 6 + reserved)
+        return -1;
+    iov[count++] = {(void*)request->method.data, request->method.len};
+    iov[count++] = {(void*)" ", 1};
+    iov[count++] = {(void*)request->path.data, request->path.len};
+    iov[count++] = {(void*)" ", 1};
+    iov[count++] = {(void*)request->version.data, request->version.len};
+    iov[count++] = {(void*)"\r\n", 2};
+
+    const char *run = nullptr, *line = headers;
+    bool dropped = false;
+    while (line < end && *line != '\r' && *line != '\n')
+    {
+        const char *next = (const char*)memchr(line, '\n', end - line);
+        next = next != nullptr ? next + 1 : end;
 
-        /* extract port from host */
-        request->port = 80;
-        if (strchr(request->host, ':'))
+        /* a folded line goes wherever the one it continues went */
+        if (*line != ' ' && *line != '\t')
         {
-            char *colon = strchr(request->host, ':');
-            *colon = '\0';
-            request->port = (uint16_t)atoi(colon + 1);
+            const char *colon = (const char*)memchr(line, ':', next - line);
+            size_t name_len = colon != nullptr ? colon - line : 0;
+            dropped = false;
+            for (const char *name : hop_by_hop_headers)
+                dropped = dropped || token_equals(line, name_len, name);
+            for (int i = 0; i < num_names; i++)
+                dropped = dropped || (name_len == names[i].len && strncasecmp(line, names[i].data, name_len) == 0);
+            dropped = dropped || (replace_host && token_equals(line, name_len, "Host"));
         }
 
-        request->client_req = true;
-        Management::getInstance()->handle_stats(read_buffer, request, msg);
+        if (!dropped && run == nullptr)
+            run = line;
+        else if (dropped && run != nullptr)
+        {
+            if (count == max_iov - reserved)
+                return -1;
+            iov[count++] = {(void*)run, (size_t)(line - run)};
+            run = nullptr;
+        }
+        line = next;
+    }
+    if (run != nullptr)
+    {
+        if (count == max_iov - reserved)
+            return -1;
+        iov[count++] = {(void*)run, (size_t)(line - run)};
+    }
 
-        free(read_buffer);
-        return request;
+    if (replace_host)
+    {
+        iov[count++] = {(void*)"Host: ", 6};
+        iov[count++] = {(void*)request->authority.data, request->authority.len};
+        iov[count++] = {(void*)"\r\n", 2};
     }
-    while (0);
 
-    /* An error occurred. */
-//    LOG("\nError in parsing packet:\n%s\n", read_buffer);
-    free_request(request);
-    free(read_buffer);
-    return nullptr;
+    const char *last = close ? "Connection: close\r\n\r\n" : keep_alive ? "Connection: keep-alive\r\n\r\n" : "\r\n";
+    iov[count++] = {(void*)last, strlen(last)};
+    return count;
+}
+
+/* gathers the rewritten head into out, returns its length or 0 if it does not fit */
+size_t http_request_write_head(const struct http_request *request, char *out, size_t size)
+{
+    struct iovec iov[LIBHTTP_HEAD_IOV_MAX];
+    int count = http_request_head_iov(request, iov, LIBHTTP_HEAD_IOV_MAX);
+    if (count < 0)
+        return 0;
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (iov[i].iov_len > size - len)
+            return 0;
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
 }
 
-size_t server_http_request_parse(int fd, char *buffer, LogMsg *msg)
+/* *held is what is left of data after a head on_head held back, which stays in stream->head */
+bool http_stream_forward(struct http_stream *stream, const char *data, size_t len, char *out, size_t size, size_t *out_len,
+                         size_t *held, LogMsg *msg, http_head_handler on_head, void *context)
 {
     struct http_request request;
-    request.client_req = false;
+    size_t consumed, head_len;
+    int action;
 
-    size_t bytes_read;
-    if ((bytes_read = http_receive_data(fd, buffer)) == 0)
+    *out_len = 0;
+    *held = 0;
+    while (len > 0)
     {
-        return 0;
+        switch (http_stream_feed(stream, data, len, &consumed, &request))
+        {
+            case STREAM_HEAD:
+                action = on_head != nullptr ? on_head(context, stream, &request) : HEAD_FORWARD;
+                if (action == HEAD_HOLD)
+                {
+                    *held = len - consumed;
+                    return true;
+                }
+                if (action == HEAD_TAKEN)
+                    break;
+                Management::getInstance()->handle_stats(stream->head, stream->head_len, &request, msg);
+                head_len = http_request_write_head(&request, out + *out_len, size - *out_len);
+                if (head_len == 0)
+                    return false;
+                *out_len += head_len;
+                break;
+
+            case STREAM_BODY:
+                if (consumed > size - *out_len)
+                    return false;
+                memcpy(out + *out_len, data, consumed);
+                *out_len += consumed;
+                break;
+
+            case STREAM_MORE:
+                break;
+
+            default:
+                return false;
+        }
+
+        data += consumed;
+        len -= consumed;
     }
 
+    return true;
+}
+
+/* looks a header up in the header lines starting at headers, returns its value */
+const char *http_find_header(const char *headers, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *line = headers;
+    while (line != nullptr && *line != '\0' && *line != '\r' && *line != '\n')
+    {
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+        {
+            line += name_len + 1;
+            while (*line == ' ' || *line == '\t')
+                line++;
+            return line;
+        }
+        line = strchr(line, '\n');
+        if (line != nullptr)
+            line++;
+    }
+    return nullptr;
+}
+
+size_t http_header_value_len(const char *value)
+{
+    size_t len = strcspn(value, "\r\n");
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
+    return len;
+}
+
+/* counts and logs a complete response head */
+void http_response_parse(const char *buffer, size_t len, LogMsg *msg)
+{
+    struct http_request request;
+    request.client_req = false;
+
     if (strstr(buffer, "HTTP/1.") == buffer)
-        Management::getInstance()->handle_stats(buffer, &request, msg);
-    return bytes_read;
+        Management::getInstance()->handle_stats(buffer, len, &request, msg);
 }
 
 const char* http_get_response_message(int status_code)
@@ -221,29 +527,50 @@ const char* http_get_response_message(int status_code)
             return "Not Implemented";
         case BAD_GATEWAY:
             return "Bad Gateway";
+        case SERVICE_UNAVAILABLE:
+            return "Service Unavailable";
         default:
             return "Internal Server Error";
     }
 }
 
-void http_start_response(int fd, int status_code)
+/* sends all of a message that is spread over several buffers with as few writes as the socket allows */
+bool http_send_iov(int fd, struct iovec *iov, int count)
 {
-    dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code, http_get_response_message(status_code));
-}
-
-void http_start_request(int fd, char *method, char *path, char *version)
-{
-    dprintf(fd, "%s %s %s\r\n", method, path, version);
+    while (count > 0)
+    {
+        ssize_t bytes_sent = writev(fd, iov, count);
+        if (bytes_sent < 0 && errno == EINTR)
+            continue;
+        if (bytes_sent < 0)
+            return false;
+        while (count > 0 && (size_t)bytes_sent >= iov->iov_len)
+        {
+            bytes_sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + bytes_sent;
+            iov->iov_len -= bytes_sent;
+        }
+    }
+    return true;
 }
 
-void http_send_header(int fd, const char *key, const char *value)
+/* our messages leave in one write each, so there is nothing for Nagle to wait for */
+void http_set_nodelay(int fd)
 {
-    dprintf(fd, "%s: %s\r\n", key, value);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 }
 
-void http_end_headers(int fd)
+/* holds partial segments back while a message is written in several calls */
+void http_set_cork(int fd, bool on)
 {
-    dprintf(fd, "\r\n");
+    int value = on ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
 }
 
 void http_send_string(int fd, const char *data)
@@ -274,15 +601,29 @@ size_t http_receive_data(int fd, char *buffer)
     return bytes_read;
 }
 
-void http_send_response(int fd, int status_code)
+/* answers 503 without reading the request, for connections the queue cannot take or kept too long */
+void http_refuse_connection(LogMsg *msg)
 {
-    char *msg = (char*)calloc(128, sizeof(char));
-    sprintf(msg, "<center><h1>%d %s</h1><hr></center>", status_code, http_get_response_message(status_code));
-
-    http_start_response(fd, status_code);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, msg);
+    http_send_response(msg->client_socket, 503);
+    shutdown(msg->client_socket, SHUT_WR);
+
+    /* unread request bytes would turn the close into a reset that can discard the response */
+    char buffer[1024];
+    while (recv(msg->client_socket, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+        ;
+    close(msg->client_socket);
+    delete(msg);
+}
 
-    free(msg);
+void http_send_response(int fd, int status_code)
+{
+    char body[128], head[256];
+    int body_len = snprintf(body, sizeof(body), "<center><h1>%d %s</h1><hr></center>", status_code,
+                            http_get_response_message(status_code));
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.0 %d %s\r\nContent-Type: text/html\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                            status_code, http_get_response_message(status_code), body_len);
+
+    struct iovec iov[] = {{head, (size_t)head_len}, {body, (size_t)body_len}};
+    http_send_iov(fd, iov, 2);
 }
@@ -1,9 +1,15 @@
 #ifndef HTTP_PROXY_SERVER_LIBHTTP_H
 #define HTTP_PROXY_SERVER_LIBHTTP_H
 
+#include <sys/uio.h>
+
+#include "http_parser.h"
 #include "log.h"
 
 #define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_MAX_HOST 255
+#define LIBHTTP_HEAD_IOV_MAX 64         /* request line, runs of kept header lines and the end of the head */
+#define LIBHTTP_CONNECTION_OPTIONS 16
 
 enum StatusCode
 {
@@ -11,39 +17,86 @@ enum StatusCode
     OK = 200,
     MOVED_PERMANENTLY = 301, FOUND = 302, NOT_MODIFIED = 304,
     BAD_REQUEST = 400, UNAUTHORIZED = 401, FORBIDDEN = 403, NOT_FOUND = 404, METHOD_NOT_ALLOWED = 405,
-    NOT_IMPLEMENTED = 501, BAD_GATEWAY = 502
+    NOT_IMPLEMENTED = 501, BAD_GATEWAY = 502, SERVICE_UNAVAILABLE = 503
 };
 
 struct http_request
 {
-    char *method;
-    char *path;
-    char *version;
+    http_slice method;
+    http_slice path;
+    http_slice version;
+    http_slice headers;     /* header lines and the empty line ending the head */
+    http_slice authority;   /* of an absolute-form target, which the Host sent upstream must agree with */
 
-    char *host;
+    char host[LIBHTTP_MAX_HOST + 1];
     uint16_t port;
 
     bool client_req;
 };
 
-void free_request(struct http_request *request);
+enum ChunkState
+{
+    STREAM_CHUNK_SIZE, STREAM_CHUNK_EXT, STREAM_CHUNK_DATA, STREAM_CHUNK_DATA_LF, STREAM_CHUNK_TRAILER
+};
 
-const char* http_get_response_message(int status_code);
+/* request heads and bodies as they arrive on a client connection */
+struct http_stream
+{
+    HttpRequestParser parser;   /* embedded, a connection costs no allocation beyond its pooled head buffer */
+    char *head;
+    size_t head_len;
+    bool head_done;
+
+    long body_remaining;    /* -1 while a chunked body is read */
+    int chunk_state;        /* a ChunkState, where the chunked body is */
+    uint64_t chunk_remaining;
+    size_t chunk_digits, line_len;
+};
+
+enum StreamStatus
+{
+    STREAM_HEAD, STREAM_BODY, STREAM_MORE, STREAM_ERROR
+};
+
+/* what to do with a request head: rewrite it into the output, leave it to the handler, or hold it and the rest back */
+enum HeadAction
+{
+    HEAD_FORWARD, HEAD_TAKEN, HEAD_HOLD
+};
+
+/* called for every request head http_stream_forward reads, returns a HeadAction */
+typedef int (*http_head_handler)(void *context, struct http_stream *stream, struct http_request *request);
 
-struct http_request *client_http_request_parse(int fd, char *buffer, LogMsg *msg);
+extern size_t http_max_head_size;
 
-size_t server_http_request_parse(int fd, char *buffer, LogMsg *msg);
+/* worst case of a forwarded read: a buffered head plus a read full of rewritten heads and body bytes */
+#define LIBHTTP_FORWARD_SIZE (http_max_head_size + 2 * LIBHTTP_REQUEST_MAX_SIZE)
+
+void http_stream_init(struct http_stream *stream);
+void http_stream_free(struct http_stream *stream);
+bool http_stream_idle(const struct http_stream *stream);
+int http_stream_feed(struct http_stream *stream, const char *data, size_t len, size_t *consumed, struct http_request *request);
+bool http_stream_forward(struct http_stream *stream, const char *data, size_t len, char *out, size_t size, size_t *out_len,
+                         size_t *held, LogMsg *msg, http_head_handler on_head, void *context);
+int http_request_head_iov(const struct http_request *request, struct iovec *iov, int max_iov);
+size_t http_request_write_head(const struct http_request *request, char *out, size_t size);
+
+const char *http_find_header(const char *headers, const char *name);
+size_t http_header_value_len(const char *value);
+
+const char* http_get_response_message(int status_code);
 
-void http_start_response(int fd, int status_code);
-void http_start_request(int fd, char *method, char *path, char *version);
+void http_response_parse(const char *buffer, size_t len, LogMsg *msg);
 
-void http_send_header(int fd, const char *key, const char *value);
-void http_end_headers(int fd);
+bool http_send_iov(int fd, struct iovec *iov, int count);
+void http_set_nodelay(int fd);
+void http_set_cork(int fd, bool on);
 void http_send_string(int fd, const char *data);
 void http_send_data(int fd, const char *data, size_t size);
 
 size_t http_receive_data(int fd, char *buffer);
 
 void http_send_response(int fd, int status_code);
+void http_refuse_connection(LogMsg *msg);
 
 #endif
@@ -0,0 +1,264 @@
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <strings.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+
+using namespace std;
+
+#define LOG_RING_MASK       (LOG_RING_SIZE - 1)
+#define LOG_IDLE_SLEEP_US   5000
+
+/* single producer, single consumer: the owning thread appends, the writer thread drains */
+struct log_ring
+{
+    atomic<uint32_t> head;  /* next record the writer reads */
+    atomic<uint32_t> tail;  /* next record the owner fills */
+    log_record records[LOG_RING_SIZE];
+};
+
+int log_level = LOG_LEVEL_INFO;
+
+static FILE *log_file = stdout;
+static atomic<uint64_t> log_drops(0);
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<log_ring*> rings;
+static thread_local log_ring *local_ring = nullptr;
+
+int log_parse_level(const char *name)
+{
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; level++)
+        if (strcasecmp(name, names[level]) == 0)
+            return level;
+    return -1;
+}
+
+uint64_t log_dropped()
+{
+    return log_drops.load(memory_order_relaxed);
+}
+
+/* returns a free slot of the calling thread's ring, or null when the writer has fallen behind */
+static log_record *log_reserve(uint8_t type)
+{
+    if (local_ring == nullptr)
+    {
+        local_ring = new log_ring();
+        local_ring->head = local_ring->tail = 0;
+
+        pthread_mutex_lock(&rings_lock);
+        rings.push_back(local_ring);
+        pthread_mutex_unlock(&rings_lock);
+    }
+
+    uint32_t tail = local_ring->tail.load(memory_order_relaxed);
+    if (tail - local_ring->head.load(memory_order_acquire) == LOG_RING_SIZE)
+    {
+        log_drops.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+
+    log_record *record = &local_ring->records[tail & LOG_RING_MASK];
+    record->type = type;
+    record->thread = pthread_self();
+    record->time = time(nullptr);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record->stamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return record;
+}
+
+static void log_commit()
+{
+    local_ring->tail.store(local_ring->tail.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+/* copies at most max bytes of src into the record text, truncating it, and returns where the next string goes */
+static char *log_pack(char *dst, const char *end, const char *src, size_t max)
+{
+    if (dst >= end)
+        return dst;
+    if (src == nullptr)
+        src = "";
+    size_t len = min(strlen(src), max);
+    if (len > (size_t)(end - dst - 1))
+        len = end - dst - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return dst + len + 1;
+}
+
+void log_text(int level, const char *fmt, ...)
+{
+    if (level < log_level)
+        return;
+
+    log_record *record = log_reserve(LOG_TEXT);
+    if (record == nullptr)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(record->text, LOG_RECORD_TEXT, fmt, args);
+    va_end(args);
+    log_commit();
+}
+
+void log_accept(const char *addr, uint16_t port)
+{
+    if (LOG_LEVEL_INFO < log_level)
+        return;
+
+    log_record *record = log_reserve(LOG_ACCEPT);
+    if (record == nullptr)
+        return;
+
+    record->client_port = port;
+    log_pack(record->text, record->text + LOG_RECORD_TEXT, addr, LOG_RECORD_TEXT);
+    log_commit();
+}
+
+static void log_exchange(uint8_t type, const LogMsg *msg, int status_code)
+{
+    if (LOG_LEVEL_INFO < log_level)
+        return;
+
+    log_record *record = log_reserve(type);
+    if (record == nullptr)
+        return;
+
+    record->status_code = (uint16_t)status_code;
+    record->client_port = msg->client_port;
+    record->server_port = msg->server_port;
+
+    const char *end = record->text + LOG_RECORD_TEXT;
+    /* a long host is cut short so the request line still fits */
+    char *next = log_pack(record->text, end, msg->client_addr, LOG_RECORD_TEXT);
+    next = log_pack(next, end, msg->server_addr, LOG_RECORD_HOST);
+    log_pack(next, end, msg->req, LOG_RECORD_TEXT);
+    log_commit();
+}
+
+void log_request(const LogMsg *msg)
+{
+    log_exchange(LOG_REQUEST, msg, 0);
+}
+
+void log_response(const LogMsg *msg, int status_code)
+{
+    log_exchange(LOG_RESPONSE, msg, status_code);
+}
+
+static void log_format(FILE *file, const log_record *record)
+{
+    if (record->type == LOG_TEXT)
+    {
+        fprintf(file, "Thread %lu: %s", record->thread, record->text);
+        return;
+    }
+    if (record->type == LOG_ACCEPT)
+    {
+        fprintf(file, "Thread %lu: Accepted connection from %s on port %d\n", record->thread, record->text, record->client_port);
+        return;
+    }
+
+    /* strings a full record had no room for are empty */
+    const char *end = record->text + LOG_RECORD_TEXT;
+    const char *client_addr = record->text;
+    const char *server_addr = client_addr + strlen(client_addr) + 1;
+    const char *req = server_addr < end ? server_addr + strlen(server_addr) + 1 : end;
+    if (server_addr >= end)
+        server_addr = "";
+    if (req >= end)
+        req = "";
+
+    struct tm tm;
+    char time_buf[64] = {0};
+    gmtime_r(&record->time, &tm);
+    strftime(time_buf, sizeof(time_buf), "%a, %d %b %G %T %Z", &tm);
+
+    if (record->type == LOG_REQUEST)
+        fprintf(file, "Thread %lu: \r\nRequest: [%s] [%s:%d] [%s:%d]\n\"%s\"\r\n",
+                record->thread, time_buf, client_addr, record->client_port, server_addr, record->server_port, req);
+    else
+        fprintf(file, "Thread %lu: \r\nResponse: [%s] [%s:%d] [%s:%d]\n\"HTTP/1.1 %d %s\" for \"%s\"\r\n",
+                record->thread, time_buf, client_addr, record->client_port, server_addr, record->server_port,
+                record->status_code, http_get_response_message(record->status_code), req);
+}
+
+/* drains every ring into the log file in timestamp order, flushing once per batch */
+static void log_writer(void *)
+{
+    uint64_t reported_drops = 0;
+    vector<log_ring*> snapshot;
+    vector<uint32_t> tails;
+    vector<const log_record*> batch;
+
+    while (true)
+    {
+        pthread_mutex_lock(&rings_lock);
+        snapshot = rings;
+        pthread_mutex_unlock(&rings_lock);
+
+        tails.resize(snapshot.size());
+        batch.clear();
+        for (size_t i = 0; i < snapshot.size(); i++)
+        {
+            uint32_t head = snapshot[i]->head.load(memory_order_relaxed);
+            tails[i] = snapshot[i]->tail.load(memory_order_acquire);
+            for (; head != tails[i]; head++)
+                batch.push_back(&snapshot[i]->records[head & LOG_RING_MASK]);
+        }
+
+        sort(batch.begin(), batch.end(), [](const log_record *a, const log_record *b) { return a->stamp < b->stamp; });
+        for (const log_record *record : batch)
+            log_format(log_file, record);
+
+        /* the slots are handed back only once they have been formatted */
+        for (size_t i = 0; i < snapshot.size(); i++)
+            snapshot[i]->head.store(tails[i], memory_order_release);
+
+        size_t written = batch.size();
+
+        uint64_t drops = log_dropped();
+        if (drops != reported_drops)
+        {
+            fprintf(log_file, "Log: %lu records dropped\n", drops - reported_drops);
+            reported_drops = drops;
+            written++;
+        }
+
+        if (written > 0)
+            fflush(log_file);
+        else
+            usleep(LOG_IDLE_SLEEP_US);
+    }
+}
+
+void log_init(const char *path)
+{
+    if (path != nullptr)
+    {
+        log_file = fopen(path, "a");
+        if (log_file == nullptr)
+        {
+            perror("Failed to open log file");
+            exit(errno);
+        }
+    }
+    setvbuf(log_file, nullptr, _IOFBF, 1 << 16);
+
+    pthread_t writer_thread;
+    pthread_create(&writer_thread, nullptr, (void *(*)(void *))log_writer, nullptr);
+    pthread_detach(writer_thread);
+}
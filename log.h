@@ -2,18 +2,49 @@
 #define HTTP_PROXY_SERVER_LOG_H
 
 #include <cstdlib>
+#include <ctime>
+#include <string>
 #include <pthread.h>
 #include <arpa/inet.h>
 
-extern pthread_mutex_t log_mutex;
+#include "buffer_pool.h"
+#include "latency.h"
 
-#define LOG(fmt, args...)                              \
-{                                                      \
-    pthread_mutex_lock(&log_mutex);                    \
-    printf("Thread %lu: ", pthread_self());           \
-    printf(fmt, ##args);                               \
-    pthread_mutex_unlock(&log_mutex);                  \
-}
+#define LOG_RING_SIZE       1024    /* records per thread, a power of two */
+#define LOG_RECORD_TEXT     232
+#define LOG_RECORD_HOST     96      /* of the text, for the upstream host */
+
+enum LogLevel
+{
+    LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR, LOG_LEVEL_OFF
+};
+
+enum LogRecordType
+{
+    LOG_TEXT, LOG_ACCEPT, LOG_REQUEST, LOG_RESPONSE
+};
+
+/* what a thread hands to the log writer; strings are packed NUL separated into text */
+struct log_record
+{
+    uint8_t type;
+    uint16_t status_code;
+    uint16_t client_port, server_port;
+    pthread_t thread;
+    time_t time;
+    uint64_t stamp;     /* monotonic nanoseconds, orders records across threads */
+    char text[LOG_RECORD_TEXT];
+};
+
+extern int log_level;
+
+#define LOG(fmt, args...)   log_text(LOG_LEVEL_INFO, fmt, ##args)
+
+int log_parse_level(const char *name);
+void log_init(const char *path);
+void log_text(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_accept(const char *addr, uint16_t port);
+uint64_t log_dropped();
 
 class LogMsg
 {
@@ -22,18 +53,29 @@ public:
     uint16_t client_port = 0, server_port = 0;
     char *client_addr = nullptr, *server_addr = nullptr;
     char *req = nullptr, *resp = nullptr;
+    latency_trace trace = {};   /* of the request the worker is handling */
+    int queue = 0;              /* work queue the connection goes back to between requests */
+    bool fetch_alone = false;   /* the next request left a collapsed fetch that could not answer it */
+    std::string pending;        /* client bytes a relay loop read but left to the workers, a request head first */
+
+    /* strings point into the arena; client_addr lives as long as the connection, the rest per request */
+    Arena arena;
+    Arena::mark_t connection_mark = {};
 
-    inline ~LogMsg()
+    inline void set_client_addr(const char *addr)
     {
-        if (this->client_addr)
-            free(this->client_addr);
-        if (this->server_addr)
-            free(this->server_addr);
-        if (this->req)
-            free(this->req);
-        if (this->resp)
-            free(this->resp);
+        this->client_addr = this->arena.strdup(addr);
+        this->connection_mark = this->arena.mark();
+    }
+
+    inline void begin_request()
+    {
+        this->arena.reset(this->connection_mark);
+        this->server_addr = this->req = this->resp = nullptr;
     }
 };
 
+void log_request(const LogMsg *msg);
+void log_response(const LogMsg *msg, int status_code);
+
 #endif //HTTP_PROXY_SERVER_LOG_H
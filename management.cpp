@@ -2,25 +2,32 @@
 
 #include <cstring>
 #include <algorithm>
+#include <set>
 #include <unistd.h>
 
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "buffer_pool.h"
+#include "cache.h"
+#include "connector.h"
+#include "disk_cache.h"
+#include "dns.h"
 #include "log.h"
+#include "scan.h"
+#include "wq.h"
 
 using namespace std;
 
 Management::Management()
 {
-    this->client_pkt_len = RunningStat();
-    this->server_pkt_len = RunningStat();
-    this->server_bd_len = RunningStat();
-
     pthread_mutex_init(&this->management_lock, nullptr);
 }
 Management* Management::instance = nullptr;
+size_t Management::top_capacity = HEAVY_HITTERS_CAPACITY;
+thread_local Management::StatShard *Management::local_shard = nullptr;
 
 Management *Management::getInstance()
 {
@@ -29,45 +36,46 @@ Management *Management::getInstance()
     return instance;
 }
 
-bool cmp(pair<string, uint32_t>& a, pair<string, uint32_t>& b)
+static bool starts_with(const char *value, size_t len, const char *prefix)
 {
-    return a.second > b.second;
+    size_t prefix_len = strlen(prefix);
+    return len >= prefix_len && strncmp(value, prefix, prefix_len) == 0;
 }
 
-Management::Types Management::http_get_mime_type(char *buffer)
+Management::Types Management::http_get_mime_type(const http_head_index *index)
 {
-    char *content_type = strstr(buffer, "Content-Type: ");
+    size_t len;
+    const char *content_type = scan_find_header(index, "Content-Type", &len);
     if (content_type == nullptr)
     {
         return NOTHING;
     }
 
-    content_type += strlen("Content-Type: ");
-    if (strstr(content_type, "text/html") == content_type)
+    if (starts_with(content_type, len, "text/html"))
     {
         return HTML;
     }
-    else if (strstr(content_type, "image/jpg") == content_type)
+    else if (starts_with(content_type, len, "image/jpg"))
     {
         return JPG;
     }
-    else if (strstr(content_type, "image/jpeg") == content_type)
+    else if (starts_with(content_type, len, "image/jpeg"))
     {
         return JPEG;
     }
-    else if (strstr(content_type, "image/png") == content_type)
+    else if (starts_with(content_type, len, "image/png"))
     {
         return PNG;
     }
-    else if (strstr(content_type, "text/css") == content_type)
+    else if (starts_with(content_type, len, "text/css"))
     {
         return CSS;
     }
-    else if (strstr(content_type, "application/javascript") == content_type)
+    else if (starts_with(content_type, len, "application/javascript"))
     {
         return JS;
     }
-    else if (strstr(content_type, "application/pdf") == content_type)
+    else if (starts_with(content_type, len, "application/pdf"))
     {
         return PDF;
     }
@@ -102,65 +110,619 @@ const char *Management::http_get_mime_type_str(Management::Types types)
     }
 }
 
-void Management::sort_host_count(vector<pair<string, uint32_t>>& A)
+/* copies every thread's host summary, all time for a window of 0 */
+void Management::collect_hosts(time_t window, vector<SpaceSaving> &summaries)
 {
-    A.clear();
+    time_t now = time(nullptr);
+
+    pthread_mutex_lock(&this->management_lock);
+    vector<StatShard*> shards = this->shards;
+    pthread_mutex_unlock(&this->management_lock);
 
-    for (auto& it : this->host_count)
+    StagedHost *staged = new StagedHost[MANAGEMENT_HOST_BATCH];
+    for (StatShard *shard : shards)
     {
-        A.push_back(it);
+        /* the owner only adds its staged hosts to the summaries under the lock, so both are copied at one point */
+        size_t num_staged;
+        pthread_mutex_lock(&shard->host_lock);
+        if (window == 0)
+            summaries.push_back(*shard->hosts);
+        else
+            shard->recent_hosts->Collect(now, window, summaries);
+        read_shard(shard, &num_staged, &shard->num_staged, sizeof(num_staged));
+        read_shard(shard, staged, shard->staged, num_staged * sizeof(StagedHost));
+        pthread_mutex_unlock(&shard->host_lock);
+
+        SpaceSaving recent(top_capacity);
+        for (size_t i = 0; i < num_staged; i++)
+            if (window == 0 || staged[i].when >= now - window)
+                recent.Push(staged[i].host);
+        summaries.push_back(recent);
     }
+    delete[] staged;
+}
+
+Management::StatShard *Management::shard()
+{
+    if (local_shard == nullptr)
+    {
+        local_shard = new StatShard();
+        local_shard->seq = 0;
+        local_shard->latency = new atomic<HostLatency*>[MANAGEMENT_LATENCY_SLOTS];
+        for (size_t i = 0; i < MANAGEMENT_LATENCY_SLOTS; i++)
+            local_shard->latency[i].store(nullptr, memory_order_relaxed);
+        local_shard->latency_hosts = 0;
+        pthread_mutex_init(&local_shard->host_lock, nullptr);
+        local_shard->hosts = new SpaceSaving(top_capacity);
+        local_shard->recent_hosts = new WindowedSpaceSaving(top_capacity);
+        local_shard->num_staged = 0;
 
-    sort(A.begin(), A.end(), cmp);
+        pthread_mutex_lock(&this->management_lock);
+        this->shards.push_back(local_shard);
+        pthread_mutex_unlock(&this->management_lock);
+    }
+    return local_shard;
 }
 
-void Management::packet_len_stats(int fd)
+void Management::begin_update(StatShard *shard)
 {
-    pthread_mutex_lock(&this->management_lock);
-    dprintf(fd, "Packet length received from servers(mean, std): (%f, %f)\n",
-            this->server_pkt_len.Mean(), this->server_pkt_len.StandardDeviation());
-    dprintf(fd, "Packet length received from clients(mean, std): (%f, %f)\n",
-            this->client_pkt_len.Mean(), this->client_pkt_len.StandardDeviation());
-    dprintf(fd, "Body length received from servers(mean, std): (%f, %f)\n",
-            this->server_bd_len.Mean(), this->server_bd_len.StandardDeviation());
-    pthread_mutex_unlock(&this->management_lock);
+    shard->seq.store(shard->seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
 }
 
-void Management::type_cnt(int fd)
+void Management::end_update(StatShard *shard)
 {
-    pthread_mutex_lock(&this->management_lock);
-    for (auto it: this->type_count)
-        dprintf(fd, "%s: %d\n", this->http_get_mime_type_str(it.first), it.second);
-    pthread_mutex_unlock(&this->management_lock);
+    shard->seq.store(shard->seq.load(memory_order_relaxed) + 1, memory_order_release);
 }
 
-void Management::status_cnt(int fd)
+/* copies what the owner of a shard writes between begin_update and end_update, retrying while it does */
+void Management::read_shard(StatShard *shard, void *to, const void *from, size_t len)
 {
+    uint32_t seq;
+    do
+    {
+        while ((seq = shard->seq.load(memory_order_acquire)) & 1)
+            ;
+        memcpy(to, from, len);
+        atomic_thread_fence(memory_order_acquire);
+    }
+    while (shard->seq.load(memory_order_relaxed) != seq);
+}
+
+/* sums up a consistent copy of every shard's counters */
+void Management::merge_counters(StatCounters &total)
+{
+    total = StatCounters();
+
+    /* shards are never freed, only the list needs the lock */
     pthread_mutex_lock(&this->management_lock);
-    for (auto it: this->status_count)
-        dprintf(fd, "%d %s: %d\n", it.first, http_get_response_message(it.first), it.second);
+    vector<StatShard*> shards = this->shards;
     pthread_mutex_unlock(&this->management_lock);
+
+    for (StatShard *shard : shards)
+    {
+        StatCounters copy;
+        read_shard(shard, &copy, &shard->counters, sizeof(copy));
+
+        total.client_pkt_len.Merge(copy.client_pkt_len);
+        total.server_pkt_len.Merge(copy.server_pkt_len);
+        total.server_bd_len.Merge(copy.server_bd_len);
+        for (int i = 0; i < MANAGEMENT_MAX_STATUS; i++)
+            total.status_count[i] += copy.status_count[i];
+        for (int i = 0; i < NOTHING; i++)
+            total.type_count[i] += copy.type_count[i];
+        for (int i = 0; i < LATENCY_PHASES; i++)
+            total.latency[i].Merge(copy.latency[i]);
+        total.tunnels += copy.tunnels;
+        total.tunnel_bytes_up += copy.tunnel_bytes_up;
+        total.tunnel_bytes_down += copy.tunnel_bytes_down;
+        total.tunnel_duration.Merge(copy.tunnel_duration);
+    }
+}
+
+void Management::packet_len_stats(FILE *out)
+{
+    StatCounters total;
+    this->merge_counters(total);
+
+    fprintf(out, "Packet length received from servers(mean, std): (%f, %f)\n",
+            total.server_pkt_len.Mean(), total.server_pkt_len.StandardDeviation());
+    fprintf(out, "Packet length received from clients(mean, std): (%f, %f)\n",
+            total.client_pkt_len.Mean(), total.client_pkt_len.StandardDeviation());
+    fprintf(out, "Body length received from servers(mean, std): (%f, %f)\n",
+            total.server_bd_len.Mean(), total.server_bd_len.StandardDeviation());
+}
+
+void Management::type_cnt(FILE *out)
+{
+    StatCounters total;
+    this->merge_counters(total);
+
+    for (int i = 0; i < NOTHING; i++)
+        if (total.type_count[i] > 0)
+            fprintf(out, "%s: %d\n", this->http_get_mime_type_str((Types)i), total.type_count[i]);
+}
+
+void Management::status_cnt(FILE *out)
+{
+    StatCounters total;
+    this->merge_counters(total);
+
+    for (int i = 0; i < MANAGEMENT_MAX_STATUS; i++)
+        if (total.status_count[i] > 0)
+            fprintf(out, "%d %s: %d\n", i, http_get_response_message(i), total.status_count[i]);
+}
+
+void Management::top_visited_hosts(FILE *out, size_t k, time_t window)
+{
+    vector<SpaceSaving> summaries;
+    this->collect_hosts(window, summaries);
+
+    for (auto &host : heavy_hitters_merge(summaries, k))
+    {
+        if (host.error > 0)
+            fprintf(out, "%s: %lu (at most %lu too high)\n", host.key.c_str(), host.count, host.error);
+        else
+            fprintf(out, "%s: %lu\n", host.key.c_str(), host.count);
+    }
+}
+
+/* splits a trace into phase durations in microseconds, -1 for phases the request skipped */
+static void latency_phases(const latency_trace *trace, int64_t durations[LATENCY_PHASES])
+{
+    uint64_t sent = trace->connect ? trace->connect : trace->dns ? trace->dns : trace->parsed;
+    uint64_t start = trace->accept ? trace->accept : trace->parsed;
+
+    durations[PHASE_PARSE] = trace->accept ? (int64_t)(trace->parsed - trace->accept) : -1;
+    durations[PHASE_DNS] = trace->dns ? (int64_t)(trace->dns - trace->parsed) : -1;
+    durations[PHASE_CONNECT] = trace->dns && trace->connect ? (int64_t)(trace->connect - trace->dns) : -1;
+    durations[PHASE_FIRST_BYTE] = trace->first_byte ? (int64_t)(trace->first_byte - sent) : -1;
+    durations[PHASE_TRANSFER] = trace->first_byte ? (int64_t)(trace->last_byte - trace->first_byte) : -1;
+    durations[PHASE_TOTAL] = (int64_t)(trace->last_byte - start);
+
+    for (int i = 0; i < LATENCY_PHASES; i++)
+        if (durations[i] >= 0)
+            durations[i] /= 1000;
+}
+
+void Management::record_latency(const char *host, const latency_trace *trace)
+{
+    if (trace->parsed == 0 || trace->last_byte == 0)
+        return;
+
+    int64_t durations[LATENCY_PHASES];
+    latency_phases(trace, durations);
+
+    StatShard *shard = this->shard();
+    uint64_t hash = heavy_hitters_hash(host);
+    HostLatency *latency = find_latency(shard, host, hash);
+    if (latency == nullptr && shard->latency_hosts < MANAGEMENT_LATENCY_HOSTS)
+    {
+        /* filled in before it is published, readers compare the name without the seqlock */
+        latency = new HostLatency();
+        latency->hash = hash;
+        strncpy(latency->host, host, LIBHTTP_MAX_HOST);
+        latency->host[LIBHTTP_MAX_HOST] = '\0';
+        for (auto &phase : latency->phases)
+            phase.Clear();
+        size_t i = hash & (MANAGEMENT_LATENCY_SLOTS - 1);
+        while (shard->latency[i].load(memory_order_relaxed) != nullptr)
+            i = (i + 1) & (MANAGEMENT_LATENCY_SLOTS - 1);
+        shard->latency[i].store(latency, memory_order_release);
+        shard->latency_hosts++;
+    }
+
+    begin_update(shard);
+    for (int i = 0; i < LATENCY_PHASES; i++)
+    {
+        if (durations[i] < 0)
+            continue;
+        shard->counters.latency[i].Push((uint64_t)durations[i]);
+        if (latency != nullptr)
+            latency->phases[i].Push((uint64_t)durations[i]);
+    }
+    end_update(shard);
+}
+
+/* entries are never removed, so a probe ends at the first empty slot */
+Management::HostLatency *Management::find_latency(StatShard *shard, const char *host, uint64_t hash)
+{
+    for (size_t i = hash & (MANAGEMENT_LATENCY_SLOTS - 1);; i = (i + 1) & (MANAGEMENT_LATENCY_SLOTS - 1))
+    {
+        HostLatency *latency = shard->latency[i].load(memory_order_acquire);
+        if (latency == nullptr || (latency->hash == hash && strcmp(latency->host, host) == 0))
+            return latency;
+    }
+}
+
+void Management::latency_stats(FILE *out, const char *host)
+{
+    static const char *names[LATENCY_PHASES] = {"parse", "dns", "connect", "first byte", "transfer", "total"};
+    LatencyHistogram phases[LATENCY_PHASES];
+
+    if (strcmp(host, "all") == 0)
+    {
+        StatCounters total;
+        this->merge_counters(total);
+        memcpy(phases, total.latency, sizeof(phases));
+    }
+    else
+    {
+        pthread_mutex_lock(&this->management_lock);
+        vector<StatShard*> shards = this->shards;
+        pthread_mutex_unlock(&this->management_lock);
+
+        /* every thread that served the host kept its own histograms */
+        uint64_t hash = heavy_hitters_hash(host);
+        bool found = false;
+        for (auto &phase : phases)
+            phase.Clear();
+        for (StatShard *shard : shards)
+        {
+            HostLatency *latency = find_latency(shard, host, hash);
+            if (latency == nullptr)
+                continue;
+            LatencyHistogram copy[LATENCY_PHASES];
+            read_shard(shard, copy, latency->phases, sizeof(copy));
+            for (int i = 0; i < LATENCY_PHASES; i++)
+                phases[i].Merge(copy[i]);
+            found = true;
+        }
+
+        if (!found)
+        {
+            fprintf(out, "No latency recorded for %s\n", host);
+            return;
+        }
+    }
+
+    fprintf(out, "Latency of %s in microseconds:\n", host);
+    for (int i = 0; i < LATENCY_PHASES; i++)
+        fprintf(out, "%s: count %lu, p50 %lu, p90 %lu, p99 %lu, max %lu\n", names[i], phases[i].Count(),
+                phases[i].Percentile(50), phases[i].Percentile(90), phases[i].Percentile(99), phases[i].Max());
 }
 
-void Management::top_visited_hosts(int fd, size_t k)
+void Management::tunnel_stats(FILE *out)
 {
-    vector<pair<string, uint32_t>> sorted_hosts;
+    StatCounters total;
+    this->merge_counters(total);
+
+    fprintf(out, "Tunnels: open %ld, closed %lu\n", (long) this->open_tunnels.load(), total.tunnels);
+    fprintf(out, "Bytes from clients: %lu, from servers: %lu\n", total.tunnel_bytes_up, total.tunnel_bytes_down);
+    fprintf(out, "Duration in milliseconds: p50 %lu, p90 %lu, p99 %lu, max %lu\n",
+            total.tunnel_duration.Percentile(50), total.tunnel_duration.Percentile(90),
+            total.tunnel_duration.Percentile(99), total.tunnel_duration.Max());
+}
 
+void Management::metrics(FILE *out)
+{
+    static const char *phases[LATENCY_PHASES] = {"parse", "dns", "connect", "first_byte", "transfer", "total"};
+    /* bucket bounds in microseconds */
+    static const uint64_t bounds[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+                                      500000, 1000000, 2500000, 5000000, 10000000};
+
+    /* everything is copied first, formatting holds no lock */
+    StatCounters total;
+    this->merge_counters(total);
+
+    fprintf(out, "# TYPE proxy_client_requests_total counter\nproxy_client_requests_total %u\n",
+            total.client_pkt_len.NumDataValues());
+    fprintf(out, "# TYPE proxy_client_request_bytes_total counter\nproxy_client_request_bytes_total %.0f\n",
+            total.client_pkt_len.Mean() * total.client_pkt_len.NumDataValues());
+    fprintf(out, "# TYPE proxy_upstream_response_bytes_total counter\nproxy_upstream_response_bytes_total %.0f\n",
+            total.server_pkt_len.Mean() * total.server_pkt_len.NumDataValues());
+    fprintf(out, "# TYPE proxy_upstream_body_bytes_total counter\nproxy_upstream_body_bytes_total %.0f\n",
+            total.server_bd_len.Mean() * total.server_bd_len.NumDataValues());
+
+    fprintf(out, "# TYPE proxy_upstream_responses_total counter\n");
+    for (int i = 0; i < MANAGEMENT_MAX_STATUS; i++)
+        if (total.status_count[i] > 0)
+            fprintf(out, "proxy_upstream_responses_total{code=\"%d\"} %u\n", i, total.status_count[i]);
+    fprintf(out, "# TYPE proxy_upstream_response_types_total counter\n");
+    for (int i = 0; i < NOTHING; i++)
+        if (total.type_count[i] > 0)
+            fprintf(out, "proxy_upstream_response_types_total{type=\"%s\"} %u\n",
+                    http_get_mime_type_str((Types)i), total.type_count[i]);
+
+    /* bucket counts are exact to the histogram's 3% bucket width */
+    fprintf(out, "# TYPE proxy_request_duration_seconds histogram\n");
+    for (int i = 0; i < LATENCY_PHASES; i++)
+    {
+        for (uint64_t bound : bounds)
+            fprintf(out, "proxy_request_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                    phases[i], bound / 1e6, total.latency[i].CountAtMost(bound));
+        fprintf(out, "proxy_request_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n",
+                phases[i], total.latency[i].Count());
+        fprintf(out, "proxy_request_duration_seconds_sum{phase=\"%s\"} %.6f\n", phases[i], total.latency[i].Sum() / 1e6);
+        fprintf(out, "proxy_request_duration_seconds_count{phase=\"%s\"} %lu\n", phases[i], total.latency[i].Count());
+    }
+
+    /* tunnel bounds in milliseconds */
+    static const uint64_t tunnel_bounds[] = {100, 1000, 10000, 60000, 300000, 1800000};
+    fprintf(out, "# TYPE proxy_tunnels_open gauge\nproxy_tunnels_open %ld\n", (long) this->open_tunnels.load());
+    fprintf(out, "# TYPE proxy_tunnel_bytes_total counter\n");
+    fprintf(out, "proxy_tunnel_bytes_total{direction=\"up\"} %lu\n", total.tunnel_bytes_up);
+    fprintf(out, "proxy_tunnel_bytes_total{direction=\"down\"} %lu\n", total.tunnel_bytes_down);
+    fprintf(out, "# TYPE proxy_tunnel_duration_seconds histogram\n");
+    for (uint64_t bound : tunnel_bounds)
+        fprintf(out, "proxy_tunnel_duration_seconds_bucket{le=\"%g\"} %lu\n", bound / 1e3,
+                total.tunnel_duration.CountAtMost(bound));
+    fprintf(out, "proxy_tunnel_duration_seconds_bucket{le=\"+Inf\"} %lu\n", total.tunnels);
+    fprintf(out, "proxy_tunnel_duration_seconds_sum %.3f\n", total.tunnel_duration.Sum() / 1e3);
+    fprintf(out, "proxy_tunnel_duration_seconds_count %lu\n", total.tunnels);
+
+    /* a host served by several threads has histograms in each */
+    set<string> latency_hosts;
     pthread_mutex_lock(&this->management_lock);
-    this->sort_host_count(sorted_hosts);
+    vector<StatShard*> shards = this->shards;
     pthread_mutex_unlock(&this->management_lock);
+    for (StatShard *shard : shards)
+        for (size_t i = 0; i < MANAGEMENT_LATENCY_SLOTS; i++)
+        {
+            HostLatency *latency = shard->latency[i].load(memory_order_acquire);
+            if (latency != nullptr)
+                latency_hosts.insert(latency->host);
+        }
+    fprintf(out, "# TYPE proxy_latency_hosts gauge\nproxy_latency_hosts %zu\n", latency_hosts.size());
+    fprintf(out, "# TYPE proxy_management_clients gauge\nproxy_management_clients %zu\n", this->clients.size());
+    fprintf(out, "# TYPE proxy_log_dropped_records_total counter\nproxy_log_dropped_records_total %lu\n", log_dropped());
+
+    ResponseCache::getInstance()->metrics(out);
+    if (DiskCache::enabled())
+        DiskCache::getInstance()->metrics(out);
+    DNSResolver::getInstance()->metrics(out);
+    Connector::getInstance()->metrics(out);
+    BufferPool::getInstance()->metrics(out);
+    WQ::metrics(out);
+}
+
+/* runs one telnet command, returns false for exit */
+bool Management::run_command(char *buffer, FILE *out)
+{
+    if (strstr(buffer, "packet length stats"))
+    {
+        this->packet_len_stats(out);
+    }
+    else if (strstr(buffer, "type count"))
+    {
+        this->type_cnt(out);
+    }
+    else if (strstr(buffer, "status count"))
+    {
+        this->status_cnt(out);
+    }
+    else if (strstr(buffer, "cache stats"))
+    {
+        ResponseCache::getInstance()->stats(out);
+        if (DiskCache::enabled())
+            DiskCache::getInstance()->stats(out);
+    }
+    else if (strstr(buffer, "pool stats"))
+    {
+        BufferPool::getInstance()->stats(out);
+    }
+    else if (strstr(buffer, "queue stats"))
+    {
+        WQ::stats(out);
+    }
+    else if (strstr(buffer, "tunnel stats"))
+    {
+        this->tunnel_stats(out);
+    }
+    else if (strstr(buffer, "dns stats"))
+    {
+        DNSResolver::getInstance()->stats(out);
+    }
+    else if (strstr(buffer, "connect stats"))
+    {
+        Connector::getInstance()->stats(out);
+    }
+    else if (strstr(buffer, "latency"))
+    {
+        char *host = strchr(buffer, ' ');
+        this->latency_stats(out, host != nullptr ? host + 1 : "all");
+    }
+    else if (strstr(buffer, "top"))
+    {
+        /* top k [window], the window in seconds or with an m suffix in minutes */
+        size_t k = 0;
+        time_t window = 0;
+        char *tmp = strchr(buffer, ' ');
+        if (tmp != nullptr)
+        {
+            *tmp = '\0';
+            char *end;
+            k = (size_t)strtoul(tmp + 1, &end, 10);
+            window = (time_t)strtol(end, &end, 10);
+            if (*end == 'm')
+                window *= 60;
+        }
 
-    k = k > sorted_hosts.size() ? sorted_hosts.size() : k;
-    for (int i = 0; i < k; i++)
-        dprintf(fd, "%s\n", sorted_hosts[i].first.c_str());
+        this->top_visited_hosts(out, k, window);
+    }
+    else if (strstr(buffer, "exit"))
+    {
+        fprintf(out, "Bye\n");
+        return false;
+    }
+    else
+    {
+        fprintf(out, "Bad Request\n");
+    }
+    return true;
+}
+
+/* answers a GET once its head is complete, the connection closes afterwards */
+void Management::serve_http(Client *client)
+{
+    const char *head = client->input.c_str();
+    if (strstr(head, "\r\n\r\n") == nullptr && strstr(head, "\n\n") == nullptr)
+        return;
+
+    const char *path = head + strlen("GET ");
+    size_t path_len = strcspn(path, " ?\r\n");
+    bool found = path_len == strlen("/metrics") && strncmp(path, "/metrics", path_len) == 0;
+
+    char *body;
+    size_t body_len;
+    FILE *out = open_memstream(&body, &body_len);
+    if (found)
+        this->metrics(out);
+    else
+        fprintf(out, "Not Found\n");
+    fclose(out);
+
+    int status = found ? 200 : 404;
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %d %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                              status, http_get_response_message(status), body_len);
+    client->output.append(header, header_len);
+    client->output.append(body, body_len);
+    free(body);
+
+    client->input.clear();
+    client->closing = true;
+}
+
+/* runs the complete lines of a telnet session */
+void Management::serve_commands(Client *client)
+{
+    size_t start = 0, end;
+    while (!client->closing && (end = client->input.find('\n', start)) != string::npos)
+    {
+        string line = client->input.substr(start, end - start);
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        start = end + 1;
+
+        char *text;
+        size_t text_len;
+        FILE *out = open_memstream(&text, &text_len);
+        client->closing = !this->run_command(&line[0], out);
+        fclose(out);
+        client->output.append(text, text_len);
+        free(text);
+    }
+    client->input.erase(0, start);
+}
+
+/* reads and writes what the socket allows, returns false once the client is done */
+bool Management::serve_client(Client *client, uint32_t events)
+{
+    if (events & EPOLLERR)
+        return false;
+
+    if (client->output.empty() && (events & (EPOLLIN | EPOLLHUP)))
+    {
+        char buffer[4096];
+        bool eof = false;
+        while (!eof)
+        {
+            ssize_t n = read(client->fd, buffer, sizeof(buffer));
+            if (n == 0)
+            {
+                eof = true;
+                break;
+            }
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    break;
+                return false;
+            }
+            client->input.append(buffer, n);
+            if (client->input.size() > MANAGEMENT_MAX_INPUT)
+                return false;
+        }
+
+        if (client->input.compare(0, 4, "GET ") == 0 && client->output.empty() && !client->served)
+            this->serve_http(client);
+        else
+            this->serve_commands(client);
+        client->served = client->served || !client->output.empty();
+        client->closing = client->closing || eof;
+    }
+
+    while (!client->output.empty())
+    {
+        ssize_t n = write(client->fd, client->output.data(), client->output.size());
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            return false;
+        }
+        client->output.erase(0, n);
+    }
+    if (client->output.empty() && client->closing)
+        return false;
+
+    /* a client that does not read its output is not served further commands */
+    struct epoll_event event;
+    event.events = client->output.empty() ? EPOLLIN : EPOLLOUT;
+    event.data.ptr = client;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+
+    client->last_active = time(nullptr);
+    return true;
+}
+
+void Management::close_client(Client *client)
+{
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, client->fd, nullptr);
+    shutdown(client->fd, SHUT_RDWR);
+    close(client->fd);
+    this->clients.erase(find(this->clients.begin(), this->clients.end(), client));
+    delete client;
+}
+
+void Management::accept_clients()
+{
+    struct sockaddr_in client_address;
+    while (true)
+    {
+        socklen_t client_address_length = sizeof(client_address);
+        int fd = accept4(this->management_socket, (struct sockaddr *) &client_address, &client_address_length,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Error accepting socket");
+            return;
+        }
+
+        if (this->clients.size() >= MANAGEMENT_MAX_CLIENTS)
+        {
+            close(fd);
+            continue;
+        }
+
+        log_accept(inet_ntoa(client_address.sin_addr), client_address.sin_port);
+
+        Client *client = new Client();
+        client->fd = fd;
+        client->last_active = time(nullptr);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        this->clients.push_back(client);
+    }
 }
 
+/*
+ * Serves every management client from one epoll loop. Commands only copy
+ * counters, so no client waits for another, and one that stops reading only
+ * stalls itself.
+ */
 void Management::handle_requests(void *input)
 {
-    struct sockaddr_in server_address, client_address;
-    size_t client_address_length = sizeof(client_address);
+    struct sockaddr_in server_address;
 
-    instance->management_socket = socket(PF_INET, SOCK_STREAM, 0);
+    instance->management_socket = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (instance->management_socket == -1)
     {
         perror("Failed to create a new socket");
@@ -186,174 +748,174 @@ void Management::handle_requests(void *input)
         exit(errno);
     }
 
-    if (listen(instance->management_socket, 1) == -1)
+    if (listen(instance->management_socket, MANAGEMENT_BACKLOG) == -1)
     {
         perror("Failed to listen on socket");
         exit(errno);
     }
 
+    instance->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (instance->epoll_fd == -1)
+    {
+        perror("Failed to create management epoll");
+        exit(errno);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(instance->epoll_fd, EPOLL_CTL_ADD, instance->management_socket, &event);
+
     LOG("Listening on port %d...\n", MANAGEMENT_PORT);
 
+    struct epoll_event events[MANAGEMENT_MAX_EVENTS];
     while (true)
     {
-        int fd = accept(instance->management_socket, (struct sockaddr *) &client_address, (socklen_t *) &client_address_length);
-        if (fd < 0)
+        int n = epoll_wait(instance->epoll_fd, events, MANAGEMENT_MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR)
         {
-            perror("Error accepting socket");
+            perror("Management epoll_wait failed");
             continue;
         }
 
-        LOG("Accepted connection from %s on port %d\n", inet_ntoa(client_address.sin_addr), client_address.sin_port);
-
-        while (true)
+        for (int i = 0; i < n; i++)
         {
-            char *buffer = (char*)calloc(128 + 1, sizeof(char));
-
-            size_t read_bytes = http_receive_data(fd, buffer);
-            if (read_bytes == 0)
-            {
-                perror("Error reading message.");
-                break;
-            }
-
-            buffer[read_bytes - 2] = '\0';
-            if (strstr(buffer, "packet length stats"))
-            {
-                instance->packet_len_stats(fd);
-            }
-            else if (strstr(buffer, "type count"))
-            {
-                instance->type_cnt(fd);
-            }
-            else if (strstr(buffer, "status count"))
-            {
-                instance->status_cnt(fd);
-            }
-            else if (strstr(buffer, "top"))
-            {
-                size_t k = 0;
-                char *tmp = strchr(buffer, ' ');
-                if (tmp != nullptr)
-                {
-                    *tmp = '\0';
-                    k = (size_t)atoi(tmp + 1);
-                }
-
-                instance->top_visited_hosts(fd, k);
-            }
-            else if (strstr(buffer, "exit"))
-            {
-                dprintf(fd, "Bye\n");
-                free(buffer);
-                break;
-            }
-            else
-            {
-                dprintf(fd, "Bad Request\n");
-            }
-
-            free(buffer);
+            Client *client = (Client*) events[i].data.ptr;
+            if (client == nullptr)
+                instance->accept_clients();
+            else if (!instance->serve_client(client, events[i].events))
+                instance->close_client(client);
         }
 
-        shutdown(fd, SHUT_RDWR);
-        close(fd);
+        time_t now = time(nullptr);
+        vector<Client*> idle;
+        for (Client *client : instance->clients)
+            if (now - client->last_active > MANAGEMENT_IDLE_TIMEOUT)
+                idle.push_back(client);
+        for (Client *client : idle)
+            instance->close_client(client);
     }
 }
 
-void Management::handle_stats(char *buffer, struct http_request *request, LogMsg *msg)
+void Management::handle_stats(const char *buffer, size_t len, struct http_request *request, LogMsg *msg)
 {
-    int msg_len = -1, header_len = 0;
+    int msg_len = 0, header_len = 0;
 
-    /* extract header len */
-    char *header_end = strstr(buffer, "\r\n\r\n") + 4;
-    if (strstr(header_end, "\r\n") == header_end)
-        header_end += 2;
-    header_len = (int)(header_end - buffer);
+    /* one pass finds the end of the head and where every header starts */
+    http_head_index index;
+    header_len = scan_head(buffer, len, &index) != SCAN_MORE ? (int)index.head_len : (int)len;
 
     /* extract body length */
-    msg_len = 0;
-    char *content_len = strstr(buffer, "Content-Length: ");
+    size_t value_len;
+    const char *content_len = scan_find_header(&index, "Content-Length", &value_len);
     if (content_len)
-    {
-        content_len += strlen("Content-Length: ");
-        size_t len = 0;
-        while (*content_len != '\r')
-        {
-            content_len++;
-            len++;
-        }
-        char msg_len_str[len];
-        strncpy(msg_len_str, content_len - len, len);
-        msg_len = atoi(msg_len_str);
-    }
+        msg_len = atoi(content_len);
 
     if (request->client_req)
     {
         {
-            if (msg->req)
-                free(msg->req);
-            msg->req = (char *) calloc(strlen(request->method) + strlen(request->path) + strlen(request->version) + 3, sizeof(char));
-            sprintf(msg->req, "%s %s %s", request->method, request->path, request->version);
+            msg->begin_request();
+            msg->req = msg->arena.alloc(request->method.len + request->path.len + request->version.len + 3);
+            sprintf(msg->req, "%.*s %.*s %.*s", (int)request->method.len, request->method.data,
+                    (int)request->path.len, request->path.data, (int)request->version.len, request->version.data);
             msg->server_port = request->port;
-            if (msg->server_addr)
-                free(msg->server_addr);
-            msg->server_addr = (char *) calloc(strlen(request->host) + 1, sizeof(char));
-            strcpy(msg->server_addr, request->host);
-
-            time_t now = time(nullptr);
-            struct tm *ptm = gmtime(&now);
-            char time_buf[256] = {0};
-            strftime(time_buf, 256, "%a, %d %b %G %T %Z", ptm);
-
-            LOG("\r\nRequest: [%s] [%s:%d] [%s:%d]\n\"%s\"\r\n",
-                time_buf, msg->client_addr, msg->client_port, msg->server_addr, msg->server_port, msg->req);
+            msg->server_addr = msg->arena.strdup(request->host);
+
+            log_request(msg);
         }
 
-        pthread_mutex_lock(&this->management_lock);
-        this->client_pkt_len.Push(header_len + msg_len);
-        this->host_count[request->host]++;
-        pthread_mutex_unlock(&this->management_lock);
+        StatShard *shard = this->shard();
+        begin_update(shard);
+        shard->counters.client_pkt_len.Push(header_len + msg_len);
+        end_update(shard);
+
+        this->count_host(shard, request->host);
     }
     else
     {
         /* extract status code */
         int status_code = 0;
-        char *status_code_str_begin = buffer + strlen("HTTP/1.") + 2;
-        char *status_code_str_end = strchr(status_code_str_begin, ' ');
+        const char *status_code_str_begin = buffer + strlen("HTTP/1.") + 2;
+        const char *status_code_str_end = strchr(status_code_str_begin, ' ');
         char status_code_str[status_code_str_end - status_code_str_begin + 1] = {0};
         strncpy(status_code_str, status_code_str_begin, status_code_str_end - status_code_str_begin);
         status_code = atoi(status_code_str);
 
         /* extract type */
-        Types types = this->http_get_mime_type(buffer);
+        Types types = this->http_get_mime_type(&index);
 
         /* print response */
         if (status_code > 0)
-        {
-            time_t now = time(nullptr);
-            struct tm *ptm = gmtime(&now);
-            char time_buf[256] = {0};
-            strftime(time_buf, 256, "%a, %d %b %G %T %Z", ptm);
-
-            LOG("\r\nResponse: [%s] [%s:%d] [%s:%d]\n\"HTTP/1.1 %d %s\" for \"%s\"\r\n",
-                time_buf, msg->client_addr, msg->client_port, msg->server_addr, msg->server_port,
-                status_code, http_get_response_message(status_code), msg->req);
-        }
+            log_response(msg, status_code);
 
         /* update stats */
-        pthread_mutex_lock(&this->management_lock);
-        if (status_code > 0)
-            this->status_count[(StatusCode)status_code]++;
+        StatShard *shard = this->shard();
+        begin_update(shard);
+        if (status_code > 0 && status_code < MANAGEMENT_MAX_STATUS)
+            shard->counters.status_count[status_code]++;
         if (types != NOTHING)
-            this->type_count[types]++;
-        this->server_pkt_len.Push(header_len + msg_len);
-        this->server_bd_len.Push(msg_len);
-        pthread_mutex_unlock(&this->management_lock);
+            shard->counters.type_count[types]++;
+        end_update(shard);
     }
 }
 
+/* sizes of a complete response, the body with and without chunk framing */
+void Management::record_response(size_t head_len, uint64_t wire_body_len, uint64_t body_len)
+{
+    StatShard *shard = this->shard();
+    begin_update(shard);
+    shard->counters.server_pkt_len.Push(head_len + wire_body_len);
+    shard->counters.server_bd_len.Push(body_len);
+    end_update(shard);
+}
+
+void Management::record_tunnel_open()
+{
+    this->open_tunnels++;
+}
+
+void Management::record_tunnel(uint64_t bytes_up, uint64_t bytes_down, uint64_t duration_ms)
+{
+    this->open_tunnels--;
+
+    StatShard *shard = this->shard();
+    begin_update(shard);
+    shard->counters.tunnels++;
+    shard->counters.tunnel_bytes_up += bytes_up;
+    shard->counters.tunnel_bytes_down += bytes_down;
+    shard->counters.tunnel_duration.Push(duration_ms);
+    end_update(shard);
+}
+
+/* hosts are staged without a lock and added to the summaries a batch at a time */
+void Management::count_host(StatShard *shard, const char *host)
+{
+    if (shard->num_staged == MANAGEMENT_HOST_BATCH)
+    {
+        pthread_mutex_lock(&shard->host_lock);
+        for (size_t i = 0; i < shard->num_staged; i++)
+        {
+            shard->hosts->Push(shard->staged[i].host);
+            shard->recent_hosts->Push(shard->staged[i].host, shard->staged[i].when);
+        }
+        begin_update(shard);
+        shard->num_staged = 0;
+        end_update(shard);
+        pthread_mutex_unlock(&shard->host_lock);
+    }
+
+    begin_update(shard);
+    StagedHost *staged = &shard->staged[shard->num_staged];
+    strncpy(staged->host, host, LIBHTTP_MAX_HOST);
+    staged->host[LIBHTTP_MAX_HOST] = '\0';
+    staged->when = time(nullptr);
+    shard->num_staged++;
+    end_update(shard);
+}
+
 Management::~Management()
 {
+    close(this->epoll_fd);
     shutdown(this->management_socket, SHUT_RDWR);
     close(this->management_socket);
 }
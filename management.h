@@ -1,17 +1,31 @@
 #ifndef HTTP_PROXY_SERVER_MANAGEMENT_H
 #define HTTP_PROXY_SERVER_MANAGEMENT_H
 
+#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <ctime>
 #include <vector>
 #include <map>
 #include <string>
 #include <pthread.h>
 #include <cmath>
 
+#include "heavy_hitters.h"
+#include "latency.h"
 #include "libhttp.h"
 #include "log.h"
 
 #define MANAGEMENT_PORT     8091
+#define MANAGEMENT_BACKLOG  128
+#define MANAGEMENT_MAX_CLIENTS  256
+#define MANAGEMENT_MAX_EVENTS   64
+#define MANAGEMENT_MAX_INPUT    8192    /* unanswered input of a client, a command or an HTTP head */
+#define MANAGEMENT_IDLE_TIMEOUT 300     /* seconds until a silent client is closed */
+#define MANAGEMENT_MAX_STATUS   600
+#define MANAGEMENT_LATENCY_HOSTS    1024    /* hosts a thread keeps histograms of, more only count towards "all" */
+#define MANAGEMENT_LATENCY_SLOTS    2048    /* power of two, twice the hosts so that probes stay short */
+#define MANAGEMENT_HOST_BATCH       64      /* hosts a thread counts before it locks its summaries to add them */
 
 class RunningStat
 {
@@ -64,6 +78,27 @@ public:
         return sqrt( Variance() );
     }
 
+    void Merge(const RunningStat &other)
+    {
+        if (other.m_n == 0)
+            return;
+        if (m_n == 0)
+        {
+            *this = other;
+            return;
+        }
+
+        // See Chan, Golub & LeVeque, "Updating Formulae and a Pairwise Algorithm for Computing Sample Variances"
+        double n = (double)m_n + other.m_n;
+        double delta = other.m_oldM - m_oldM;
+        m_newM = m_oldM + delta*other.m_n/n;
+        m_newS = m_oldS + other.m_oldS + delta*delta*m_n*other.m_n/n;
+        m_n += other.m_n;
+
+        m_oldM = m_newM;
+        m_oldS = m_newS;
+    }
+
 private:
     uint32_t m_n;
     double m_oldM, m_newM, m_oldS, m_newS;
@@ -74,30 +109,106 @@ class Management
 private:
     enum Types {PLAIN, HTML, JPG, JPEG, PNG, CSS, JS, PDF, NOTHING};
 
-    RunningStat client_pkt_len, server_pkt_len, server_bd_len;
-    int management_socket{};
-    std::map<StatusCode, uint32_t> status_count;
-    std::map<Types, uint32_t> type_count;
-    std::map<std::string, uint32_t> host_count;
+    struct StatCounters
+    {
+        RunningStat client_pkt_len, server_pkt_len, server_bd_len;
+        uint32_t status_count[MANAGEMENT_MAX_STATUS];
+        uint32_t type_count[NOTHING];
+        LatencyHistogram latency[LATENCY_PHASES];
+
+        uint64_t tunnels;               /* CONNECT tunnels closed */
+        uint64_t tunnel_bytes_up, tunnel_bytes_down;
+        LatencyHistogram tunnel_duration;   /* milliseconds */
+    };
+
+    /* the name and hash never change once the entry is published */
+    struct HostLatency
+    {
+        uint64_t hash;
+        char host[LIBHTTP_MAX_HOST + 1];
+        LatencyHistogram phases[LATENCY_PHASES];
+    };
 
-    pthread_mutex_t management_lock{};
+    struct StagedHost
+    {
+        char host[LIBHTTP_MAX_HOST + 1];
+        time_t when;
+    };
 
+    /* one per thread; the owner writes without locking and queries merge all shards */
+    struct StatShard
+    {
+        std::atomic<uint32_t> seq;      /* odd while the owner is writing counters, staged hosts or histograms */
+        StatCounters counters;
+
+        std::atomic<HostLatency*> *latency;     /* MANAGEMENT_LATENCY_SLOTS, found by host hash */
+        uint32_t latency_hosts;
+
+        pthread_mutex_t host_lock;      /* held while the staged hosts are added to the summaries, or copied */
+        SpaceSaving *hosts;
+        WindowedSpaceSaving *recent_hosts;
+        StagedHost staged[MANAGEMENT_HOST_BATCH];
+        size_t num_staged;
+    };
+
+    /* a telnet session, or an HTTP client asking for /metrics */
+    struct Client
+    {
+        int fd;
+        std::string input, output;
+        time_t last_active;
+        bool served = false;        /* answered something, later input is never HTTP */
+        bool closing = false;       /* close once the output is written */
+    };
+
+    int management_socket{};
+    int epoll_fd = -1;
+    std::vector<Client*> clients;   /* only touched by the management thread */
+    std::vector<StatShard*> shards;
+    pthread_mutex_t management_lock{};    /* guards shards */
+    std::atomic<int64_t> open_tunnels{0};
+
+    static thread_local StatShard *local_shard;
     static Management *instance;
     Management();
     ~Management();
-    static Types http_get_mime_type(char *buffer);
+    static Types http_get_mime_type(const struct http_head_index *index);
     static const char *http_get_mime_type_str(Management::Types);
-    void sort_host_count(std::vector<std::pair<std::string, uint32_t>>& A);
-
-    void packet_len_stats(int fd);
-    void type_cnt(int fd);
-    void status_cnt(int fd);
-    void top_visited_hosts(int fd, size_t k);
+    void collect_hosts(time_t window, std::vector<SpaceSaving> &summaries);
+
+    StatShard *shard();
+    static void begin_update(StatShard *shard);
+    static void end_update(StatShard *shard);
+    static void read_shard(StatShard *shard, void *to, const void *from, size_t len);
+    static HostLatency *find_latency(StatShard *shard, const char *host, uint64_t hash);
+    void count_host(StatShard *shard, const char *host);
+    void merge_counters(StatCounters &total);
+
+    void packet_len_stats(FILE *out);
+    void type_cnt(FILE *out);
+    void status_cnt(FILE *out);
+    void top_visited_hosts(FILE *out, size_t k, time_t window);
+    void latency_stats(FILE *out, const char *host);
+    void tunnel_stats(FILE *out);
+    void metrics(FILE *out);
+
+    bool run_command(char *buffer, FILE *out);
+    void serve_http(Client *client);
+    void serve_commands(Client *client);
+    bool serve_client(Client *client, uint32_t events);
+    void close_client(Client *client);
+    void accept_clients();
 
 public:
+    static size_t top_capacity;     /* hosts each thread tracks for top k */
+
     static Management* getInstance();
     static void handle_requests(void *input);
-    void handle_stats(char *buffer, struct http_request *request, LogMsg *msg);
+    void handle_stats(const char *buffer, size_t len, struct http_request *request, LogMsg *msg);
+    void record_response(size_t head_len, uint64_t wire_body_len, uint64_t body_len);
+    void record_latency(const char *host, const latency_trace *trace);
+    void record_tunnel_open();
+    void record_tunnel(uint64_t bytes_up, uint64_t bytes_down, uint64_t duration_ms);
 };
 
 #endif //HTTP_PROXY_SERVER_MANAGEMENT_H
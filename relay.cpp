@@ -0,0 +1,1672 @@
+#include "relay.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+#include "cache.h"
+#include "conn_pool.h"
+#include "connector.h"
+#include "disk_cache.h"
+#include "management.h"
+#include "scan.h"
+#include "wq.h"
+
+using namespace std;
+
+vector<Relay*> Relay::loops;
+uint32_t Relay::next_loop = 0;
+thread_local int Relay::home_loop = -1;
+RelayBackend Relay::backend = RELAY_EPOLL;
+
+/* io_uring operations, kept in the low bits of the connection pointer that tags them */
+enum RelayOp
+{
+    OP_WAKE, OP_RECV_CLIENT, OP_SEND_SERVER, OP_RECV_SERVER, OP_SEND_CLIENT, OP_CANCEL
+};
+#define RELAY_OP_MASK       7
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+Relay::Relay()
+{
+    this->epoll_fd = epoll_create1(0);
+    this->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (this->epoll_fd == -1 || this->event_fd == -1)
+    {
+        perror("Failed to create relay event loop");
+        exit(errno);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->event_fd, &event);
+
+    this->read_buffer = (char*) calloc(LIBHTTP_REQUEST_MAX_SIZE + 1, sizeof(char));
+    pthread_mutex_init(&this->lock, nullptr);
+}
+
+Relay::~Relay()
+{
+    close(this->event_fd);
+    close(this->epoll_fd);
+    free(this->read_buffer);
+}
+
+void Relay::init(int num_loops, const vector<int> *cpus)
+{
+    if (backend == RELAY_URING && !Uring::supported())
+    {
+        fprintf(stderr, "io_uring is not available, relaying with epoll\n");
+        backend = RELAY_EPOLL;
+    }
+
+    for (int i = 0; i < num_loops; i++)
+    {
+        Relay *relay = new Relay();
+        relay->cpu = cpus != nullptr && !cpus->empty() ? (*cpus)[i % cpus->size()] : -1;
+        loops.push_back(relay);
+
+        pthread_t relay_thread;
+        pthread_create(&relay_thread, nullptr, (void *(*)(void *))event_loop, (void*)relay);
+    }
+}
+
+relay_conn *Relay::new_conn(LogMsg *msg)
+{
+    relay_conn *conn = new relay_conn();
+    conn->msg = msg;
+
+    conn->up.src_fd = msg->client_socket;
+    conn->up.dst_fd = msg->server_socket;
+    conn->up.buffer = BufferPool::getInstance()->get(BUFFER_FORWARD);
+    conn->up.splice_fds[0] = conn->up.splice_fds[1] = -1;
+
+    conn->down.src_fd = msg->server_socket;
+    conn->down.dst_fd = msg->client_socket;
+    conn->down.buffer = BufferPool::getInstance()->get(BUFFER_READ);
+    conn->down.splice_fds[0] = conn->down.splice_fds[1] = -1;
+
+    conn->client.conn = conn->server.conn = conn;
+    conn->client.fd = msg->client_socket;
+    conn->server.fd = msg->server_socket;
+
+    conn->host = msg->server_addr;
+    conn->port = msg->server_port;
+    return conn;
+}
+
+/* a client between requests only holds the bytes of its next head, buffers come with an upstream */
+relay_conn *Relay::idle_conn(LogMsg *msg)
+{
+    relay_conn *conn = new relay_conn();
+    conn->msg = msg;
+    conn->idle = true;
+    conn->held.swap(msg->pending);
+    conn->stream.parser.set_max_head(http_max_head_size);
+
+    conn->up.src_fd = conn->down.dst_fd = msg->client_socket;
+    conn->up.dst_fd = conn->down.src_fd = -1;
+    conn->up.splice_fds[0] = conn->up.splice_fds[1] = -1;
+    conn->down.splice_fds[0] = conn->down.splice_fds[1] = -1;
+
+    conn->client.conn = conn->server.conn = conn;
+    conn->client.fd = msg->client_socket;
+    conn->server.fd = -1;
+    return conn;
+}
+
+/* the caller's home loop if it has one, round robin otherwise */
+Relay *Relay::pick()
+{
+    return home_loop >= 0 ? loops[home_loop % loops.size()] : loops[__sync_fetch_and_add(&next_loop, 1) % loops.size()];
+}
+
+/* the leader of a collapsed fetch and its followers share a loop, picked by whichever comes first */
+Relay *Relay::fetch_loop(cache_fetch *fetch)
+{
+    pthread_mutex_lock(&fetch->lock);
+    if (fetch->loop == nullptr)
+        fetch->loop = pick();
+    Relay *relay = fetch->loop;
+    pthread_mutex_unlock(&fetch->lock);
+    return relay;
+}
+
+/* queues a connection for a loop, picked unless given */
+void Relay::hand_off(relay_conn *conn, Relay *relay)
+{
+    if (relay == nullptr)
+        relay = pick();
+
+    pthread_mutex_lock(&relay->lock);
+    relay->incoming.push_back(conn);
+    pthread_mutex_unlock(&relay->lock);
+
+    uint64_t one = 1;
+    if (write(relay->event_fd, &one, sizeof(one)) < 0)
+        perror("Failed to wake relay loop");
+}
+
+/* the head and the body bytes behind it go out in one send now, the loop only finishes what did not fit */
+static void send_early(relay_conn *conn)
+{
+    ssize_t bytes_sent = send(conn->server.fd, conn->up.buffer, conn->up.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (bytes_sent == (ssize_t)conn->up.len)
+        conn->up.off = conn->up.len = 0;
+    else if (bytes_sent > 0)
+        conn->up.off = (size_t)bytes_sent;
+}
+
+/* takes over a client whose first request head has been read and an upstream connection for it */
+bool Relay::dispatch(LogMsg *msg, http_stream *stream, http_request *request, const char *rest, size_t rest_len,
+                     const shared_ptr<cache_fetch> &fetch)
+{
+    relay_conn *conn = new_conn(msg);
+    conn->stream = *stream;
+    conn->loop = fetch ? fetch_loop(fetch.get()) : pick();
+
+    /* the rewritten head, then whatever followed it in the last read; requests pipelined behind it are fetched apart */
+    track_request(conn, stream, request);
+    conn->exchanges.front().fetch = fetch;
+    conn->up.len = http_request_write_head(request, conn->up.buffer, LIBHTTP_FORWARD_SIZE);
+    if (conn->up.len == 0 || !forward_requests(conn, rest, rest_len, queue_request))
+    {
+        BufferPool::getInstance()->put(BUFFER_FORWARD, conn->up.buffer);
+        BufferPool::getInstance()->put(BUFFER_READ, conn->down.buffer);
+        delete(conn);
+        return false;
+    }
+
+    send_early(conn);
+    hand_off(conn, conn->loop);
+    return true;
+}
+
+/*
+ * Starts fetching a request pipelined behind the first on an upstream
+ * connection of its own, from the pool when one is idle. Its response is
+ * kept in conn->queued until the client has been sent the ones before it.
+ * Requests with a body, tunnels and those beyond RELAY_PIPELINE_MAX wait
+ * for the workers like requests for another upstream do, and so do heads
+ * that cannot be rewritten, for the workers to answer with a 400.
+ */
+int Relay::queue_request(void *context, http_stream *stream, http_request *request)
+{
+    relay_conn *conn = (relay_conn*)context;
+    struct iovec iov[LIBHTTP_HEAD_IOV_MAX];
+    if (stream->body_remaining != 0 || http_slice_equals(request->method, "CONNECT") ||
+        conn->queued.size() >= RELAY_PIPELINE_MAX || http_request_head_iov(request, iov, LIBHTTP_HEAD_IOV_MAX) < 0)
+    {
+        conn->held.assign(stream->head, stream->head_len);
+        stream->body_remaining = 0;
+        return HEAD_HOLD;
+    }
+
+    shared_ptr<cache_fetch> fetch = make_shared<cache_fetch>();
+    fetch->pipelined = true;
+    fetch->loop = conn->loop;
+    conn->queued.push_back(fetch);
+
+    LogMsg *msg = new LogMsg();
+    msg->set_client_addr(conn->msg->client_addr);
+    msg->client_port = conn->msg->client_port;
+    msg->client_socket = -1;
+    msg->queue = conn->msg->queue;
+    msg->trace.parsed = latency_now();
+    Management::getInstance()->handle_stats(stream->head, stream->head_len, request, msg);
+
+    shared_ptr<const cache_object> object;
+    if (ResponseCache::cacheable_request(stream, request))
+        object = ResponseCache::getInstance()->lookup(ResponseCache::key(request), request->headers.data);
+    if (object)
+    {
+        fetch->data = object->response;
+        fetch->keep_alive = object->keep_alive;
+        fetch->complete = true;
+        delete(msg);
+        return HEAD_TAKEN;
+    }
+
+    msg->server_socket = ConnPool::getInstance()->acquire(request->host, request->port);
+    if (msg->server_socket < 0)
+        msg->server_socket = Connector::getInstance()->open(request->host, request->port, &msg->trace);
+    if (msg->server_socket < 0)
+    {
+        fetch->data = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        fetch->complete = true;
+        delete(msg);
+        return HEAD_TAKEN;
+    }
+
+    relay_conn *fetcher = new_conn(msg);
+    fetcher->prefetch = true;
+    http_stream_init(&fetcher->stream);
+    track_request(fetcher, stream, request);
+    fetcher->exchanges.front().fetch = fetch;
+    fetcher->up.len = http_request_write_head(request, fetcher->up.buffer, LIBHTTP_FORWARD_SIZE);
+
+    /*
+     * Sends in flight point into the data, which therefore has room for all it
+     * holds at once: reading stops at RELAY_REORDER_MAX, and the last read
+     * appends its bytes plus heads that began in earlier reads, a 1xx and the
+     * final one at most.
+     */
+    fetch->data.reserve(RELAY_REORDER_MAX + RELAY_SPLICE_SIZE + 2 * http_max_head_size);
+    fetch->fetcher = fetcher;
+    send_early(fetcher);
+    hand_off(fetcher, conn->loop);
+    return HEAD_TAKEN;
+}
+
+/* the follower only sends, to the loop that receives the response; it waits there for the head instead of in a worker */
+bool Relay::follow(LogMsg *msg, http_stream *stream, const shared_ptr<cache_fetch> &fetch)
+{
+    if (!ResponseCache::getInstance()->follow(fetch.get(), stream->head + stream->parser.line_len))
+        return false;
+
+    msg->server_socket = -1;
+    relay_conn *conn = new_conn(msg);
+    conn->stream = *stream;
+    conn->up.eof = true;
+    conn->fetch = fetch;
+    conn->opened = latency_now();
+
+    hand_off(conn, fetch_loop(fetch.get()));
+    return true;
+}
+
+void Relay::wait(LogMsg *msg)
+{
+    hand_off(idle_conn(msg));
+}
+
+void Relay::tunnel(LogMsg *msg, size_t sent)
+{
+    relay_conn *conn = new_conn(msg);
+    conn->tunnel = true;
+    conn->up.relayed = sent;
+    conn->opened = latency_now();
+
+    Management::getInstance()->record_tunnel_open();
+    hand_off(conn);
+}
+
+void Relay::set_home(int loop)
+{
+    home_loop = loop;
+}
+
+void Relay::accept_incoming()
+{
+    uint64_t count;
+    if (read(this->event_fd, &count, sizeof(count)) < 0 && !would_block())
+        perror("Failed to read relay event");
+
+    vector<relay_conn*> pending;
+    pthread_mutex_lock(&this->lock);
+    pending.swap(this->incoming);
+    pthread_mutex_unlock(&this->lock);
+
+    for (relay_conn *conn : pending)
+        this->add(conn);
+}
+
+void Relay::add(relay_conn *conn)
+{
+    conn->loop = this;
+    if (conn->idle)
+    {
+        this->await_request(conn);
+        return;
+    }
+    if (conn->fetch)
+    {
+        conn->last_active = time(nullptr);
+        this->conns.insert(conn);
+        conn->fetch->followers.push_back(conn);
+
+        /* only hang ups are watched until there is something to send */
+        if (this->ring == nullptr)
+        {
+            set_nonblocking(conn->client.fd);
+            struct epoll_event event;
+            event.events = conn->client.events = 0;
+            event.data.ptr = &conn->client;
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, conn->client.fd, &event);
+        }
+
+        /* the head may have been decided on since the worker attached the client */
+        if (!conn->fetch->pipelined &&
+            !ResponseCache::getInstance()->shares(conn->fetch.get(), conn->stream.head + conn->stream.parser.line_len, true))
+            this->unfollow(conn);
+        else
+            this->feed(conn);
+        return;
+    }
+
+    if (this->ring != nullptr)
+    {
+        this->uring_add(conn);
+        return;
+    }
+
+    set_nonblocking(conn->server.fd);
+
+    struct epoll_event event;
+    conn->client.events = conn->server.events = EPOLLIN;
+    event.events = EPOLLIN;
+
+    if (!conn->prefetch)
+    {
+        set_nonblocking(conn->client.fd);
+        event.data.ptr = &conn->client;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, conn->client.fd, &event);
+    }
+    event.data.ptr = &conn->server;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, conn->server.fd, &event);
+
+    conn->last_active = time(nullptr);
+    this->conns.insert(conn);
+
+    /* flush the requests the worker left behind */
+    this->update_events(&conn->client);
+    this->update_events(&conn->server);
+}
+
+/* the client is not read while a request of it waits for responses to earlier ones, and a prefetch has none */
+static bool client_paused(const relay_conn *conn)
+{
+    return conn->prefetch || !conn->held.empty() || !conn->queued.empty();
+}
+
+/* a pipelined response is read no further than RELAY_REORDER_MAX ahead of its client */
+static bool ahead_full(const relay_conn *conn)
+{
+    return conn->prefetch && !conn->exchanges.empty() && conn->exchanges.front().fetch->data.size() >= RELAY_REORDER_MAX;
+}
+
+/* returns 1 when the pipe is drained, 0 if the destination would block and -1 on error */
+int Relay::flush(relay_pipe *pipe)
+{
+    while (pipe->off < pipe->len)
+    {
+        ssize_t bytes_sent = write(pipe->dst_fd, pipe->buffer + pipe->off, pipe->len - pipe->off);
+        if (bytes_sent < 0)
+            return would_block() ? 0 : -1;
+        pipe->off += bytes_sent;
+    }
+
+    pipe->off = pipe->len = 0;
+    return 1;
+}
+
+int Relay::track_request(void *context, http_stream *stream, http_request *request)
+{
+    relay_conn *conn = (relay_conn*)context;
+
+    /* another upstream, or a tunnel, is for the workers to set up once this one has answered */
+    if (http_slice_equals(request->method, "CONNECT") || request->port != conn->port ||
+        strcasecmp(request->host, conn->host.c_str()) != 0)
+    {
+        conn->held.assign(stream->head, stream->head_len);
+        stream->body_remaining = 0;
+        return HEAD_HOLD;
+    }
+
+    relay_exchange exchange;
+    exchange.trace = conn->msg->trace;
+    conn->msg->trace = latency_trace();
+    if (exchange.trace.parsed == 0)
+        exchange.trace.parsed = latency_now();
+    exchange.head_request = http_slice_equals(request->method, "HEAD");
+    exchange.cacheable = ResponseCache::cacheable_request(stream, request);
+    if (exchange.cacheable)
+    {
+        exchange.cache_key = ResponseCache::key(request);
+        exchange.request_headers.assign(request->headers.data, request->headers.len);
+    }
+    conn->exchanges.push_back(exchange);
+    return HEAD_FORWARD;
+}
+
+/* rewrites client bytes onto what the upstream buffer holds, false if they are not a valid request */
+bool Relay::forward_requests(relay_conn *conn, const char *data, size_t len, http_head_handler on_head)
+{
+    size_t forwarded, held;
+    if (!http_stream_forward(&conn->stream, data, len, conn->up.buffer + conn->up.len, LIBHTTP_FORWARD_SIZE - conn->up.len,
+                             &forwarded, &held, conn->msg, on_head, conn))
+        return false;
+    conn->up.len += forwarded;
+    conn->held.append(data + len - held, held);
+    return true;
+}
+
+/* everything sent upstream has been answered and passed on to the client */
+bool Relay::answered(relay_conn *conn)
+{
+    return conn->exchanges.empty() && conn->response.idle() && conn->up.off == conn->up.len &&
+           conn->down.off == conn->down.len && conn->down.spliced == 0;
+}
+
+/* follows response boundaries so that the upstream can be pooled once the client leaves */
+void Relay::track_response(relay_conn *conn, const char *data, size_t len)
+{
+    FrameStatus status = FRAME_MORE;
+
+    /* after a head the framer is called once more, a body may be empty */
+    while (len > 0 || status == FRAME_HEAD)
+    {
+        relay_exchange *exchange = conn->exchanges.empty() ? nullptr : &conn->exchanges.front();
+
+        /* head bytes are only passed on whole, by start_response */
+        size_t consumed;
+        bool body = !conn->response.in_head();
+        status = conn->response.feed(data, len, exchange && exchange->head_request, &consumed);
+        if (status == FRAME_HEAD)
+            start_response(conn, exchange);
+        else if (body)
+        {
+            if (conn->disk)
+                DiskCache::getInstance()->append(conn->disk, data, consumed);
+            if (conn->capturing)
+                conn->capture.append(data, consumed);
+            if (exchange && exchange->fetch && (conn->capturing || exchange->fetch->pipelined))
+            {
+                exchange->fetch->data.append(data, consumed);
+                conn->loop->feed_followers(exchange->fetch.get());
+            }
+        }
+        data += consumed;
+        len -= consumed;
+
+        if (status == FRAME_DONE)
+            finish_response(conn);
+    }
+}
+
+void Relay::start_response(relay_conn *conn, relay_exchange *exchange)
+{
+    HttpResponseFramer *response = &conn->response;
+
+    if (exchange && exchange->trace.first_byte == 0)
+        exchange->trace.first_byte = latency_now();
+    http_response_parse(response->index.data, response->head_len, conn->msg);
+    if (exchange && exchange->fetch && exchange->fetch->pipelined)
+    {
+        exchange->fetch->data.append(response->index.data, response->head_len);
+        exchange->fetch->keep_alive = response->keep_alive;
+        conn->loop->feed_followers(exchange->fetch.get());
+    }
+    if (response->status_code / 100 == 1)
+        return;
+
+    /* cacheable responses are copied as they pass, which rules out splicing them */
+    time_t expires;
+    size_t head_len = response->head_len;
+    bool storable = exchange && exchange->cacheable && response->content_length >= 0 &&
+                    ResponseCache::freshness(response->index.data, head_len, &expires);
+    conn->capturing = storable && head_len + response->content_length <= CACHE_MAX_OBJECT;
+    if (conn->capturing)
+    {
+        conn->capture.assign(response->index.data, head_len);
+        conn->capture_head_len = head_len;
+    }
+    conn->disk.reset();
+    if (storable && DiskCache::enabled())
+        conn->disk = DiskCache::getInstance()->begin(exchange->cache_key, exchange->request_headers.c_str(),
+                                                     response->index.data, head_len,
+                                                     head_len + response->content_length, expires, response->keep_alive);
+
+    if (!exchange || !exchange->fetch || exchange->fetch->pipelined)
+        return;
+    cache_fetch *fetch = exchange->fetch.get();
+    if (conn->capturing)
+    {
+        /* reserved whole so that sends in flight from it stay valid */
+        fetch->keep_alive = response->keep_alive;
+        fetch->data.reserve(head_len + response->content_length);
+        fetch->data.assign(response->index.data, head_len);
+        ResponseCache::getInstance()->share(fetch, fetch->data.c_str(), exchange->request_headers.c_str());
+        conn->loop->settle_followers(fetch);
+    }
+    else
+    {
+        ResponseCache::getInstance()->abandon(fetch);
+        conn->loop->settle_followers(fetch);
+        exchange->fetch.reset();
+    }
+}
+
+void Relay::finish_response(relay_conn *conn)
+{
+    HttpResponseFramer *response = &conn->response;
+    Management::getInstance()->record_response(response->head_len, response->body_wire_len, response->body_len);
+    if (conn->exchanges.empty())
+        return;
+
+    relay_exchange &exchange = conn->exchanges.front();
+    exchange.trace.last_byte = latency_now();
+    Management::getInstance()->record_latency(conn->host.c_str(), &exchange.trace);
+
+    if (conn->capturing)
+    {
+        ResponseCache::getInstance()->store(exchange.cache_key, exchange.request_headers.c_str(), conn->capture,
+                                            conn->capture_head_len, response->keep_alive);
+        conn->capture.clear();
+        conn->capturing = false;
+    }
+    if (conn->disk)
+    {
+        DiskCache::getInstance()->commit(conn->disk);
+        conn->disk.reset();
+    }
+    if (exchange.fetch)
+    {
+        /* from now on the cache has it, or the follower of a pipelined response does */
+        exchange.fetch->complete = true;
+        exchange.fetch->fetcher = nullptr;
+        ResponseCache::getInstance()->forget(exchange.fetch.get());
+        conn->loop->feed_followers(exchange.fetch.get());
+    }
+    conn->exchanges.pop_front();
+}
+
+/*
+ * Moves up to max bytes through a pipe pair without copying them to user
+ * space, same return values as flush. moved is what was read from src_fd.
+ */
+int Relay::splice_through(relay_pipe *pipe, size_t max, size_t *moved)
+{
+    *moved = 0;
+    if (pipe->spliced == 0)
+    {
+        if (pipe->splice_fds[0] < 0 && pipe2(pipe->splice_fds, O_NONBLOCK | O_CLOEXEC) < 0)
+            return -1;
+
+        ssize_t bytes_read = splice(pipe->src_fd, nullptr, pipe->splice_fds[1], nullptr, max,
+                                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytes_read < 0)
+            return would_block() ? 0 : -1;
+        if (bytes_read == 0)
+        {
+            pipe->eof = true;
+            return 1;
+        }
+
+        pipe->spliced = (size_t)bytes_read;
+        pipe->relayed += (size_t)bytes_read;
+        *moved = (size_t)bytes_read;
+    }
+
+    while (pipe->spliced > 0)
+    {
+        ssize_t bytes_sent = splice(pipe->splice_fds[0], nullptr, pipe->dst_fd, nullptr, pipe->spliced,
+                                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytes_sent < 0)
+            return would_block() ? 0 : -1;
+        pipe->spliced -= bytes_sent;
+    }
+    return 1;
+}
+
+/* response bodies bypass the framer, which only counts them */
+int Relay::splice_body(relay_conn *conn)
+{
+    uint64_t remaining = conn->response.splice_remaining();
+    size_t moved;
+    int status = splice_through(&conn->down, remaining > RELAY_SPLICE_SIZE ? RELAY_SPLICE_SIZE : (size_t)remaining,
+                                &moved);
+    if (moved > 0 && conn->response.skip(moved) == FRAME_DONE)
+        finish_response(conn);
+    return status;
+}
+
+bool Relay::reusable(relay_conn *conn)
+{
+    return !conn->tunnel && conn->server.fd >= 0 && conn->response.idle() && conn->response.keep_alive && conn->exchanges.empty() &&
+           http_stream_idle(&conn->stream) && conn->up.off == conn->up.len && conn->down.spliced == 0 && !conn->down.eof;
+}
+
+bool Relay::pump_up(relay_conn *conn)
+{
+    relay_pipe *pipe = &conn->up;
+    char *parse_buffer = this->read_buffer;
+
+    for (int i = 0; i < 4; i++)
+    {
+        int status = flush(pipe);
+        if (status <= 0)
+            return status == 0;
+        if (pipe->eof)
+            return false;
+        if (client_paused(conn))
+            return true;
+
+        ssize_t bytes_read = read(pipe->src_fd, parse_buffer, LIBHTTP_REQUEST_MAX_SIZE);
+        if (bytes_read < 0)
+            return would_block();
+        if (bytes_read == 0)
+        {
+            pipe->eof = true;
+            continue;
+        }
+
+        if (!forward_requests(conn, parse_buffer, (size_t)bytes_read))
+        {
+            http_send_response(conn->client.fd, 400);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Relay::pump_down(relay_conn *conn)
+{
+    relay_pipe *pipe = &conn->down;
+
+    for (int i = 0; i < 4; i++)
+    {
+        int status = flush(pipe);
+        if (status > 0 && pipe->spliced > 0)
+            status = splice_body(conn);
+        if (status <= 0)
+            return status == 0;
+        if (pipe->eof)
+            return false;
+
+        if (ahead_full(conn))
+            return true;
+
+        /* once the head has been seen and counted the body bypasses the parsers */
+        if (!conn->capturing && !conn->disk && !conn->prefetch && conn->response.splice_remaining() > 0)
+        {
+            status = splice_body(conn);
+            if (status <= 0)
+                return status == 0;
+            continue;
+        }
+
+        ssize_t bytes_read = read(pipe->src_fd, pipe->buffer, LIBHTTP_REQUEST_MAX_SIZE);
+        if (bytes_read < 0)
+            return would_block();
+        if (bytes_read == 0)
+        {
+            pipe->eof = true;
+            continue;
+        }
+        pipe->buffer[bytes_read] = '\0';
+        pipe->len = (size_t)bytes_read;
+
+        track_response(conn, pipe->buffer, pipe->len);
+
+        /* a prefetch passed it to its fetch, and is done once the response is */
+        if (conn->prefetch)
+            pipe->len = 0;
+        if (conn->prefetch && conn->exchanges.empty())
+            return false;
+    }
+
+    return true;
+}
+
+/* a tunnel splices each way until both sides have finished sending */
+bool Relay::pump_tunnel(relay_conn *conn, relay_pipe *pipe)
+{
+    for (int i = 0; i < 4 && !(pipe->eof && pipe->spliced == 0); i++)
+    {
+        size_t moved;
+        int status = splice_through(pipe, RELAY_SPLICE_SIZE, &moved);
+        if (status <= 0)
+            return status == 0;
+        if (pipe->eof)
+        {
+            /* pass the half close on, TLS sessions end with one */
+            shutdown(pipe->dst_fd, SHUT_WR);
+            return !conn->up.eof || !conn->down.eof;
+        }
+    }
+
+    return true;
+}
+
+void Relay::update_events(relay_end *end)
+{
+    relay_conn *conn = end->conn;
+    relay_pipe *in = end == &conn->client ? &conn->up : &conn->down;
+    relay_pipe *out = end == &conn->client ? &conn->down : &conn->up;
+    if (end->fd < 0)
+        return;
+
+    uint32_t events = 0;
+    if (in->off == in->len && in->spliced == 0 && !in->eof &&
+        (in == &conn->up ? !client_paused(conn) : !ahead_full(conn)))
+        events |= EPOLLIN;
+    if (out->off < out->len || out->spliced > 0)
+        events |= EPOLLOUT;
+
+    if (events == end->events)
+        return;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = end;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, end->fd, &event);
+    end->events = events;
+}
+
+void Relay::handle_event(relay_end *end, uint32_t events)
+{
+    relay_conn *conn = end->conn;
+    bool client = end == &conn->client;
+    bool ok = true;
+
+    conn->last_active = time(nullptr);
+
+    if (conn->idle)
+    {
+        this->read_head(conn);
+        return;
+    }
+    if (conn->fetch)
+    {
+        if (events & (EPOLLHUP | EPOLLERR))
+            this->close_conn(conn);
+        else
+            this->feed(conn);
+        return;
+    }
+
+    if (conn->tunnel)
+    {
+        relay_pipe *in = client ? &conn->up : &conn->down;
+        relay_pipe *out = client ? &conn->down : &conn->up;
+        /* a peer that hung up after closing its side can take nothing more either */
+        if ((events & EPOLLERR) || ((events & EPOLLHUP) && in->eof))
+            ok = false;
+        else if (events & (EPOLLIN | EPOLLHUP))
+            ok = pump_tunnel(conn, in);
+        if (ok && (events & EPOLLOUT))
+            ok = pump_tunnel(conn, out);
+    }
+    else
+    {
+        /* a client holding a request back is not read, so a hang up is all that can come from it */
+        if (client && client_paused(conn) && (events & (EPOLLHUP | EPOLLERR)))
+            ok = false;
+        else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ok = client ? this->pump_up(conn) : this->pump_down(conn);
+        if (ok && (events & EPOLLOUT))
+            ok = client ? this->pump_down(conn) : this->pump_up(conn);
+    }
+
+    if ((!conn->held.empty() || !conn->queued.empty()) && (ok || conn->down.eof))
+    {
+        if (conn->down.eof && conn->response.finish_eof())
+            finish_response(conn);
+        if (answered(conn))
+        {
+            this->reroute(conn);
+            return;
+        }
+    }
+    if (!ok)
+    {
+        this->close_conn(conn);
+        return;
+    }
+
+    this->update_events(&conn->client);
+    this->update_events(&conn->server);
+}
+
+static void close_splice_pipes(relay_conn *conn)
+{
+    for (relay_pipe *pipe : {&conn->up, &conn->down})
+        if (pipe->splice_fds[0] >= 0)
+        {
+            close(pipe->splice_fds[0]);
+            close(pipe->splice_fds[1]);
+            pipe->splice_fds[0] = pipe->splice_fds[1] = -1;
+        }
+}
+
+void Relay::close_conn(relay_conn *conn)
+{
+    if (this->ring == nullptr)
+    {
+        if (conn->client.fd >= 0)
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->client.fd, nullptr);
+        if (conn->server.fd >= 0)
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->server.fd, nullptr);
+    }
+
+    /* a response delimited by the server closing ends here, and so does a tunnel */
+    if (conn->tunnel)
+        Management::getInstance()->record_tunnel(conn->up.relayed, conn->down.relayed,
+                                                 (latency_now() - conn->opened) / 1000000);
+    else if (conn->down.eof && conn->response.finish_eof())
+        finish_response(conn);
+
+    if (reusable(conn))
+        ConnPool::getInstance()->release(conn->host.c_str(), conn->port, conn->server.fd);
+    else if (conn->server.fd >= 0)
+    {
+        shutdown(conn->server.fd, SHUT_RDWR);
+        close(conn->server.fd);
+    }
+    if (conn->client.fd >= 0)
+    {
+        shutdown(conn->client.fd, SHUT_RDWR);
+        close(conn->client.fd);
+    }
+
+    /* whoever waits for a response this connection was fetching gets nothing more */
+    for (relay_exchange &exchange : conn->exchanges)
+        if (exchange.fetch)
+        {
+            if (!exchange.fetch->pipelined)
+            {
+                ResponseCache::getInstance()->abandon(exchange.fetch.get());
+                this->settle_followers(exchange.fetch.get());
+            }
+            exchange.fetch->fetcher = nullptr;
+            exchange.fetch->failed = !exchange.fetch->complete;
+            this->feed_followers(exchange.fetch.get());
+        }
+    if (conn->fetch)
+    {
+        vector<relay_conn*> &followers = conn->fetch->followers;
+        followers.erase(std::remove(followers.begin(), followers.end(), conn), followers.end());
+    }
+
+    /* and nobody is left for the responses fetched ahead for this one */
+    vector<relay_conn*> fetchers;
+    if (conn->fetch && conn->fetch->fetcher != nullptr)
+        fetchers.push_back(conn->fetch->fetcher);
+    for (const shared_ptr<cache_fetch> &fetch : conn->queued)
+        if (fetch->fetcher != nullptr)
+            fetchers.push_back(fetch->fetcher);
+    for (relay_conn *fetcher : fetchers)
+    {
+        if (this->ring != nullptr)
+            this->uring_close(fetcher);
+        else
+            this->close_conn(fetcher);
+    }
+
+    close_splice_pipes(conn);
+
+    this->conns.erase(conn);
+    conn->client.conn = conn->server.conn = nullptr;
+    this->closed.push_back(conn);
+}
+
+void Relay::free_closed()
+{
+    for (relay_conn *conn : this->closed)
+        free_conn(conn);
+    this->closed.clear();
+}
+
+void Relay::free_conn(relay_conn *conn)
+{
+    if (!conn->tunnel)
+        http_stream_free(&conn->stream);
+    BufferPool::getInstance()->put(BUFFER_FORWARD, conn->up.buffer);
+    BufferPool::getInstance()->put(BUFFER_READ, conn->down.buffer);
+    delete(conn->msg);
+    delete(conn);
+}
+
+void Relay::sweep_idle()
+{
+    time_t now = time(nullptr);
+
+    vector<relay_conn*> idle;
+    vector<shared_ptr<cache_fetch>> late;
+    uint64_t waited = latency_now() - CACHE_COLLAPSE_WAIT_MS * 1000ULL;
+    for (relay_conn *conn : this->conns)
+    {
+        time_t timeout = conn->tunnel ? RELAY_TUNNEL_TIMEOUT : conn->idle ? RELAY_REQUEST_TIMEOUT : RELAY_IDLE_TIMEOUT;
+        if (now - conn->last_active > timeout)
+            idle.push_back(conn);
+        else if (conn->fetch && !conn->fetch->pipelined &&
+                 (conn->opened < waited ||
+                  !ResponseCache::getInstance()->shares(conn->fetch.get(), conn->stream.head + conn->stream.parser.line_len, true)))
+            late.push_back(conn->fetch);
+    }
+
+    /* followers of a head that is late fetch on their own, and so do those of a leader that failed in its worker */
+    for (const shared_ptr<cache_fetch> &fetch : late)
+    {
+        ResponseCache::getInstance()->give_up(fetch.get());
+        this->settle_followers(fetch.get());
+    }
+
+    for (relay_conn *conn : idle)
+    {
+        /* closing a client closes the connections fetching ahead for it too */
+        if (this->conns.count(conn) == 0)
+            continue;
+        if (this->ring != nullptr)
+            this->uring_close(conn);
+        else
+            this->close_conn(conn);
+    }
+    this->free_closed();
+}
+
+/* sends a follower what has arrived of its response, then lets the workers read its next request */
+void Relay::feed(relay_conn *conn)
+{
+    cache_fetch *fetch = conn->fetch.get();
+    if (fetch->failed)
+    {
+        if (this->ring != nullptr)
+            this->uring_close(conn);
+        else
+            this->close_conn(conn);
+        return;
+    }
+
+    conn->last_active = time(nullptr);
+    if (this->ring != nullptr)
+    {
+        if (conn->uring_ops & (1 << OP_SEND_CLIENT))
+            return;
+        this->drop_sent(conn);
+        if (conn->down.off < fetch->data.size())
+        {
+            this->uring_submit(conn, OP_SEND_CLIENT);
+            return;
+        }
+    }
+    else
+    {
+        while (conn->down.off < fetch->data.size())
+        {
+            ssize_t bytes_sent = write(conn->client.fd, fetch->data.data() + conn->down.off,
+                                       fetch->data.size() - conn->down.off);
+            if (bytes_sent < 0 && !would_block())
+            {
+                this->close_conn(conn);
+                return;
+            }
+            if (bytes_sent < 0)
+                break;
+            conn->down.off += bytes_sent;
+        }
+        this->drop_sent(conn);
+
+        uint32_t events = conn->down.off < fetch->data.size() ? (uint32_t) EPOLLOUT : 0;
+        if (events != conn->client.events)
+        {
+            struct epoll_event event;
+            event.events = conn->client.events = events;
+            event.data.ptr = &conn->client;
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, conn->client.fd, &event);
+        }
+        if (events != 0)
+            return;
+    }
+
+    if (!fetch->complete)
+        return;
+    if (!fetch->pipelined)
+    {
+        /* the connection that fetched a pipelined response recorded it */
+        conn->msg->trace.last_byte = latency_now();
+        Management::getInstance()->record_latency(conn->host.c_str(), &conn->msg->trace);
+    }
+    if (!fetch->keep_alive)
+    {
+        if (this->ring != nullptr)
+            this->uring_close(conn);
+        else
+            this->close_conn(conn);
+    }
+    else if (!conn->queued.empty())
+        this->next_response(conn);
+    else
+        this->hand_back(conn);
+}
+
+/* moves a client on to the response of its next pipelined request */
+void Relay::next_response(relay_conn *conn)
+{
+    if (conn->fetch)
+    {
+        vector<relay_conn*> &followers = conn->fetch->followers;
+        followers.erase(std::remove(followers.begin(), followers.end(), conn), followers.end());
+    }
+    conn->fetch = conn->queued.front();
+    conn->queued.pop_front();
+    conn->fetch->followers.push_back(conn);
+    conn->down.off = 0;
+    this->feed(conn);
+}
+
+/* what the only follower of a pipelined response sent makes room for its fetcher to read on */
+void Relay::drop_sent(relay_conn *conn)
+{
+    cache_fetch *fetch = conn->fetch.get();
+    relay_conn *fetcher = fetch->fetcher;
+    if (!fetch->pipelined || fetcher == nullptr || conn->down.off == 0)
+        return;
+    fetch->data.erase(0, conn->down.off);
+    conn->down.off = 0;
+    if (ahead_full(fetcher))
+        return;
+
+    if (this->ring == nullptr)
+    {
+        this->update_events(&fetcher->server);
+        return;
+    }
+    if (fetcher->closing || (fetcher->uring_ops & (1 << OP_RECV_SERVER)))
+        return;
+    for (auto &entry : this->starved)
+        if (entry.first == fetcher)
+            return;
+    this->uring_submit(fetcher, OP_RECV_SERVER);
+}
+
+void Relay::feed_followers(cache_fetch *fetch)
+{
+    vector<relay_conn*> followers = fetch->followers;
+    for (relay_conn *conn : followers)
+        this->feed(conn);
+}
+
+/* once the leader's head is in, followers whose request the response does not answer fetch on their own */
+void Relay::settle_followers(cache_fetch *fetch)
+{
+    vector<relay_conn*> followers = fetch->followers;
+    for (relay_conn *conn : followers)
+        if (!ResponseCache::getInstance()->shares(fetch, conn->stream.head + conn->stream.parser.line_len, false))
+            this->unfollow(conn);
+}
+
+/* sends a follower back to the workers with its request head, nothing of the response was sent to it */
+void Relay::unfollow(relay_conn *conn)
+{
+    vector<relay_conn*> &followers = conn->fetch->followers;
+    followers.erase(std::remove(followers.begin(), followers.end(), conn), followers.end());
+    conn->held.assign(conn->stream.head, conn->stream.head_len);
+    conn->msg->fetch_alone = true;
+    this->to_workers(conn);
+}
+
+/*
+ * Once its upstream has answered, a client moves on to the responses fetched
+ * for its pipelined requests, then goes back to the workers to route the
+ * request it held back, if any.
+ */
+void Relay::reroute(relay_conn *conn)
+{
+    if (this->ring == nullptr)
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->server.fd, nullptr);
+    if (reusable(conn))
+        ConnPool::getInstance()->release(conn->host.c_str(), conn->port, conn->server.fd);
+    else
+    {
+        shutdown(conn->server.fd, SHUT_RDWR);
+        close(conn->server.fd);
+    }
+    conn->server.fd = -1;
+    close_splice_pipes(conn);
+
+    /* the client was told the connection ends with the last response */
+    if (!conn->response.keep_alive)
+    {
+        this->close_conn(conn);
+        return;
+    }
+
+    conn->rerouting = false;
+    if (!conn->queued.empty())
+    {
+        conn->closing = false;
+        if (this->ring == nullptr)
+        {
+            struct epoll_event event;
+            event.events = conn->client.events = 0;
+            event.data.ptr = &conn->client;
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, conn->client.fd, &event);
+        }
+        this->next_response(conn);
+        return;
+    }
+    this->hand_back(conn);
+}
+
+/* a client whose response has been sent waits for its next request, which the workers route */
+void Relay::hand_back(relay_conn *conn)
+{
+    if (this->ring == nullptr)
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->client.fd, nullptr);
+    if (conn->fetch)
+    {
+        vector<relay_conn*> &followers = conn->fetch->followers;
+        followers.erase(std::remove(followers.begin(), followers.end(), conn), followers.end());
+    }
+
+    /* the held request, or the start of a head read behind pipelined ones */
+    LogMsg *msg = conn->msg;
+    conn->msg = nullptr;
+    if (conn->held.empty() && !conn->stream.head_done)
+        conn->held.assign(conn->stream.head, conn->stream.head_len);
+    msg->pending.swap(conn->held);
+    this->conns.erase(conn);
+    conn->client.conn = conn->server.conn = nullptr;
+    this->closed.push_back(conn);
+
+    msg->trace = latency_trace();
+    msg->trace.accept = latency_now();
+    relay_conn *next = idle_conn(msg);
+    next->loop = this;
+    this->await_request(next);
+}
+
+/* a worker is only taken once the head is complete, until then the client is one of the loop's connections */
+void Relay::await_request(relay_conn *conn)
+{
+    if (this->buffer_head(conn, nullptr, 0))
+        return;
+
+    conn->last_active = time(nullptr);
+    this->conns.insert(conn);
+    if (this->ring != nullptr)
+    {
+        this->uring_submit(conn, OP_RECV_CLIENT);
+        return;
+    }
+
+    set_nonblocking(conn->client.fd);
+    struct epoll_event event;
+    event.events = conn->client.events = EPOLLIN;
+    event.data.ptr = &conn->client;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, conn->client.fd, &event);
+}
+
+void Relay::read_head(relay_conn *conn)
+{
+    while (true)
+    {
+        ssize_t bytes_read = read(conn->client.fd, this->read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
+        if (bytes_read < 0 && would_block())
+            return;
+        if (bytes_read <= 0)
+        {
+            this->close_conn(conn);
+            return;
+        }
+        if (this->buffer_head(conn, this->read_buffer, (size_t)bytes_read))
+            return;
+    }
+}
+
+/* true once the client went to the workers with a whole head, or with one they answer 400 */
+bool Relay::buffer_head(relay_conn *conn, const char *data, size_t len)
+{
+    if (len > 0)
+        conn->held.append(data, len);
+    if (conn->stream.parser.parse(conn->held.data(), conn->held.size()) == PARSE_INCOMPLETE)
+        return false;
+    this->to_workers(conn);
+    return true;
+}
+
+void Relay::to_workers(relay_conn *conn)
+{
+    if (this->conns.erase(conn) > 0 && this->ring == nullptr)
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->client.fd, nullptr);
+    if (this->ring == nullptr)
+    {
+        int flags = fcntl(conn->client.fd, F_GETFL, 0);
+        if (flags >= 0 && (flags & O_NONBLOCK))
+            fcntl(conn->client.fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    LogMsg *msg = conn->msg;
+    conn->msg = nullptr;
+    msg->pending.swap(conn->held);
+    conn->client.conn = conn->server.conn = nullptr;
+    this->closed.push_back(conn);
+
+    vector<LogMsg*> expired;
+    if (!WQ::getInstance(msg->queue)->push(msg, expired))
+        http_refuse_connection(msg);
+    for (LogMsg *old : expired)
+        http_refuse_connection(old);
+}
+
+void Relay::event_loop(void *input)
+{
+    Relay *relay = (Relay*)input;
+    struct epoll_event events[RELAY_MAX_EVENTS];
+    time_t last_sweep = time(nullptr);
+
+    if (relay->cpu >= 0)
+        affinity_pin(relay->cpu);
+    if (backend == RELAY_URING)
+    {
+        relay->uring_loop();
+        return;
+    }
+
+    while (true)
+    {
+        int n = epoll_wait(relay->epoll_fd, events, RELAY_MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("Relay epoll_wait failed");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            relay_end *end = (relay_end*)events[i].data.ptr;
+            if (end == nullptr)
+            {
+                relay->accept_incoming();
+                continue;
+            }
+
+            /* the connection was closed by an earlier event of this batch */
+            if (end->conn == nullptr)
+                continue;
+            relay->handle_event(end, events[i].events);
+        }
+        relay->free_closed();
+
+        time_t now = time(nullptr);
+        if (now != last_sweep)
+        {
+            relay->sweep_idle();
+            ConnPool::getInstance()->expire();
+            last_sweep = now;
+        }
+    }
+}
+
+/*
+ * The io_uring backend keeps at most one operation per direction and end in
+ * flight. Receives pick a provided buffer when data arrives, requests are
+ * parsed out of it and responses are sent straight from it, and a direction
+ * is only received again once its bytes have been sent on.
+ */
+void Relay::uring_loop()
+{
+    this->ring = new Uring();
+    if (!this->ring->init(RELAY_URING_ENTRIES) ||
+        !this->ring->init_buffers(RELAY_URING_BUFFERS, RELAY_SPLICE_SIZE + 1))
+    {
+        perror("Failed to set up relay io_uring");
+        exit(errno);
+    }
+
+    this->uring_watch_wake();
+    time_t last_sweep = time(nullptr);
+    while (true)
+    {
+        if (this->ring->submit(1, 1000) < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+            perror("Relay io_uring_enter failed");
+
+        io_uring_cqe *cqe;
+        while ((cqe = this->ring->peek()) != nullptr)
+        {
+            io_uring_cqe completion = *cqe;
+            this->ring->advance();
+            this->uring_complete(&completion);
+        }
+        this->free_closed();
+
+        /* receives that ran out of buffers are retried once some came back */
+        if (this->recycled && !this->starved.empty())
+        {
+            vector<pair<relay_conn*, int>> retry;
+            retry.swap(this->starved);
+            for (auto &entry : retry)
+                this->uring_submit(entry.first, entry.second);
+        }
+        this->recycled = false;
+
+        time_t now = time(nullptr);
+        if (now != last_sweep)
+        {
+            this->sweep_idle();
+            ConnPool::getInstance()->expire();
+            last_sweep = now;
+        }
+    }
+}
+
+/* one multishot poll reports every wake up from dispatch */
+void Relay::uring_watch_wake()
+{
+    io_uring_sqe *sqe = this->ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = this->event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = OP_WAKE;
+}
+
+/* the sockets stay blocking, io_uring polls them itself */
+void Relay::uring_add(relay_conn *conn)
+{
+    conn->last_active = time(nullptr);
+    this->conns.insert(conn);
+
+    /* flush the requests the worker left behind */
+    if (conn->up.off < conn->up.len)
+        this->uring_submit(conn, OP_SEND_SERVER);
+    else if (!client_paused(conn))
+        this->uring_submit(conn, OP_RECV_CLIENT);
+    this->uring_submit(conn, OP_RECV_SERVER);
+}
+
+void Relay::uring_submit(relay_conn *conn, int op)
+{
+    io_uring_sqe *sqe = this->ring->get_sqe();
+    switch (op)
+    {
+        case OP_RECV_CLIENT:
+        case OP_RECV_SERVER:
+            /* most receives follow a send of our own, so waiting for data beats trying first */
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = op == OP_RECV_CLIENT ? conn->client.fd : conn->server.fd;
+            sqe->len = op == OP_RECV_CLIENT && !conn->tunnel ? LIBHTTP_REQUEST_MAX_SIZE : this->ring->buffer_size() - 1;
+            sqe->ioprio = IORING_RECVSEND_POLL_FIRST;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUFFER_GROUP;
+            break;
+        case OP_SEND_SERVER:
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->server.fd;
+            sqe->addr = (uint64_t)(uintptr_t)((conn->tunnel ? this->ring->buffer(conn->up_buffer) : conn->up.buffer) +
+                                              conn->up.off);
+            sqe->len = (uint32_t)(conn->up.len - conn->up.off);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            break;
+        case OP_SEND_CLIENT:
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->client.fd;
+            if (conn->fetch)
+            {
+                sqe->addr = (uint64_t)(uintptr_t)(conn->fetch->data.data() + conn->down.off);
+                sqe->len = (uint32_t)(conn->fetch->data.size() - conn->down.off);
+            }
+            else
+            {
+                sqe->addr = (uint64_t)(uintptr_t)(this->ring->buffer(conn->down_buffer) + conn->down.off);
+                sqe->len = (uint32_t)(conn->down.len - conn->down.off);
+            }
+            sqe->msg_flags = MSG_NOSIGNAL;
+            break;
+        case OP_CANCEL:
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t) conn | OP_RECV_SERVER;
+            break;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t) conn | (uint64_t) op;
+    conn->uring_ops |= 1 << op;
+}
+
+void Relay::uring_recycle(uint16_t buffer)
+{
+    this->ring->recycle(buffer);
+    this->recycled = true;
+}
+
+void Relay::uring_complete(const io_uring_cqe *cqe)
+{
+    if (cqe->user_data == URING_RECYCLE)
+    {
+        errno = -cqe->res;
+        perror("Failed to recycle relay buffer");
+        return;
+    }
+
+    int op = (int)(cqe->user_data & RELAY_OP_MASK);
+    if (op == OP_WAKE)
+    {
+        this->accept_incoming();
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            this->uring_watch_wake();
+        return;
+    }
+
+    relay_conn *conn = (relay_conn*)(uintptr_t)(cqe->user_data & ~(uint64_t) RELAY_OP_MASK);
+    int res = cqe->res;
+    bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    uint16_t buffer = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    conn->uring_ops &= ~(1 << op);
+
+    if (conn->closing)
+    {
+        if (has_buffer)
+            this->uring_recycle(buffer);
+        /* bytes the server sent after the last response make it unfit for the pool */
+        if (op == OP_RECV_SERVER && res > 0)
+            conn->down.eof = true;
+        if (conn->uring_ops == 0)
+            this->uring_release(conn);
+        return;
+    }
+    conn->last_active = time(nullptr);
+
+    if ((op == OP_RECV_CLIENT || op == OP_RECV_SERVER) && res == -ENOBUFS)
+    {
+        this->starved.push_back(make_pair(conn, op));
+        return;
+    }
+    if (conn->tunnel && res > 0 && (op == OP_RECV_CLIENT || op == OP_RECV_SERVER))
+    {
+        this->uring_tunnel(conn, op, buffer, (size_t) res);
+        return;
+    }
+    if (conn->tunnel && res == 0 && (op == OP_RECV_CLIENT || op == OP_RECV_SERVER))
+    {
+        /* pass the half close on, the tunnel ends once both sides are done */
+        relay_pipe *pipe = op == OP_RECV_CLIENT ? &conn->up : &conn->down;
+        pipe->eof = true;
+        shutdown(pipe->dst_fd, SHUT_WR);
+        if (conn->up.eof && conn->down.eof)
+            this->uring_close(conn);
+        return;
+    }
+    if (op == OP_RECV_SERVER && res == 0)
+    {
+        conn->down.eof = true;
+        bool waiting = !conn->held.empty() || !conn->queued.empty();
+        if (waiting && conn->response.finish_eof())
+            finish_response(conn);
+        if (waiting && answered(conn))
+        {
+            this->uring_reroute(conn);
+            return;
+        }
+    }
+    if (res <= 0 && op != OP_CANCEL)
+    {
+        if (has_buffer)
+            this->uring_recycle(buffer);
+        this->uring_close(conn);
+        return;
+    }
+
+    switch (op)
+    {
+        case OP_RECV_CLIENT:
+        {
+            if (conn->idle)
+            {
+                bool taken = this->buffer_head(conn, this->ring->buffer(buffer), (size_t) res);
+                this->uring_recycle(buffer);
+                if (!taken)
+                    this->uring_submit(conn, OP_RECV_CLIENT);
+                break;
+            }
+            bool ok = forward_requests(conn, this->ring->buffer(buffer), (size_t) res);
+            this->uring_recycle(buffer);
+            if (!ok)
+            {
+                http_send_response(conn->client.fd, 400);
+                this->uring_close(conn);
+                return;
+            }
+            if (conn->up.len > 0)
+                this->uring_submit(conn, OP_SEND_SERVER);
+            else if (!client_paused(conn))
+                this->uring_submit(conn, OP_RECV_CLIENT);
+            else if (answered(conn))
+                this->uring_reroute(conn);
+            break;
+        }
+        case OP_SEND_SERVER:
+            conn->up.off += (size_t) res;
+            if (conn->up.off < conn->up.len)
+                this->uring_submit(conn, OP_SEND_SERVER);
+            else
+            {
+                if (conn->tunnel)
+                    this->uring_recycle(conn->up_buffer);
+                conn->up.off = conn->up.len = 0;
+                if (!client_paused(conn))
+                    this->uring_submit(conn, OP_RECV_CLIENT);
+                else if (!conn->prefetch && answered(conn))
+                    this->uring_reroute(conn);
+            }
+            break;
+        case OP_RECV_SERVER:
+        {
+            char *data = this->ring->buffer(buffer);
+            data[res] = '\0';
+            conn->down_buffer = buffer;
+            conn->down.off = 0;
+            conn->down.len = (size_t) res;
+            track_response(conn, data, conn->down.len);
+            if (!conn->prefetch)
+            {
+                this->uring_submit(conn, OP_SEND_CLIENT);
+                break;
+            }
+
+            /* a prefetch passed it to its fetch, and reads on unless the client is far behind */
+            this->uring_recycle(buffer);
+            conn->down.len = 0;
+            if (conn->exchanges.empty())
+                this->uring_close(conn);
+            else if (!ahead_full(conn))
+                this->uring_submit(conn, OP_RECV_SERVER);
+            break;
+        }
+        case OP_SEND_CLIENT:
+            conn->down.off += (size_t) res;
+            if (conn->fetch)
+                this->feed(conn);
+            else if (conn->down.off < conn->down.len)
+                this->uring_submit(conn, OP_SEND_CLIENT);
+            else
+            {
+                this->uring_recycle(conn->down_buffer);
+                conn->down.off = conn->down.len = 0;
+                if ((!conn->held.empty() || !conn->queued.empty()) && answered(conn))
+                    this->uring_reroute(conn);
+                else
+                    this->uring_submit(conn, OP_RECV_SERVER);
+            }
+            break;
+    }
+}
+
+/* a tunnel sends what either side sent from the buffer it arrived in */
+void Relay::uring_tunnel(relay_conn *conn, int op, uint16_t buffer, size_t len)
+{
+    bool client = op == OP_RECV_CLIENT;
+    relay_pipe *pipe = client ? &conn->up : &conn->down;
+
+    if (client)
+        conn->up_buffer = buffer;
+    else
+        conn->down_buffer = buffer;
+    pipe->off = 0;
+    pipe->len = len;
+    pipe->relayed += len;
+    this->uring_submit(conn, client ? OP_SEND_SERVER : OP_SEND_CLIENT);
+}
+
+/* stops both ends, the connection is released once its last operation completed */
+void Relay::uring_close(relay_conn *conn)
+{
+    if (conn->closing)
+        return;
+    conn->closing = true;
+
+    /* a pooled upstream is only cancelled, shutting it down would end it for the next client too */
+    if (conn->client.fd >= 0)
+        shutdown(conn->client.fd, SHUT_RDWR);
+    if (!reusable(conn) && conn->server.fd >= 0)
+        shutdown(conn->server.fd, SHUT_RDWR);
+    else if (conn->uring_ops & (1 << OP_RECV_SERVER))
+        this->uring_submit(conn, OP_CANCEL);
+
+    if (conn->uring_ops == 0)
+        this->uring_release(conn);
+}
+
+/* like uring_close but the client is kept, to be handed back once the receive from the server is cancelled */
+void Relay::uring_reroute(relay_conn *conn)
+{
+    conn->closing = conn->rerouting = true;
+    if (conn->uring_ops & (1 << OP_RECV_SERVER))
+        this->uring_submit(conn, OP_CANCEL);
+    if (conn->uring_ops == 0)
+        this->uring_release(conn);
+}
+
+void Relay::uring_release(relay_conn *conn)
+{
+    if (conn->down.len > 0)
+        this->uring_recycle(conn->down_buffer);
+    if (conn->tunnel && conn->up.len > 0)
+        this->uring_recycle(conn->up_buffer);
+    conn->down.off = conn->down.len = 0;
+    if (conn->tunnel)
+        conn->up.off = conn->up.len = 0;
+
+    for (size_t i = 0; i < this->starved.size(); i++)
+        if (this->starved[i].first == conn)
+            this->starved.erase(this->starved.begin() + i--);
+
+    if (conn->rerouting)
+        this->reroute(conn);
+    else
+        this->close_conn(conn);
+}
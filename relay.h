@@ -0,0 +1,198 @@
+#ifndef HTTP_PROXY_SERVER_RELAY_H
+#define HTTP_PROXY_SERVER_RELAY_H
+
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <pthread.h>
+
+#include "cache.h"
+#include "disk_cache.h"
+#include "libhttp.h"
+#include "log.h"
+#include "uring.h"
+
+#define RELAY_IDLE_TIMEOUT  60
+#define RELAY_TUNNEL_TIMEOUT    300     /* tunnels carry long lived sessions with their own keep-alives */
+#define RELAY_REQUEST_TIMEOUT   30      /* for a client to send its next request head */
+#define RELAY_MAX_EVENTS    256
+#define RELAY_SPLICE_SIZE   65536
+#define RELAY_URING_ENTRIES 1024
+#define RELAY_URING_BUFFERS 256     /* receive buffers of RELAY_SPLICE_SIZE per loop */
+#define RELAY_PIPELINE_MAX  8       /* pipelined requests fetched ahead of the client's current one */
+#define RELAY_REORDER_MAX   (256 * 1024)    /* bytes of each such response read before it is the client's turn */
+
+enum RelayBackend
+{
+    RELAY_EPOLL,    /* readiness with epoll, then read, write and splice */
+    RELAY_URING     /* receives and sends completed by io_uring into provided buffers */
+};
+
+struct relay_conn;
+
+/* one direction of a proxied connection */
+struct relay_pipe
+{
+    int src_fd, dst_fd;
+    char *buffer;
+    size_t len, off;
+    bool eof;
+
+    int splice_fds[2];      /* bytes may also move src -> kernel pipe -> dst */
+    size_t spliced;         /* in the kernel pipe, not written yet */
+    uint64_t relayed;       /* read from src_fd, counted for tunnels */
+};
+
+/* registered with epoll, one per socket */
+struct relay_end
+{
+    relay_conn *conn;
+    int fd;
+    uint32_t events;
+};
+
+/* a request sent upstream whose response has not been relayed completely */
+struct relay_exchange
+{
+    bool head_request;
+    bool cacheable;
+    std::string cache_key;
+    std::string request_headers;
+    latency_trace trace;
+    std::shared_ptr<cache_fetch> fetch;     /* requests collapsed into this one are fed its response */
+};
+
+struct relay_conn
+{
+    Relay *loop;            /* the loop the connection was added to */
+    LogMsg *msg;
+    relay_pipe up, down;    /* up: client -> server, down: server -> client */
+    relay_end client, server;
+    time_t last_active;
+
+    std::string host;       /* pool key of the upstream connection */
+    uint16_t port;
+    http_stream stream;     /* requests from the client */
+    std::string held;       /* a request for another upstream and what followed it, read no further */
+    std::deque<std::shared_ptr<cache_fetch>> queued;    /* responses to pipelined requests, sent in turn */
+    bool prefetch;          /* no client: fetches the response of exchanges.front() for another connection */
+    std::deque<relay_exchange> exchanges;
+    HttpResponseFramer response{http_max_head_size};     /* responses from the server */
+
+    bool capturing;         /* the current response is copied for the cache */
+    std::string capture;
+    size_t capture_head_len;
+    std::shared_ptr<disk_write> disk;   /* and written to the disk cache */
+
+    bool tunnel;            /* CONNECT: bytes pass both ways untouched */
+    bool idle;              /* between requests: no upstream, the next head is read into held for the workers */
+    uint64_t opened;        /* when a tunnel was opened, or a follower started waiting */
+
+    /* a follower has no server: it is sent the response another connection fetches, down.off counts what was sent */
+    std::shared_ptr<cache_fetch> fetch;
+
+    /* io_uring backend: down.len bytes of provided buffer down_buffer are sent to the client */
+    uint8_t uring_ops;      /* bit per operation in flight, freed once none is */
+    bool closing;
+    bool rerouting;         /* the client is kept once closing is done, see Relay::reroute */
+    uint16_t down_buffer;
+    uint16_t up_buffer;     /* tunnels send client bytes from a provided buffer too */
+};
+
+class Relay
+{
+    int epoll_fd;
+    int event_fd;
+    char *read_buffer;
+
+    pthread_mutex_t lock{};
+    std::vector<relay_conn*> incoming;
+    std::set<relay_conn*> conns;
+    std::vector<relay_conn*> closed;    /* freed once the events at hand have been handled */
+
+    static std::vector<Relay*> loops;
+    static uint32_t next_loop;
+    static thread_local int home_loop;
+    int cpu;
+
+    Uring *ring = nullptr;
+    std::vector<std::pair<relay_conn*, int>> starved;  /* receives that found no free buffer */
+    bool recycled = false;
+
+    Relay();
+    ~Relay();
+
+    void add(relay_conn *conn);
+    void accept_incoming();
+    void handle_event(relay_end *end, uint32_t events);
+    void update_events(relay_end *end);
+    void sweep_idle();
+    void close_conn(relay_conn *conn);
+    void free_closed();
+    static void free_conn(relay_conn *conn);
+    void feed(relay_conn *conn);
+    void feed_followers(cache_fetch *fetch);
+    void settle_followers(cache_fetch *fetch);
+    void unfollow(relay_conn *conn);
+    void hand_back(relay_conn *conn);
+    void await_request(relay_conn *conn);
+    void read_head(relay_conn *conn);
+    bool buffer_head(relay_conn *conn, const char *data, size_t len);
+    void to_workers(relay_conn *conn);
+    void reroute(relay_conn *conn);
+    void next_response(relay_conn *conn);
+    void drop_sent(relay_conn *conn);
+
+    bool pump_up(relay_conn *conn);
+    bool pump_down(relay_conn *conn);
+    static bool pump_tunnel(relay_conn *conn, relay_pipe *pipe);
+    static relay_conn *new_conn(LogMsg *msg);
+    static relay_conn *idle_conn(LogMsg *msg);
+    static Relay *pick();
+    static Relay *fetch_loop(cache_fetch *fetch);
+    static void hand_off(relay_conn *conn, Relay *relay = nullptr);
+    static int flush(relay_pipe *pipe);
+    static void track_response(relay_conn *conn, const char *data, size_t len);
+    static void start_response(relay_conn *conn, relay_exchange *exchange);
+    static void finish_response(relay_conn *conn);
+    static int track_request(void *context, http_stream *stream, http_request *request);
+    static int queue_request(void *context, http_stream *stream, http_request *request);
+    static bool forward_requests(relay_conn *conn, const char *data, size_t len, http_head_handler on_head = track_request);
+    static bool answered(relay_conn *conn);
+    static int splice_through(relay_pipe *pipe, size_t max, size_t *moved);
+    static int splice_body(relay_conn *conn);
+    static bool reusable(relay_conn *conn);
+
+    void uring_loop();
+    void uring_watch_wake();
+    void uring_add(relay_conn *conn);
+    void uring_submit(relay_conn *conn, int op);
+    void uring_complete(const io_uring_cqe *cqe);
+    void uring_tunnel(relay_conn *conn, int op, uint16_t buffer, size_t len);
+    void uring_close(relay_conn *conn);
+    void uring_reroute(relay_conn *conn);
+    void uring_release(relay_conn *conn);
+    void uring_recycle(uint16_t buffer);
+
+public:
+    static RelayBackend backend;
+
+    /* cpus, when given, pins loop i to cpus[i] */
+    static void init(int num_loops, const std::vector<int> *cpus = nullptr);
+    /* connections dispatched from the calling thread go to this loop instead of round robin */
+    static void set_home(int loop);
+    static bool dispatch(LogMsg *msg, http_stream *stream, http_request *request, const char *rest, size_t rest_len,
+                         const std::shared_ptr<cache_fetch> &fetch = nullptr);
+    /* sends a client the response a loop is fetching for the same cacheable request, false if it cannot be shared */
+    static bool follow(LogMsg *msg, http_stream *stream, const std::shared_ptr<cache_fetch> &fetch);
+    /* keeps a client that has no complete request head buffered until it has one, then hands it to the workers */
+    static void wait(LogMsg *msg);
+    /* takes over a client whose CONNECT was answered, sent bytes of it were already passed to the server */
+    static void tunnel(LogMsg *msg, size_t sent);
+    static void event_loop(void *input);
+};
+
+#endif //HTTP_PROXY_SERVER_RELAY_H
@@ -0,0 +1,292 @@
+#include "scan.h"
+
+#include <cstring>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+static ScanKernel active_kernel = scan_best_kernel();
+
+/*
+ * Consumes the LF positions of one block (bit i is data[base + i]): every LF
+ * starts a line, and the empty one ends the head. Names are not measured here,
+ * lookups check for the colon after the name they want instead.
+ */
+static inline ScanResult add_lines(uint64_t lf, size_t base, const char *data, size_t len, http_head_index *index)
+{
+    while (lf != 0)
+    {
+        size_t start = base + __builtin_ctzll(lf) + 1;
+        lf &= lf - 1;
+        if (start >= len)
+            return SCAN_MORE;
+
+        char c = data[start];
+        if (c == '\n')
+        {
+            index->head_len = start + 1;
+            return SCAN_FOUND;
+        }
+        if (c == '\r')
+        {
+            if (start + 1 >= len)
+                return SCAN_MORE;
+            if (data[start + 1] == '\n')
+            {
+                index->head_len = start + 2;
+                return SCAN_FOUND;
+            }
+        }
+        if (index->num_lines == SCAN_MAX_LINES)
+            return SCAN_FULL;
+        index->lines[index->num_lines++] = (uint32_t)start;
+    }
+    return SCAN_MORE;
+}
+
+static inline uint64_t scalar_mask(const char *data, size_t len, char c)
+{
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++)
+        if (data[i] == c)
+            mask |= 1ull << i;
+    return mask;
+}
+
+static inline ScanResult add_tail(size_t base, const char *data, size_t len, http_head_index *index)
+{
+    size_t n = len - base < 64 ? len - base : 64;
+    return add_lines(scalar_mask(data + base, n, '\n'), base, data, len, index);
+}
+
+/* memchr finds the line breaks, each is handed over as a block of its own */
+static ScanResult scan_head_scalar(const char *data, size_t len, http_head_index *index)
+{
+    const char *end = data + len;
+    for (const char *lf = data; (lf = (const char*) memchr(lf, '\n', end - lf)) != nullptr; lf++)
+    {
+        ScanResult result = add_lines(1, lf - data, data, len, index);
+        if (result != SCAN_MORE)
+            return result;
+    }
+    return SCAN_MORE;
+}
+
+/* the line starting at start ends the head if it is empty, its end is returned then and 0 otherwise */
+static size_t empty_line_end(const char *data, size_t start)
+{
+    if (data[start] == '\n')
+        return start + 1;
+    return data[start] == '\r' && data[start + 1] == '\n' ? start + 2 : 0;
+}
+
+/* the index is full: the rest of the head is walked line by line for its end */
+static ScanResult walk_to_end(const char *data, size_t len, http_head_index *index)
+{
+    size_t line = index->lines[index->num_lines - 1];
+    while (true)
+    {
+        const char *lf = (const char*) memchr(data + line, '\n', len - line);
+        if (lf == nullptr)
+            return SCAN_MORE;
+        line = lf - data + 1;
+        if (line >= len || (data[line] == '\r' && line + 1 >= len))
+            return SCAN_MORE;
+        if (empty_line_end(data, line) != 0)
+        {
+            index->head_len = empty_line_end(data, line);
+            return SCAN_FULL;
+        }
+    }
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static ScanResult scan_head_sse2(const char *data, size_t len, http_head_index *index)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        uint64_t lfs = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i + j * 16));
+            lfs |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, lf)) << (j * 16);
+        }
+
+        ScanResult result = add_lines(lfs, i, data, len, index);
+        if (result != SCAN_MORE)
+            return result;
+    }
+
+    return i < len ? add_tail(i, data, len, index) : SCAN_MORE;
+}
+
+__attribute__((target("avx2")))
+static ScanResult scan_head_avx2(const char *data, size_t len, http_head_index *index)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+        uint64_t lfs = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, lf)) |
+                       (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, lf)) << 32;
+
+        ScanResult result = add_lines(lfs, i, data, len, index);
+        if (result != SCAN_MORE)
+            return result;
+    }
+
+    return i < len ? add_tail(i, data, len, index) : SCAN_MORE;
+}
+#endif
+
+ScanResult scan_head(const char *data, size_t len, http_head_index *index)
+{
+    index->data = data;
+    index->head_len = 0;
+    index->num_lines = 0;
+
+    ScanResult result;
+#ifdef SCAN_X86
+    if (active_kernel == SCAN_AVX2)
+        result = scan_head_avx2(data, len, index);
+    else if (active_kernel == SCAN_SSE2)
+        result = scan_head_sse2(data, len, index);
+    else
+#endif
+        result = scan_head_scalar(data, len, index);
+    return result == SCAN_FULL ? walk_to_end(data, len, index) : result;
+}
+
+/* the value of the header whose name of name_len bytes starts line */
+static const char *header_value(const http_head_index *index, const char *line, size_t name_len, size_t *value_len)
+{
+    const char *value = line + name_len + 1;
+    const char *end = index->data + index->head_len - 1;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    const char *value_end = value < end ? (const char*) memchr(value, '\n', (size_t)(end - value)) : nullptr;
+    if (value_end == nullptr)
+        value_end = end;
+    while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t'))
+        value_end--;
+
+    *value_len = value_end - value;
+    return value;
+}
+
+/* whether indexed line i starts with the header name, the first byte and the colon rule out most lines before the rest is compared */
+static inline bool name_matches(const http_head_index *index, size_t i, const char *name, size_t name_len)
+{
+    const char *line = index->data + index->lines[i];
+    return index->lines[i] + name_len < index->head_len && (line[0] | 0x20) == (name[0] | 0x20) &&
+           line[name_len] == ':' && strncasecmp(line, name, name_len) == 0;
+}
+
+/* walks the lines the index had no room for */
+static const char *find_past_index(const http_head_index *index, const char *name, size_t name_len, size_t *value_len)
+{
+    if (index->num_lines < SCAN_MAX_LINES || index->head_len == 0)
+        return nullptr;
+    const char *end = index->data + index->head_len;
+    const char *line = (const char*) memchr(index->data + index->lines[SCAN_MAX_LINES - 1], '\n',
+                                            end - index->data - index->lines[SCAN_MAX_LINES - 1]);
+    while (line != nullptr && ++line < end && empty_line_end(index->data, line - index->data) == 0)
+    {
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+            return header_value(index, line, name_len, value_len);
+        line = (const char*) memchr(line, '\n', end - line);
+    }
+    return nullptr;
+}
+
+const char *scan_find_header(const http_head_index *index, const char *name, size_t *value_len)
+{
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < index->num_lines; i++)
+    {
+        if (name_matches(index, i, name, name_len))
+            return header_value(index, index->data + index->lines[i], name_len, value_len);
+    }
+    return find_past_index(index, name, name_len, value_len);
+}
+
+size_t scan_find_headers(const http_head_index *index, const char *const *names, size_t count,
+                         const char **values, size_t *value_lens)
+{
+    size_t name_lens[SCAN_MAX_NAMES];
+    char firsts[SCAN_MAX_NAMES];
+    if (count > SCAN_MAX_NAMES)
+        count = SCAN_MAX_NAMES;
+    for (size_t n = 0; n < count; n++)
+    {
+        name_lens[n] = strlen(names[n]);
+        firsts[n] = (char)(names[n][0] | 0x20);
+        values[n] = nullptr;
+    }
+
+    /* each line's first byte is loaded once and compared with every name still missing */
+    const char *data = index->data;
+    uint32_t missing = (1u << count) - 1;
+    for (size_t i = 0; i < index->num_lines && missing != 0; i++)
+    {
+        size_t line = index->lines[i];
+        char first = (char)(data[line] | 0x20);
+        for (uint32_t rest = missing; rest != 0; rest &= rest - 1)
+        {
+            size_t n = __builtin_ctz(rest);
+            if (firsts[n] == first && name_matches(index, i, names[n], name_lens[n]))
+            {
+                values[n] = header_value(index, data + line, name_lens[n], &value_lens[n]);
+                missing &= ~(1u << n);
+                break;
+            }
+        }
+    }
+
+    for (uint32_t rest = missing; rest != 0; rest &= rest - 1)
+    {
+        size_t n = __builtin_ctz(rest);
+        values[n] = find_past_index(index, names[n], name_lens[n], &value_lens[n]);
+        if (values[n] != nullptr)
+            missing &= ~(1u << n);
+    }
+    return count - __builtin_popcount(missing);
+}
+
+void scan_set_kernel(ScanKernel kernel)
+{
+    active_kernel = kernel <= scan_best_kernel() ? kernel : scan_best_kernel();
+}
+
+ScanKernel scan_best_kernel()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SCAN_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SCAN_SSE2;
+#endif
+    return SCAN_SCALAR;
+}
+
+const char *scan_kernel_name(ScanKernel kernel)
+{
+    switch (kernel)
+    {
+        case SCAN_AVX2:
+            return "avx2";
+        case SCAN_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
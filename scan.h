@@ -0,0 +1,49 @@
+#ifndef HTTP_PROXY_SERVER_SCAN_H
+#define HTTP_PROXY_SERVER_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define SCAN_MAX_LINES      128
+#define SCAN_MAX_NAMES      8       /* headers one scan_find_headers call looks for */
+
+enum ScanKernel
+{
+    SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2
+};
+
+/* SCAN_FULL: the head is complete but only its first SCAN_MAX_LINES header lines are indexed */
+enum ScanResult
+{
+    SCAN_MORE, SCAN_FOUND, SCAN_FULL
+};
+
+/* header lines of a message head, found in one pass over the buffer */
+struct http_head_index
+{
+    const char *data;
+    size_t head_len;            /* through the empty line, 0 if the head is incomplete */
+    size_t num_lines;
+    uint32_t lines[SCAN_MAX_LINES];     /* offsets of the header lines after the start line */
+};
+
+/*
+ * Indexes the head at the start of data. Returns SCAN_MORE when data holds no
+ * complete head within len bytes. Past SCAN_MAX_LINES header lines the end of
+ * the head is found line by line, and SCAN_FULL is returned.
+ */
+ScanResult scan_head(const char *data, size_t len, http_head_index *index);
+
+/* value of the first header called name (case-insensitive), not NUL terminated; lines past the index are walked,
+   nothing is found before the head is complete */
+const char *scan_find_header(const http_head_index *index, const char *name, size_t *value_len);
+/* the first header of each name in one pass over the index, nullptr where there is none; returns how many were found */
+size_t scan_find_headers(const http_head_index *index, const char *const *names, size_t count,
+                         const char **values, size_t *value_lens);
+
+/* the kernels are picked from the CPU features at startup, benchmarks may pin one */
+void scan_set_kernel(ScanKernel kernel);
+ScanKernel scan_best_kernel();
+const char *scan_kernel_name(ScanKernel kernel);
+
+#endif //HTTP_PROXY_SERVER_SCAN_H
@@ -0,0 +1,170 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include "../cache.h"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+/* an HTTP date `offset` seconds from now */
+static string http_date(long offset)
+{
+    time_t when = time(nullptr) + offset;
+    struct tm tm;
+    char date[64];
+    gmtime_r(&when, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return date;
+}
+
+static string response(const string &headers, const string &body = "body")
+{
+    return "HTTP/1.1 200 OK\r\n" + headers + "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+/* seconds the response stays fresh for, -1 if it may not be stored */
+static long lifetime(const string &head)
+{
+    time_t expires, now = time(nullptr);
+    if (!ResponseCache::freshness(head.c_str(), head.find("\r\n\r\n") + 4, &expires))
+        return -1;
+    return (long)(expires - now);
+}
+
+/* within a second, the clock may tick between the response and the check */
+static bool about(long seconds, long expected)
+{
+    return seconds >= expected - 1 && seconds <= expected + 1;
+}
+
+static void test_freshness()
+{
+    CHECK(about(lifetime(response("Cache-Control: max-age=100\r\n")), 100));
+    CHECK(about(lifetime(response("Cache-Control: public, s-maxage=300, max-age=10\r\n")), 300));
+
+    /* the time a response spent in other caches, or since its Date, is used up already */
+    CHECK(about(lifetime(response("Cache-Control: max-age=100\r\nAge: 30\r\n")), 70));
+    CHECK(about(lifetime(response("Cache-Control: max-age=100\r\nDate: " + http_date(-40) + "\r\nAge: 10\r\n")), 60));
+    CHECK(about(lifetime(response("Cache-Control: max-age=100\r\nDate: " + http_date(-10) + "\r\nAge: 40\r\n")), 60));
+    CHECK(lifetime(response("Cache-Control: max-age=100\r\nAge: 150\r\n")) == -1);
+    CHECK(about(lifetime(response("Cache-Control: max-age=100\r\nAge: -50\r\n")), 100));
+
+    /* Expires counts from the origin's Date, not from our clock */
+    CHECK(about(lifetime(response("Expires: " + http_date(50) + "\r\n")), 50));
+    CHECK(about(lifetime(response("Date: " + http_date(-10) + "\r\nExpires: " + http_date(40) + "\r\n")), 40));
+    CHECK(about(lifetime(response("Date: " + http_date(0) + "\r\nExpires: " + http_date(50) + "\r\nAge: 20\r\n")), 30));
+    CHECK(lifetime(response("Expires: " + http_date(-5) + "\r\n")) == -1);
+    CHECK(lifetime(response("Expires: 0\r\n")) == -1);
+
+    /* responses that must not be stored */
+    CHECK(lifetime(response("")) == -1);
+    CHECK(lifetime(response("Cache-Control: max-age=100, no-store\r\n")) == -1);
+    CHECK(lifetime(response("Cache-Control: private, max-age=100\r\n")) == -1);
+    CHECK(lifetime(response("Cache-Control: no-cache\r\nExpires: " + http_date(50) + "\r\n")) == -1);
+    CHECK(lifetime(response("Cache-Control: max-age=100\r\nSet-Cookie: a=1\r\n")) == -1);
+    CHECK(lifetime(response("Cache-Control: max-age=100\r\nVary: *\r\n")) == -1);
+    CHECK(lifetime("HTTP/1.1 404 Not Found\r\nCache-Control: max-age=100\r\n\r\n") == -1);
+}
+
+static void store(const string &key, const char *request_headers, string data)
+{
+    ResponseCache::getInstance()->store(key, request_headers, data, data.find("\r\n\r\n") + 4, true);
+}
+
+static bool cached(const string &key, const char *request_headers)
+{
+    return ResponseCache::getInstance()->lookup(key, request_headers) != nullptr;
+}
+
+/* a response is only served to requests with the header values it varies on */
+static void test_vary()
+{
+    const char *gzip = "Host: a\r\nAccept-Encoding: gzip\r\n\r\n";
+    const char *br = "Host: a\r\nAccept-Encoding: br\r\n\r\n";
+    const char *none = "Host: a\r\n\r\n";
+
+    store("a:80/vary", gzip, response("Cache-Control: max-age=100\r\nVary: Accept-Encoding\r\n", "gzipped"));
+    CHECK(cached("a:80/vary", gzip));
+    CHECK(cached("a:80/vary", "Host: a\r\nAccept-Encoding:   gzip \r\n\r\n"));
+    CHECK(!cached("a:80/vary", br));
+    CHECK(!cached("a:80/vary", none));
+    CHECK(!cached("a:80/vary", "Host: a\r\nAccept-Encoding: gzip, br\r\n\r\n"));
+
+    /* variants are kept side by side, and each replaces only its own */
+    store("a:80/vary", br, response("Cache-Control: max-age=100\r\nVary: Accept-Encoding, Accept-Language\r\n", "br"));
+    store("a:80/vary", none, response("Cache-Control: max-age=100\r\nVary: Accept-Encoding\r\n", "plain"));
+    store("a:80/vary", none, response("Cache-Control: max-age=100\r\nVary: Accept-Encoding\r\n", "plain again"));
+    shared_ptr<const cache_object> object = ResponseCache::getInstance()->lookup("a:80/vary", gzip);
+    CHECK(object && object->response.substr(object->head_len) == "gzipped");
+    object = ResponseCache::getInstance()->lookup("a:80/vary", br);
+    CHECK(object && object->response.substr(object->head_len) == "br");
+    CHECK(!cached("a:80/vary", "Host: a\r\nAccept-Encoding: br\r\nAccept-Language: de\r\n\r\n"));
+    object = ResponseCache::getInstance()->lookup("a:80/vary", none);
+    CHECK(object && object->response.substr(object->head_len) == "plain again");
+
+    /* a client asking for a fresh copy is not served from the cache */
+    CHECK(!cached("a:80/vary", "Host: a\r\nAccept-Encoding: gzip\r\nCache-Control: no-cache\r\n\r\n"));
+    CHECK(!cached("a:80/vary", "Host: a\r\nAccept-Encoding: gzip\r\nCache-Control: max-age=0\r\n\r\n"));
+    CHECK(!cached("a:80/vary", "Host: a\r\nAccept-Encoding: gzip\r\nPragma: no-cache\r\n\r\n"));
+}
+
+/* at capacity the least recently used object goes first; run on an empty cache */
+static void test_lru_eviction()
+{
+    const char *headers = "Host: a\r\n\r\n";
+    string data = response("Cache-Control: max-age=100\r\n", string(1000, 'x'));
+    size_t object_size = data.size() + strlen("a:80/1") + sizeof(cache_object);
+    size_t budget = ResponseCache::memory_budget;
+    ResponseCache::memory_budget = 3 * object_size;
+
+    store("a:80/1", headers, data);
+    store("a:80/2", headers, data);
+    store("a:80/3", headers, data);
+    CHECK(cached("a:80/1", headers) && cached("a:80/2", headers) && cached("a:80/3", headers));
+
+    /* /1 was used last, so /2 is the one to make room for /4 */
+    CHECK(cached("a:80/1", headers));
+    store("a:80/4", headers, data);
+    CHECK(!cached("a:80/2", headers));
+    CHECK(cached("a:80/1", headers) && cached("a:80/3", headers) && cached("a:80/4", headers));
+
+    /* lookups count as use too: of those just checked, /1 came first */
+    store("a:80/5", headers, data);
+    CHECK(!cached("a:80/1", headers));
+    CHECK(cached("a:80/3", headers) && cached("a:80/4", headers) && cached("a:80/5", headers));
+
+    /* nor is anything larger than the whole budget stored */
+    store("a:80/6", headers, response("Cache-Control: max-age=100\r\n", string(4000, 'x')));
+    CHECK(!cached("a:80/6", headers) && cached("a:80/5", headers));
+
+    ResponseCache::memory_budget = budget;
+}
+
+int main()
+{
+    test_lru_eviction();
+    test_freshness();
+    test_vary();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All cache checks passed\n");
+    return EXIT_SUCCESS;
+}
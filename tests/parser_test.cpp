@@ -0,0 +1,386 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../http_parser.h"
+#include "../libhttp.h"
+
+#define TEST_MAX_HEAD   4096
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static bool slice_is(http_slice slice, const char *text)
+{
+    return slice.len == strlen(text) && memcmp(slice.data, text, slice.len) == 0;
+}
+
+static ParseStatus parse_whole(const string &head, size_t max_head = TEST_MAX_HEAD)
+{
+    HttpRequestParser parser(max_head);
+    return parser.parse(head.data(), head.size());
+}
+
+static const char *simple_request = "GET /index.html HTTP/1.1\r\n"
+                                    "Host: www.example.com\r\n"
+                                    "Accept:  text/html \t\r\n"
+                                    "Cookie: a=1; b=2\r\n"
+                                    "\r\n";
+
+/* the parser is resumed after every read, whatever byte a read ends at */
+static void test_split_heads()
+{
+    const char *heads[] = {
+        simple_request,
+        "\r\nGET http://www.example.com:8080/a?b=c HTTP/1.0\nHost: x\nEmpty:\n\n",
+        "CONNECT [::1]:443 HTTP/1.1\r\n\r\n",
+    };
+
+    for (const char *text : heads)
+    {
+        string head = text;
+        HttpRequestParser whole(TEST_MAX_HEAD);
+        CHECK(whole.parse(head.data(), head.size()) == PARSE_DONE);
+        CHECK(whole.head_len == head.size());
+
+        /* one split at every offset */
+        for (size_t split = 0; split < head.size(); split++)
+        {
+            HttpRequestParser parser(TEST_MAX_HEAD);
+            CHECK(parser.parse(head.data(), split) == PARSE_INCOMPLETE);
+            CHECK(parser.parse(head.data(), head.size()) == PARSE_DONE);
+            CHECK(parser.head_len == whole.head_len && parser.line_len == whole.line_len);
+            CHECK(parser.method.len == whole.method.len && parser.path.len == whole.path.len);
+            CHECK(parser.num_headers == whole.num_headers);
+            for (size_t i = 0; i < parser.num_headers && i < whole.num_headers; i++)
+                CHECK(parser.headers[i].name.data == whole.headers[i].name.data &&
+                      parser.headers[i].value.len == whole.headers[i].value.len);
+        }
+
+        /* one byte per read */
+        HttpRequestParser parser(TEST_MAX_HEAD);
+        for (size_t len = 1; len < head.size(); len++)
+            CHECK(parser.parse(head.data(), len) == PARSE_INCOMPLETE);
+        CHECK(parser.parse(head.data(), head.size()) == PARSE_DONE);
+        CHECK(parser.head_len == whole.head_len);
+    }
+
+    HttpRequestParser parser(TEST_MAX_HEAD);
+    CHECK(parser.parse(simple_request, strlen(simple_request)) == PARSE_DONE);
+    CHECK(slice_is(parser.method, "GET") && slice_is(parser.path, "/index.html") && slice_is(parser.version, "HTTP/1.1"));
+    CHECK(parser.num_headers == 3);
+    CHECK(parser.header("host") != nullptr && slice_is(*parser.header("host"), "www.example.com"));
+    CHECK(parser.header("Accept") != nullptr && slice_is(*parser.header("Accept"), "text/html"));
+    CHECK(parser.header("Referer") == nullptr);
+
+    /* bytes after the head are left for the body or the next request */
+    string pipelined = string(simple_request) + "GET /next HTTP/1.1\r\n";
+    parser.reset();
+    CHECK(parser.parse(pipelined.data(), pipelined.size()) == PARSE_DONE);
+    CHECK(parser.head_len == strlen(simple_request));
+}
+
+static void test_max_head_size()
+{
+    string head = simple_request;
+    CHECK(parse_whole(head, head.size()) == PARSE_DONE);
+    CHECK(parse_whole(head, head.size() - 1) == PARSE_TOO_LARGE);
+
+    /* the limit holds for a head that never ends, inside a long path or value too */
+    string path = "GET /" + string(TEST_MAX_HEAD, 'a');
+    CHECK(parse_whole(path) == PARSE_TOO_LARGE);
+    string value = "GET / HTTP/1.1\r\nCookie: " + string(TEST_MAX_HEAD, 'a');
+    CHECK(parse_whole(value) == PARSE_TOO_LARGE);
+    CHECK(parse_whole(value.substr(0, TEST_MAX_HEAD - 1)) == PARSE_INCOMPLETE);
+
+    string many = "GET / HTTP/1.1\r\n";
+    for (int i = 0; i < HTTP_PARSER_MAX_HEADERS; i++)
+        many += "X-" + to_string(i) + ": 1\r\n";
+    CHECK(parse_whole(many + "\r\n") == PARSE_DONE);
+    CHECK(parse_whole(many + "X-Over: 1\r\n\r\n") == PARSE_ERROR);
+}
+
+static void test_malformed_request_lines()
+{
+    const char *lines[] = {
+        " GET / HTTP/1.1\r\n\r\n",
+        "GET  / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1 extra\r\n\r\n",
+        "G(T / HTTP/1.1\r\n\r\n",
+        "GET /\r\n\r\n",
+        "GET / \r\n\r\n",
+        "GET / HTTP/2.0\r\n\r\n",
+        "GET / HTTP/1.10\r\n\r\n",
+        "GET / http/1.1\r\n\r\n",
+        "GET /\x01 HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\rX\r\n\r\n",
+    };
+    for (const char *line : lines)
+        CHECK(parse_whole(line) == PARSE_ERROR);
+
+    CHECK(parse_whole("GET / HTTP/1.0\r\n\r\n") == PARSE_DONE);
+    CHECK(parse_whole("\r\n\r\nGET / HTTP/1.1\r\n\r\n") == PARSE_DONE);
+}
+
+static void test_malformed_header_lines()
+{
+    const char *heads[] = {
+        "GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+        "GET / HTTP/1.1\r\nName : x\r\n\r\n",
+        "GET / HTTP/1.1\r\n: x\r\n\r\n",
+        "GET / HTTP/1.1\r\nNoColon\r\n\r\n",
+        "GET / HTTP/1.1\r\nName: x\rY\r\n\r\n",
+        "GET / HTTP/1.1\r\nName: x\r\n\rX",
+        "GET / HTTP/1.1\r\nNa\"me: x\r\n\r\n",
+    };
+    for (const char *head : heads)
+        CHECK(parse_whole(head) == PARSE_ERROR);
+
+    /* obsolete line folding, RFC 7230 section 3.2.4 */
+    CHECK(parse_whole("GET / HTTP/1.1\r\nX-Long: a\r\n b\r\n\r\n") == PARSE_ERROR);
+    CHECK(parse_whole("GET / HTTP/1.1\r\nX-Long: a\r\n\tb\r\n\r\n") == PARSE_ERROR);
+    CHECK(parse_whole("GET / HTTP/1.1\r\n Host: x\r\n\r\n") == PARSE_ERROR);
+}
+
+struct stream_result
+{
+    int heads, errors;
+    string paths, hosts;
+    size_t body_bytes;
+};
+
+/* feeds the data through a stream in reads of at most `chunk` bytes */
+static stream_result feed(const string &data, size_t chunk)
+{
+    stream_result result = {0, 0, "", "", 0};
+    struct http_stream stream;
+    http_stream_init(&stream);
+    struct http_request request;
+
+    for (size_t offset = 0; offset < data.size() && result.errors == 0;)
+    {
+        size_t end = offset + chunk < data.size() ? offset + chunk : data.size();
+        while (offset < end)
+        {
+            size_t consumed = 0;
+            int status = http_stream_feed(&stream, data.data() + offset, end - offset, &consumed, &request);
+            if (status == STREAM_ERROR)
+            {
+                result.errors++;
+                break;
+            }
+            offset += consumed;
+            if (status == STREAM_HEAD)
+            {
+                result.heads++;
+                result.paths += string(request.path.data, request.path.len) + " ";
+                result.hosts += string(request.host) + ":" + to_string(request.port) + " ";
+            }
+            else if (status == STREAM_BODY)
+                result.body_bytes += consumed;
+        }
+    }
+
+    http_stream_free(&stream);
+    return result;
+}
+
+/* the end of every body is found, whatever reads it arrives in */
+static void check_stream(const string &data, int heads, const char *paths, size_t body_bytes)
+{
+    for (size_t chunk = 1; chunk <= data.size(); chunk++)
+    {
+        stream_result result = feed(data, chunk);
+        CHECK(result.errors == 0);
+        CHECK(result.heads == heads);
+        CHECK(result.paths == paths);
+        CHECK(result.body_bytes == body_bytes);
+        if (failures > 0)
+        {
+            fprintf(stderr, "in reads of %zu bytes\n", chunk);
+            return;
+        }
+    }
+}
+
+static void test_stream_framing()
+{
+    string next = "GET /next HTTP/1.1\r\nHost: b.example\r\n\r\n";
+
+    check_stream("GET http://a.example/x HTTP/1.1\r\nHost: b.example\r\n\r\n" + next, 2, "/x /next ", 0);
+    CHECK(feed("GET http://a.example:8080/x HTTP/1.1\r\nHost: b.example\r\n\r\n", 64).hosts == "a.example:8080 ");
+    CHECK(feed("GET / HTTP/1.1\r\nHost: [::1]:81\r\n\r\n", 64).hosts == "::1:81 ");
+
+    check_stream("POST /cl HTTP/1.1\r\nHost: a.example\r\nContent-Length: 11\r\n\r\nhello world" + next,
+                 2, "/cl /next ", 11);
+
+    /* a chunked body with extensions and trailers, looking like a request head inside */
+    string chunked = "POST /te HTTP/1.1\r\nHost: a.example\r\nTransfer-Encoding: chunked\r\n\r\n"
+                     "5;name=value\r\nhello\r\n"
+                     "1A\r\nGET /fake HTTP/1.1\r\n\r\n\r\n\r\n\r\n"
+                     "0\r\nTrailer: x\r\n\r\n";
+    check_stream(chunked + next, 2, "/te /next ", chunked.size() - chunked.find("\r\n\r\n") - 4);
+
+    /* Transfer-Encoding overrides Content-Length, RFC 7230 section 3.3.3 */
+    string both = "POST /both HTTP/1.1\r\nHost: a.example\r\nContent-Length: 100\r\n"
+                  "Transfer-Encoding: gzip, chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n";
+    check_stream(both + next, 2, "/both /next ", strlen("3\r\nabc\r\n0\r\n\r\n"));
+
+    /* a body whose end cannot be found is refused */
+    CHECK(feed("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: gzip\r\n\r\n", 64).errors == 1);
+    CHECK(feed("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", 64).errors == 1);
+    CHECK(feed("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n\r\n", 64).errors == 1);
+    CHECK(feed("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nab\r\n", 64).errors == 1);
+
+    /* a length that is not plain digits, or two that disagree, is refused rather than guessed at */
+    const char *lengths[] = {"-1", "+5", "5x", "0x10", "5 5", "5,5", "99999999999999999999"};
+    for (const char *length : lengths)
+        CHECK(feed(string("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: ") + length + "\r\n\r\n0\r\n\r\n", 64).errors == 1);
+    CHECK(feed("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab", 64).errors == 1);
+    check_stream("POST /twice HTTP/1.1\r\nHost: a\r\nContent-Length: 2\r\ncontent-length: 2\r\n\r\nab" + next,
+                 2, "/twice /next ", 2);
+
+    /* requests without a target host, or too long for the stream's head buffer */
+    CHECK(feed("GET / HTTP/1.1\r\n\r\n", 64).errors == 1);
+    CHECK(feed("GET / HTTP/1.1\r\nHost: [::1\r\n\r\n", 64).errors == 1);
+    CHECK(feed("GET / HTTP/1.1\r\nHost: a\r\nCookie: " + string(http_max_head_size, 'a') + "\r\n\r\n", 512).errors == 1);
+}
+
+/*
+ * Feeds responses to a framer in two reads split at `split`, or a byte per
+ * read when split is 0, and writes down what it reports: H and the status
+ * of every head, k if the connection stays open after it, D and the body
+ * length without and with chunk framing when a response ends, E on errors,
+ * C when the close completes the body.
+ */
+static string frame(const string &data, size_t split, const bool *head_requests, bool eof)
+{
+    HttpResponseFramer framer(TEST_MAX_HEAD);
+    string events;
+    size_t responses = 0;
+
+    for (size_t offset = 0; offset < data.size();)
+    {
+        size_t end = split == 0 ? offset + 1 : offset < split ? split : data.size();
+        FrameStatus status = FRAME_MORE;
+
+        /* as in the relay, the framer is called once more after a head, a body may be empty */
+        while (offset < end || status == FRAME_HEAD)
+        {
+            size_t consumed;
+            status = framer.feed(data.data() + offset, end - offset, head_requests[responses], &consumed);
+            offset += consumed;
+            if (status == FRAME_HEAD)
+                events += "H" + to_string(framer.status_code) + (framer.keep_alive ? "k " : " ");
+            else if (status == FRAME_DONE)
+            {
+                events += "D" + to_string(framer.body_len) + "/" + to_string(framer.body_wire_len) + " ";
+                responses++;
+            }
+            else if (status == FRAME_ERROR)
+                events += "E ";
+            else if (consumed == 0 && offset < end)
+                return events + "stuck";
+        }
+    }
+    if (eof && framer.finish_eof())
+        events += "C" + to_string(framer.body_len);
+    return events;
+}
+
+/* the framer reports the same events whatever reads the responses arrive in */
+static void check_frames(const string &data, const char *events, const bool *head_requests = nullptr, bool eof = false)
+{
+    static const bool no_head_requests[8] = {false};
+    if (head_requests == nullptr)
+        head_requests = no_head_requests;
+
+    for (size_t split = 0; split < data.size(); split++)
+    {
+        string result = frame(data, split, head_requests, eof);
+        CHECK(result == events);
+        if (result != events)
+        {
+            fprintf(stderr, "split at %zu: got \"%s\", expected \"%s\"\n", split, result.c_str(), events);
+            return;
+        }
+    }
+}
+
+static void test_response_framing()
+{
+    string next = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nend";
+
+    check_frames("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello" + next, "H200k D5/5 H200k D3/3 ");
+    check_frames("HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", "H200 D0/0 ");
+    check_frames("HTTP/1.0 200 OK\nContent-Length: 2\n\nok", "H200 D2/2 ");
+    check_frames("HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 2\r\n\r\nok", "H200k D2/2 ");
+
+    /* chunk extensions and trailers, and chunk data that looks like a head */
+    string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n"
+                     "5;name=value\r\nhello\r\n"
+                     "17 ; x=\"y\"\r\nHTTP/1.1 200 OK\r\n\r\n\r\n\r\n\r\n"
+                     "0\r\nTrailer: x\r\nExpires: 0\r\n\r\n";
+    size_t wire = chunked.size() - chunked.find("\r\n\r\n") - 4;
+    check_frames(chunked + next, ("H200k D28/" + to_string(wire) + " H200k D3/3 ").c_str());
+    check_frames("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n0\n\n" + next, "H200k D0/3 H200k D3/3 ");
+
+    /* without a length the body runs until the server closes */
+    check_frames("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nuntil close\r\n\r\n", "H200 C15", nullptr, true);
+    check_frames("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip\r\nContent-Length: 4\r\n\r\nmore than 4", "H200 C11",
+                 nullptr, true);
+
+    /* responses to HEAD, 204 and 304 have no body, whatever their headers say */
+    const bool head_first[] = {true, false};
+    check_frames("HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n" + next, "H200k D0/0 H200k D3/3 ", head_first);
+    check_frames("HTTP/1.1 204 No Content\r\nTransfer-Encoding: chunked\r\n\r\n" + next, "H204k D0/0 H200k D3/3 ");
+    check_frames("HTTP/1.1 304 Not Modified\r\nContent-Length: 50\r\n\r\n" + next, "H304k D0/0 H200k D3/3 ");
+
+    /* interim responses come before the final one, which answers the same request */
+    check_frames("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 103 Early Hints\r\nLink: </a>\r\n\r\n" + next,
+                 "H100k H103k H200k D3/3 ");
+    check_frames("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 9\r\n\r\n", "H100k H200k D0/0 ",
+                 head_first);
+
+    /* a length that is not plain digits fails the connection rather than framing it wrongly */
+    const char *lengths[] = {"-1", "+5", "5x", "0x10", "abc", "5 5", "99999999999999999999"};
+    for (const char *length : lengths)
+        check_frames(string("HTTP/1.1 200 OK\r\nContent-Length: ") + length + "\r\n\r\nhello" + next, "E ");
+
+    /* as does anything that is not HTTP, or a broken chunk */
+    check_frames("SSH-2.0-OpenSSH\r\n\r\n", "E ");
+    check_frames("HTTP/1.1 abc\r\n\r\n", "E ");
+    check_frames("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n" + next, "H200k E ");
+    check_frames("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nabc\r\n" + next, "H200k E ");
+    check_frames("HTTP/1.1 200 OK\r\nCookie: " + string(TEST_MAX_HEAD, 'a') + "\r\n\r\n", "E ");
+}
+
+int main()
+{
+    test_split_heads();
+    test_max_head_size();
+    test_malformed_request_lines();
+    test_malformed_header_lines();
+    test_stream_framing();
+    test_response_framing();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All parser checks passed\n");
+    return EXIT_SUCCESS;
+}
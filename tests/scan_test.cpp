@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include <vector>
+
+#include "../scan.h"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+/* what every kernel has to agree with: the lines after each LF, up to the empty one */
+struct reference
+{
+    ScanResult result;
+    size_t head_len;
+    vector<uint32_t> lines;
+};
+
+static reference scan_reference(const string &data)
+{
+    reference ref = {SCAN_MORE, 0, {}};
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        if (data[i] != '\n')
+            continue;
+        size_t start = i + 1;
+        if (start >= data.size() || (data[start] == '\r' && start + 1 >= data.size()))
+            return ref;
+        if (data[start] == '\n' || (data[start] == '\r' && data[start + 1] == '\n'))
+        {
+            ref.result = ref.lines.size() > SCAN_MAX_LINES ? SCAN_FULL : SCAN_FOUND;
+            ref.head_len = start + (data[start] == '\r' ? 2 : 1);
+            if (ref.lines.size() > SCAN_MAX_LINES)
+                ref.lines.resize(SCAN_MAX_LINES);
+            return ref;
+        }
+        ref.lines.push_back((uint32_t)start);
+    }
+    return ref;
+}
+
+static const char *find_reference(const string &data, size_t head_len, const char *name, size_t *value_len)
+{
+    size_t name_len = strlen(name);
+    for (size_t line = data.find('\n') + 1; line < head_len; line = data.find('\n', line) + 1)
+    {
+        if (line + name_len < head_len && strncasecmp(data.data() + line, name, name_len) == 0 && data[line + name_len] == ':')
+        {
+            size_t value = line + name_len + 1, end = data.find('\n', value);
+            while (data[value] == ' ' || data[value] == '\t')
+                value++;
+            while (end > value && (data[end - 1] == '\r' || data[end - 1] == ' ' || data[end - 1] == '\t'))
+                end--;
+            *value_len = end - value;
+            return data.data() + value;
+        }
+    }
+    return nullptr;
+}
+
+static const char *names[] = {"Content-Length", "content-type", "CONNECTION", "Transfer-Encoding", "X-Last", "Missing"};
+#define NUM_NAMES (sizeof(names) / sizeof(names[0]))
+
+/* every kernel this CPU has indexes data like the reference and finds the same values */
+static void check_kernels(const string &data)
+{
+    reference ref = scan_reference(data);
+    for (int kernel = SCAN_SCALAR; kernel <= scan_best_kernel(); kernel++)
+    {
+        scan_set_kernel((ScanKernel)kernel);
+        http_head_index index;
+        ScanResult result = scan_head(data.data(), data.size(), &index);
+
+        CHECK(result == ref.result);
+        if (result != SCAN_MORE)
+        {
+            CHECK(index.head_len == ref.head_len);
+            CHECK(index.num_lines == ref.lines.size());
+            for (size_t i = 0; i < index.num_lines && i < ref.lines.size(); i++)
+                CHECK(index.lines[i] == ref.lines[i]);
+
+            const char *values[NUM_NAMES];
+            size_t value_lens[NUM_NAMES];
+            size_t found = scan_find_headers(&index, names, NUM_NAMES, values, value_lens), expected = 0;
+            for (size_t n = 0; n < NUM_NAMES; n++)
+            {
+                size_t ref_len = 0, value_len = 0;
+                const char *ref_value = find_reference(data, ref.head_len, names[n], &ref_len);
+                const char *value = scan_find_header(&index, names[n], &value_len);
+                CHECK(value == ref_value && (value == nullptr || value_len == ref_len));
+                CHECK(values[n] == ref_value && (ref_value == nullptr || value_lens[n] == ref_len));
+                expected += ref_value != nullptr;
+            }
+            CHECK(found == expected);
+        }
+        if (failures > 0)
+        {
+            fprintf(stderr, "with the %s kernel on %zu bytes:\n%s\n", scan_kernel_name((ScanKernel)kernel), data.size(),
+                    data.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+    scan_set_kernel(scan_best_kernel());
+}
+
+static uint32_t seed = 12345;
+
+static uint32_t next_random(uint32_t bound)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % bound;
+}
+
+/* a header line of exactly len bytes with its line break, names among the looked up ones and near misses */
+static string header_line(size_t len, bool crlf)
+{
+    static const char *line_names[] = {"Content-Length", "Content-Type", "Connection", "Transfer-Encoding", "X-Last",
+                                       "Content-Lengthy", "Set-Cookie", "Conn", "X"};
+    string line = string(line_names[next_random(sizeof(line_names) / sizeof(line_names[0]))]);
+    line += next_random(4) == 0 ? " : " : ": ";
+    string end = crlf ? "\r\n" : "\n";
+    while (line.size() + end.size() < len)
+        line += (char)('a' + next_random(26));
+    line.resize(len > end.size() ? len - end.size() : 0);
+    return line + end;
+}
+
+/* line breaks at and around every 64 byte block edge, CR and LF split across blocks */
+static void test_block_edges()
+{
+    for (size_t first = 14; first < 200; first++)
+    {
+        for (int crlf = 0; crlf < 2; crlf++)
+        {
+            string head = "HTTP/1.1 200 OK\r\n";
+            head.resize(first - 2, 'x');
+            head += "\r\n";
+            for (int i = 0; i < 3; i++)
+                head += header_line(40 + next_random(90), crlf != 0);
+            head += crlf ? "\r\n" : "\n";
+            check_kernels(head);
+            check_kernels(head + "body after the head, with a line\nbreak and a colon: in it\r\n\r\n");
+        }
+    }
+}
+
+/* heads of every shape, and every prefix of some, which has to be SCAN_MORE until the empty line is in */
+static void test_random_heads()
+{
+    for (int round = 0; round < 2000; round++)
+    {
+        bool crlf = next_random(3) != 0;
+        string head = "HTTP/1.1 200 OK";
+        head += crlf ? "\r\n" : "\n";
+        size_t lines = next_random(10) == 0 ? SCAN_MAX_LINES - 2 + next_random(8) : next_random(20);
+        for (size_t i = 0; i < lines; i++)
+            head += header_line(3 + next_random(next_random(4) == 0 ? 300 : 70), crlf);
+        head += crlf ? "\r\n" : "\n";
+        head.append(next_random(100), 'y');
+
+        check_kernels(head);
+        if (round % 50 == 0)
+            for (size_t len = 0; len < head.size(); len++)
+                check_kernels(head.substr(0, len));
+    }
+}
+
+/* past SCAN_MAX_LINES lines the head is still found, and so are the headers the index had no room for */
+static void test_full_index()
+{
+    string head = "HTTP/1.1 200 OK\r\n";
+    for (int i = 0; i < SCAN_MAX_LINES + 10; i++)
+        head += "Set-Cookie: n" + to_string(i) + "=v\r\n";
+    head += "X-Last: after the index\r\n\r\n";
+    check_kernels(head);
+
+    http_head_index index;
+    CHECK(scan_head(head.data(), head.size(), &index) == SCAN_FULL);
+    CHECK(index.head_len == head.size() && index.num_lines == SCAN_MAX_LINES);
+    size_t value_len;
+    const char *value = scan_find_header(&index, "x-last", &value_len);
+    CHECK(value != nullptr && string(value, value_len) == "after the index");
+}
+
+int main()
+{
+    test_block_edges();
+    test_random_heads();
+    test_full_index();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All scan checks passed for kernels up to %s\n", scan_kernel_name(scan_best_kernel()));
+    return EXIT_SUCCESS;
+}
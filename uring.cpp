@@ -0,0 +1,231 @@
+#include "uring.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int io_uring_setup(unsigned entries, io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring::~Uring()
+{
+    if (this->buf_base != nullptr)
+        free(this->buf_base);
+    if (this->sqes != nullptr)
+        munmap(this->sqes, this->sqes_size);
+    if (this->cq_ring != nullptr && this->cq_ring != this->sq_ring)
+        munmap(this->cq_ring, this->cq_ring_size);
+    if (this->sq_ring != nullptr)
+        munmap(this->sq_ring, this->sq_ring_size);
+    if (this->ring_fd >= 0)
+        close(this->ring_fd);
+}
+
+bool Uring::init(unsigned entries)
+{
+    /* completions are only needed when the owner waits for them, which saves interrupting it */
+    static const unsigned setups[] = {
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+        0
+    };
+
+    io_uring_params params;
+    for (unsigned flags : setups)
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = flags;
+        this->ring_fd = io_uring_setup(entries, &params);
+        if (this->ring_fd >= 0 || errno != EINVAL)
+            break;
+    }
+    if (this->ring_fd < 0)
+        return false;
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_CQE_SKIP))
+        return false;
+
+    this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        this->sq_ring_size = this->cq_ring_size = this->sq_ring_size > this->cq_ring_size ? this->sq_ring_size
+                                                                                           : this->cq_ring_size;
+
+    this->sq_ring = mmap(nullptr, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         this->ring_fd, IORING_OFF_SQ_RING);
+    if (this->sq_ring == MAP_FAILED)
+    {
+        this->sq_ring = nullptr;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        this->cq_ring = this->sq_ring;
+    else
+    {
+        this->cq_ring = mmap(nullptr, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             this->ring_fd, IORING_OFF_CQ_RING);
+        if (this->cq_ring == MAP_FAILED)
+        {
+            this->cq_ring = nullptr;
+            return false;
+        }
+    }
+
+    this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    this->sqes = (io_uring_sqe*) mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      this->ring_fd, IORING_OFF_SQES);
+    if (this->sqes == MAP_FAILED)
+    {
+        this->sqes = nullptr;
+        return false;
+    }
+
+    char *sq = (char*) this->sq_ring, *cq = (char*) this->cq_ring;
+    this->sq_head = (unsigned*)(sq + params.sq_off.head);
+    this->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    this->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    this->sq_entries = params.sq_entries;
+    this->sq_array = (unsigned*)(sq + params.sq_off.array);
+    this->cq_head = (unsigned*)(cq + params.cq_off.head);
+    this->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    this->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    this->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    /* entry i of the array always points at sqe i */
+    for (unsigned i = 0; i < this->sq_entries; i++)
+        this->sq_array[i] = i;
+    this->sqe_tail = *this->sq_tail;
+    return true;
+}
+
+bool Uring::init_buffers(unsigned count, unsigned size)
+{
+    this->buf_base = (char*) malloc((size_t)count * size);
+    if (this->buf_base == nullptr)
+        return false;
+    this->buf_size = size;
+
+    io_uring_sqe *sqe = this->get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int) count;
+    sqe->addr = (uint64_t)(uintptr_t) this->buf_base;
+    sqe->len = size;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    if (this->submit(1, -1) < 0)
+        return false;
+
+    io_uring_cqe *cqe = this->peek();
+    bool provided = cqe != nullptr && cqe->res >= 0;
+    if (cqe != nullptr)
+        this->advance();
+    return provided;
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+    if (this->sqe_tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) >= this->sq_entries)
+        this->submit(0, -1);
+
+    io_uring_sqe *sqe = &this->sqes[this->sqe_tail & this->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    this->sqe_tail++;
+    this->pending++;
+    return sqe;
+}
+
+int Uring::submit(unsigned wait, int timeout_ms)
+{
+    __atomic_store_n(this->sq_tail, this->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (wait > 0 && timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)(uintptr_t) &ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int submitted = io_uring_enter(this->ring_fd, this->pending, wait, flags,
+                                   flags & IORING_ENTER_EXT_ARG ? &arg : nullptr, sizeof(arg));
+    if (submitted > 0)
+        this->pending -= (unsigned)submitted < this->pending ? (unsigned)submitted : this->pending;
+    return submitted;
+}
+
+io_uring_cqe *Uring::peek()
+{
+    unsigned head = *this->cq_head;
+    if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &this->cqes[head & this->cq_mask];
+}
+
+void Uring::advance()
+{
+    __atomic_store_n(this->cq_head, *this->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *Uring::buffer(uint16_t id)
+{
+    return this->buf_base + (size_t)id * this->buf_size;
+}
+
+void Uring::recycle(uint16_t id)
+{
+    io_uring_sqe *sqe = this->get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = 1;
+    sqe->addr = (uint64_t)(uintptr_t) this->buffer(id);
+    sqe->len = this->buf_size;
+    sqe->off = id;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECYCLE;
+}
+
+unsigned Uring::buffer_size() const
+{
+    return this->buf_size;
+}
+
+bool Uring::supported()
+{
+    /* IORING_OP_SOCKET stands for 5.19, which brought multishot accept and receives that poll first */
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD,
+                              IORING_OP_ASYNC_CANCEL, IORING_OP_PROVIDE_BUFFERS, IORING_OP_SOCKET};
+
+    Uring ring;
+    if (!ring.init(8) || !ring.init_buffers(8, 64))
+        return false;
+
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    io_uring_probe *probe = (io_uring_probe*) calloc(1, probe_size);
+    if (probe == nullptr)
+        return false;
+    bool found = io_uring_register(ring.ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int op : ops)
+        found = found && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return found;
+}
@@ -0,0 +1,59 @@
+#ifndef HTTP_PROXY_SERVER_URING_H
+#define HTTP_PROXY_SERVER_URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+#define URING_BUFFER_GROUP  0
+#define URING_RECYCLE       UINT64_MAX  /* user_data of a buffer that could not be given back */
+
+/*
+ * io_uring on the raw system calls: a submission and completion ring pair and
+ * optionally a group of buffers provided to the kernel, which receives pick
+ * from when data arrives. A ring belongs to the thread that created it.
+ */
+class Uring
+{
+    int ring_fd = -1;
+    void *sq_ring = nullptr, *cq_ring = nullptr;
+    size_t sq_ring_size = 0, cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, cq_mask = 0, sq_entries = 0;
+    io_uring_cqe *cqes = nullptr;
+    unsigned sqe_tail = 0;      /* next free entry, published to the kernel on submit */
+    unsigned pending = 0;       /* entries not submitted yet */
+
+    char *buf_base = nullptr;
+    unsigned buf_size = 0;
+
+public:
+    Uring() = default;
+    Uring(const Uring&) = delete;
+    ~Uring();
+
+    bool init(unsigned entries);
+    /* count buffers of size bytes, before anything else is submitted */
+    bool init_buffers(unsigned count, unsigned size);
+
+    /* never null, submits what is queued when the ring is full */
+    io_uring_sqe *get_sqe();
+    /* submits the queued entries and waits up to timeout_ms for wait completions */
+    int submit(unsigned wait, int timeout_ms);
+    io_uring_cqe *peek();
+    void advance();
+
+    char *buffer(uint16_t id);
+    /* gives a buffer back with the next submission, which only completes if that fails */
+    void recycle(uint16_t id);
+    unsigned buffer_size() const;
+
+    /* whether this kernel has every feature the relay backend uses */
+    static bool supported();
+};
+
+#endif //HTTP_PROXY_SERVER_URING_H
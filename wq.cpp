@@ -2,50 +2,173 @@
 
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
-WQ* WQ::instance = nullptr;
+#include "latency.h"
+
+std::vector<WQ*> WQ::groups;
+size_t WQ::max_depth = WQ_MAX_DEPTH;
+uint64_t WQ::max_delay_ms = WQ_MAX_DELAY_MS;
+WQPolicy WQ::policy = WQ_FIFO;
 
 WQ::WQ()
 {
-    this->msg_queue = new std::queue<LogMsg*>();
     pthread_mutex_init(&this->lock, nullptr);
     pthread_cond_init(&this->cond, nullptr);
 }
 
 WQ::~WQ()
 {
-    delete this->msg_queue;
+    pthread_mutex_destroy(&this->lock);
+    pthread_cond_destroy(&this->cond);
+}
+
+void WQ::init(int num_groups)
+{
+    while ((int)groups.size() < num_groups)
+        groups.push_back(new WQ());
+}
+
+WQ* WQ::getInstance(int group)
+{
+    if (groups.empty())
+        init(1);
+    return groups[group];
+}
+
+bool WQ::parse_policy(const char *name)
+{
+    if (strcmp(name, "fifo") == 0)
+        policy = WQ_FIFO;
+    else if (strcmp(name, "lifo") == 0)
+        policy = WQ_LIFO;
+    else if (strcmp(name, "codel") == 0)
+        policy = WQ_CODEL;
+    else
+        return false;
+    return true;
 }
 
-WQ* WQ::getInstance()
+/* nanoseconds a connection may wait, 0 for no limit */
+uint64_t WQ::delay_limit() const
 {
-    if (instance == nullptr)
-        instance = new WQ();
-    return instance;
+    if (this->overloaded && policy == WQ_CODEL)
+        return (uint64_t)WQ_CODEL_TARGET_MS * 1000000;
+    return max_delay_ms * 1000000;
 }
 
-LogMsg *WQ::pop()
+LogMsg *WQ::pop(bool *shed)
 {
     pthread_mutex_lock(&this->lock);
 
-    while (this->msg_queue->empty())
+    while (this->msg_queue.empty())
     {
         pthread_cond_wait(&this->cond, &this->lock);
     }
 
-    LogMsg *pMsg = this->msg_queue->front();
-    this->msg_queue->pop();
+    uint64_t now = latency_now();
+    uint64_t limit = this->delay_limit();
+
+    /* expired connections are refused first, whatever order the rest is served in */
+    entry next;
+    *shed = limit > 0 && now - this->msg_queue.front().enqueued > limit;
+    if (*shed || !this->overloaded || policy != WQ_LIFO)
+    {
+        next = this->msg_queue.front();
+        this->msg_queue.pop_front();
+    }
+    else
+    {
+        next = this->msg_queue.back();
+        this->msg_queue.pop_back();
+    }
+
+    if (*shed)
+        this->shed_delay++;
+    else
+        this->served++;
+
+    /* CoDel: the smallest wait of the oldest connection in an interval tells whether a queue stands */
+    uint64_t standing = this->msg_queue.empty() ? 0 : now - this->msg_queue.front().enqueued;
+    if (standing < this->interval_min)
+        this->interval_min = standing;
+    if (now >= this->interval_end)
+    {
+        this->overloaded = this->interval_min > (uint64_t)WQ_CODEL_TARGET_MS * 1000000;
+        this->interval_min = UINT64_MAX;
+        this->interval_end = now + (uint64_t)WQ_CODEL_INTERVAL_MS * 1000000;
+    }
 
     pthread_mutex_unlock(&this->lock);
-    return pMsg;
+    return next.msg;
 }
 
-void WQ::push(LogMsg *msg)
+bool WQ::push(LogMsg *msg, std::vector<LogMsg*> &expired)
 {
     pthread_mutex_lock(&this->lock);
 
-    this->msg_queue->push(msg);
+    uint64_t now = latency_now();
+    uint64_t limit = this->delay_limit();
+    while (limit > 0 && !this->msg_queue.empty() && now - this->msg_queue.front().enqueued > limit)
+    {
+        expired.push_back(this->msg_queue.front().msg);
+        this->msg_queue.pop_front();
+        this->shed_delay++;
+    }
+
+    if (this->msg_queue.size() >= max_depth)
+    {
+        this->shed_full++;
+        pthread_mutex_unlock(&this->lock);
+        return false;
+    }
+
+    this->msg_queue.push_back({msg, now});
+    if (this->msg_queue.size() > this->high_water)
+        this->high_water = this->msg_queue.size();
 
     pthread_cond_signal(&this->cond);
     pthread_mutex_unlock(&this->lock);
+    return true;
+}
+
+void WQ::stats(FILE *out)
+{
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        WQ *queue = groups[i];
+        pthread_mutex_lock(&queue->lock);
+        fprintf(out, "Queue %zu: depth %zu (high water %zu, max %zu), served %lu, shed full %lu, shed delay %lu%s\n",
+                i, queue->msg_queue.size(), queue->high_water, max_depth, queue->served, queue->shed_full,
+                queue->shed_delay, queue->overloaded ? ", overloaded" : "");
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+void WQ::metrics(FILE *out)
+{
+    std::vector<size_t> depth(groups.size());
+    std::vector<uint64_t> served(groups.size()), shed_full(groups.size()), shed_delay(groups.size());
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        pthread_mutex_lock(&groups[i]->lock);
+        depth[i] = groups[i]->msg_queue.size();
+        served[i] = groups[i]->served;
+        shed_full[i] = groups[i]->shed_full;
+        shed_delay[i] = groups[i]->shed_delay;
+        pthread_mutex_unlock(&groups[i]->lock);
+    }
+
+    fprintf(out, "# TYPE proxy_queue_depth gauge\n");
+    for (size_t i = 0; i < groups.size(); i++)
+        fprintf(out, "proxy_queue_depth{group=\"%zu\"} %zu\n", i, depth[i]);
+    fprintf(out, "# TYPE proxy_queue_served_total counter\n");
+    for (size_t i = 0; i < groups.size(); i++)
+        fprintf(out, "proxy_queue_served_total{group=\"%zu\"} %lu\n", i, served[i]);
+    fprintf(out, "# TYPE proxy_queue_shed_total counter\n");
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        fprintf(out, "proxy_queue_shed_total{group=\"%zu\",reason=\"full\"} %lu\n", i, shed_full[i]);
+        fprintf(out, "proxy_queue_shed_total{group=\"%zu\",reason=\"delay\"} %lu\n", i, shed_delay[i]);
+    }
 }
@@ -1,24 +1,71 @@
 #ifndef HTTP_PROXY_SERVER_WQ_H
 #define HTTP_PROXY_SERVER_WQ_H
 
-#include <queue>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <vector>
 #include <pthread.h>
 #include "log.h"
 
+#define WQ_MAX_DEPTH        1024    /* connections waiting per group before new ones are refused */
+#define WQ_MAX_DELAY_MS     1000    /* connections waiting longer are refused, 0 waits forever */
+#define WQ_CODEL_TARGET_MS  5
+#define WQ_CODEL_INTERVAL_MS    100
+
+enum WQPolicy
+{
+    WQ_FIFO,
+    WQ_LIFO,    /* newest first while a queue stands, so some requests still finish in time */
+    WQ_CODEL    /* while a queue stands, connections older than the target are refused */
+};
+
 class WQ
 {
+    struct entry
+    {
+        LogMsg *msg;
+        uint64_t enqueued;
+    };
+
     pthread_cond_t cond;
     pthread_mutex_t lock;
-    std::queue<LogMsg*> *msg_queue;
+    std::deque<entry> msg_queue;
 
-    static WQ *instance;
+    /* a queue stands when it never got below the target during a whole interval */
+    uint64_t interval_end = 0;
+    uint64_t interval_min = UINT64_MAX;
+    bool overloaded = false;
+
+    uint64_t served = 0, shed_full = 0, shed_delay = 0;
+    size_t high_water = 0;
+
+    static std::vector<WQ*> groups;
     WQ();
 
+    uint64_t delay_limit() const;
+
 public:
+    static size_t max_depth;
+    static uint64_t max_delay_ms;
+    static WQPolicy policy;
+
     ~WQ();
-    static WQ* getInstance();
-    void push(LogMsg *msg);
-    LogMsg *pop();
+    /* one queue per worker group, group 0 is the only one unless acceptors are sharded */
+    static void init(int num_groups);
+    static WQ* getInstance(int group = 0);
+    static bool parse_policy(const char *name);
+    static void stats(FILE *out);
+    static void metrics(FILE *out);
+
+    /*
+     * false when the queue is full, the caller refuses the connection. The
+     * connections that waited too long are handed back in expired to be
+     * refused, so they need not wait for a free worker.
+     */
+    bool push(LogMsg *msg, std::vector<LogMsg*> &expired);
+    /* shed is set for a connection that waited too long and is to be refused */
+    LogMsg *pop(bool *shed);
 };
 
 #endif